@@ -21,26 +21,69 @@
 #define TARGET_LINUX
 #endif
 
+//- Frame profiler (F3 / three-finger tap toggles the overlay, F4 dumps it to a file)
+// Compiled out entirely when ENABLE_PROFILER is not defined; debug builds define it unless the build already did
+#if !defined(NDEBUG) && !defined(ENABLE_PROFILER)
+#define ENABLE_PROFILER
+#endif
+
+//- Chrome trace export (frames, routines, transactions and asset loads), written to trace-<date>.json on exit
+// Compiled out entirely when ENABLE_TRACING is not defined
+// #define ENABLE_TRACING
+
+//- Embedded resources: res/ is compiled into the executable from embedded_resources.h (written by "--embed-resources"),
+//   so startup reads no files. Without it, resources come from res/resources.pak or the loose files
+// #define EMBED_RESOURCES
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <list>
+#include <deque>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <string>
 #include <algorithm>
 #include <ctime>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iterator>
+#include <random>
 
 #include <SFML/System.hpp>
 #include <SFML/Audio.hpp>
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
+#include <SFML/Network.hpp>
 
 #ifdef TARGET_WIN
  #define NOMINMAX
-// #include <windows.h>
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+ #include <io.h>
 #endif //_WIN32
 
+#ifndef TARGET_WIN
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef TARGET_LINUX
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#endif
+
 #ifdef TARGET_ANDROID
 #include <android/asset_manager.h>
 #include <android/log.h>
@@ -112,7 +155,10 @@ private:
 
         // Get the method 'getSystemService' and call it
         jmethodID getSystemServiceMethodId = env->GetMethodID(nativeActivity, "getSystemService", "(Ljava/lang/String;)Ljava/lang/Object;");
-        vibrateObject = env->CallObjectMethod(nativeActivityHandle->clazz, getSystemServiceMethodId, vibratorServiceObject);
+        jobject vibrateLocalObject = env->CallObjectMethod(nativeActivityHandle->clazz, getSystemServiceMethodId, vibratorServiceObject);
+        // A global reference, since the haptics device calls it from its own thread
+        vibrateObject = env->NewGlobalRef(vibrateLocalObject);
+        env->DeleteLocalRef(vibrateLocalObject);
 
         // Get the object's class and retrieve the member name
         jclass vibrateClass = env->GetObjectClass(vibrateObject);
@@ -132,17 +178,26 @@ public:
         init();
     }
 
+    // Callable from any thread; other threads are attached on first use and must call detachCurrentThread() when done
     void vibrate(int durationMillis)
     {
+        JNIEnv* threadEnv = nullptr;
+        if (vm->GetEnv((void**) &threadEnv, JNI_VERSION_1_6) == JNI_EDETACHED)
+            vm->AttachCurrentThread(&threadEnv, nullptr);
         jlong durationMillisJlong = durationMillis;
         // Bzzz!
-        env->CallVoidMethod(vibrateObject, vibrateMethod, durationMillisJlong);
+        threadEnv->CallVoidMethod(vibrateObject, vibrateMethod, durationMillisJlong);
+    }
+
+    void detachCurrentThread()
+    {
+        vm->DetachCurrentThread();
     }
 
     void release()
     {
         // Free references
-        env->DeleteLocalRef(vibrateObject);
+        env->DeleteGlobalRef(vibrateObject);
 
         // Detach thread again
         vm->DetachCurrentThread();
@@ -151,9 +206,90 @@ public:
 
 #endif
 
+typedef float (*EasingFunction)(float progress);
+
+namespace Easing
+{
+    inline float linear(float t)
+    {
+        return t;
+    }
+
+    inline float quadIn(float t)
+    {
+        return t * t;
+    }
+
+    inline float quadOut(float t)
+    {
+        return t * (2.f - t);
+    }
+
+    inline float quadInOut(float t)
+    {
+        return t < 0.5f ? 2.f * t * t : -1.f + (4.f - 2.f * t) * t;
+    }
+
+    inline float cubicOut(float t)
+    {
+        float f = t - 1.f;
+        return f * f * f + 1.f;
+    }
+}
+
+template <class T>
+struct Keyframe
+{
+    sf::Time time;
+    T value;
+    // Easing of the segment that ends on this keyframe
+    EasingFunction easing;
+};
+
+template <class T>
+class KeyframeTrack
+{
+private:
+    std::vector<Keyframe<T>> keyframes;
+
+public:
+    KeyframeTrack& add(sf::Time time, T value, EasingFunction easing = Easing::linear)
+    {
+        keyframes.push_back(Keyframe<T> { time, value, easing });
+        return *this;
+    }
+
+    sf::Time getDuration() const
+    {
+        return keyframes.empty() ? sf::Time::Zero : keyframes.back().time;
+    }
+
+    // Samples the track at an absolute time since its start, so the result never
+    //  depends on how many frames were used to get there
+    T evaluate(sf::Time time) const
+    {
+        // An empty track has nothing to animate; hand back a value-initialized property
+        if (keyframes.empty()) return T();
+        if (time <= keyframes.front().time) return keyframes.front().value;
+        for (size_t i = 1; i < keyframes.size(); ++i)
+        {
+            const Keyframe<T>& from = keyframes[i - 1];
+            const Keyframe<T>& to = keyframes[i];
+            if (time < to.time)
+            {
+                float progress = (time - from.time) / (to.time - from.time);
+                return from.value + (to.value - from.value) * to.easing(progress);
+            }
+        }
+        return keyframes.back().value;
+    }
+};
+
 struct Animation
 {
-    virtual void update(sf::Time deltaTime) = 0;
+    // Latches the timeline time the animation was added at, so its first frame is already one delta in
+    virtual void start(sf::Time startTime) = 0;
+    virtual void update(sf::Time currentTime) = 0;
     virtual bool isEnded() = 0;
     virtual ~Animation() = default;
 };
@@ -163,26 +299,19 @@ class GenericAnimation : public Animation
 {
 private:
     bool ended = false;
+    sf::Time startTime;
 
 protected:
-    sf::Time duration;
-    sf::Clock runningTimeClock;
+    KeyframeTrack<T> track;
     std::function<void(T animatedProperty)> onUpdateCallback;
     std::function<void()> onAnimationEndCallback;
 
-    GenericAnimation(sf::Time duration,
-                     std::function<void(T)> onUpdateCallback,
+    GenericAnimation(std::function<void(T)> onUpdateCallback,
                      std::function<void()> onAnimationEndCallback)
     {
-        this->duration = duration;
         this->onUpdateCallback = onUpdateCallback;
         this->onAnimationEndCallback = onAnimationEndCallback;
     }
-    
-    bool isEnded()
-    {
-        return ended;
-    }
 
     virtual void onAnimationEnd()
     {
@@ -192,26 +321,35 @@ protected:
 
 public:
     virtual ~GenericAnimation() = default;
-};
 
-class AlphaAnimation : public GenericAnimation<int>
-{
-private:
-    float targetAlpha;
-    float currentAlpha;
-    float alphaDiff;
+    bool isEnded()
+    {
+        return ended;
+    }
 
-    void setAlpha(float alpha)
+    void start(sf::Time startTime)
     {
-        float sanitizedAlpha;
-        if (alphaDiff > 0.f)
-            sanitizedAlpha = std::min(targetAlpha, alpha);
-        else
-            sanitizedAlpha = std::max(targetAlpha, alpha);
-        this->currentAlpha = sanitizedAlpha;
-        onUpdateCallback(sanitizedAlpha);
+        this->startTime = startTime;
+    }
+
+    void update(sf::Time currentTime)
+    {
+        if (isEnded()) return;
+        sf::Time elapsedTime = currentTime - startTime;
+        if (elapsedTime < track.getDuration())
+        {
+            onUpdateCallback(track.evaluate(elapsedTime));
+        } else {
+            // Always land exactly on the last keyframe, whatever the frame pacing was
+            onUpdateCallback(track.evaluate(track.getDuration()));
+            onAnimationEnd();
+        }
     }
+};
 
+class AlphaAnimation : public GenericAnimation<float>
+{
+private:
     int getSanitizedColorComponent(int component) {
         return std::max(0, std::min(255, component));
     }
@@ -219,30 +357,18 @@ private:
 public:
     AlphaAnimation(sf::Time duration, int startAlpha, int targetAlpha,
                    std::function<void(int)> onUpdateCallback,
-                   std::function<void()> onAnimationEndCallback = {}) :
-                   GenericAnimation(duration, onUpdateCallback, onAnimationEndCallback)
+                   std::function<void()> onAnimationEndCallback = {},
+                   EasingFunction easing = Easing::linear) :
+                   GenericAnimation([onUpdateCallback](float alpha) -> void {
+                       onUpdateCallback((int) std::lround(alpha));
+                   }, onAnimationEndCallback)
     {
-        int startAlphaSafe = getSanitizedColorComponent(startAlpha);
-        int targetAlphaSafe = getSanitizedColorComponent(targetAlpha);
-        this->alphaDiff = targetAlphaSafe - startAlphaSafe;
-        this->targetAlpha = targetAlphaSafe;
-        setAlpha(startAlphaSafe);
+        track.add(sf::Time::Zero, (float) getSanitizedColorComponent(startAlpha))
+             .add(duration, (float) getSanitizedColorComponent(targetAlpha), easing);
+        this->onUpdateCallback(track.evaluate(sf::Time::Zero));
     }
 
     ~AlphaAnimation() = default;
-
-    void update(sf::Time deltaTime)
-    {
-        if (isEnded()) return;
-        if (runningTimeClock.getElapsedTime() <= duration)
-        {
-            float currentAlphaDiff = (deltaTime * (float) alphaDiff) / duration;
-            float newAlpha = currentAlpha + currentAlphaDiff;
-            setAlpha(newAlpha);
-        } else {
-            onAnimationEnd();
-        }
-    }
 };
 
 enum class OffsetAnimationUpdateType
@@ -257,65 +383,33 @@ struct OffsetAnimationUpdate
     sf::Vector2f value;
 };
 
-class OffsetAnimation : public GenericAnimation<OffsetAnimationUpdate>
+class OffsetAnimation : public GenericAnimation<sf::Vector2f>
 {
 private:
-    sf::Vector2f getSafeIncrementalOffset(sf::Vector2f proposedOffset)
+    static std::function<void(sf::Vector2f)> toPositionCallback(std::function<void(OffsetAnimationUpdate)> onUpdateCallback)
     {
-        sf::Vector2f safeOffset;
-        sf::Vector2f availableSpace = targetOffset - cumulatedOffset;
-        if (targetOffset.x > 0.f)
-            safeOffset.x = std::min(availableSpace.x, proposedOffset.x);
-        else
-            safeOffset.x = std::max(availableSpace.x, proposedOffset.x);
-        if (targetOffset.y > 0.f)
-            safeOffset.y = std::min(availableSpace.y, proposedOffset.y);
-        else
-            safeOffset.y = std::max(availableSpace.y, proposedOffset.y);
-        return safeOffset;
+        return [onUpdateCallback](sf::Vector2f position) -> void {
+            onUpdateCallback(OffsetAnimationUpdate {
+                OffsetAnimationUpdateType::SET_POSITION, position
+            });
+        };
     }
 
-protected:
-    sf::Vector2f targetOffset;
-    sf::Vector2f cumulatedOffset;
-
 public:
-    OffsetAnimation(sf::Time duration, 
-                    std::function<void(OffsetAnimationUpdate)> onUpdateCallback,
-                    std::function<void()> onAnimationEndCallback) :
-                    GenericAnimation(duration, onUpdateCallback, onAnimationEndCallback) {}
-
     OffsetAnimation(sf::Time duration,
                     sf::Vector2f startPosition, 
                     sf::Vector2f targetOffset,
                     std::function<void(OffsetAnimationUpdate)> onUpdateCallback,
-                    std::function<void()> onAnimationEndCallback) :
-                    GenericAnimation(duration, onUpdateCallback, onAnimationEndCallback)
+                    std::function<void()> onAnimationEndCallback,
+                    EasingFunction easing = Easing::linear) :
+                    GenericAnimation(toPositionCallback(onUpdateCallback), onAnimationEndCallback)
     {
-        onUpdateCallback(OffsetAnimationUpdate {
-            OffsetAnimationUpdateType::SET_POSITION, startPosition
-        });
-        this->targetOffset = targetOffset;
+        track.add(sf::Time::Zero, startPosition)
+             .add(duration, startPosition + targetOffset, easing);
+        this->onUpdateCallback(startPosition);
     }
 
     virtual ~OffsetAnimation() = default;
-
-    void update(sf::Time deltaTime)
-    {
-        if (isEnded()) return;
-        if (runningTimeClock.getElapsedTime() <= duration)
-        {
-            float offsetX = (deltaTime * targetOffset.x) / duration;
-            float offsetY = (deltaTime * targetOffset.y) / duration;
-            sf::Vector2f safeIncrementalOffset = getSafeIncrementalOffset(sf::Vector2f(offsetX, offsetY));
-            this->cumulatedOffset += safeIncrementalOffset;
-            onUpdateCallback(OffsetAnimationUpdate {
-                OffsetAnimationUpdateType::MOVE, safeIncrementalOffset
-            });
-        } else {
-            onAnimationEnd();
-        }
-    }
 };
 
 enum VerticalOffsetAnimationType
@@ -326,6 +420,21 @@ enum VerticalOffsetAnimationType
 
 class VerticalOffsetAnimation : public OffsetAnimation
 {
+private:
+    static sf::Vector2f getStartPosition(sf::Vector2f originPosition, VerticalOffsetAnimationType type, float animatedSubjectHeight)
+    {
+        if (type == VerticalOffsetAnimationType::TOP_TO_ORIGIN)
+            return sf::Vector2f(originPosition.x, originPosition.y - animatedSubjectHeight);
+        return originPosition;
+    }
+
+    static sf::Vector2f getTargetOffset(VerticalOffsetAnimationType type, float animatedSubjectHeight)
+    {
+        if (type == VerticalOffsetAnimationType::TOP_TO_ORIGIN)
+            return sf::Vector2f(0, animatedSubjectHeight);
+        return sf::Vector2f(0, -animatedSubjectHeight);
+    }
+
 public:
     VerticalOffsetAnimation(
             sf::Time duration,
@@ -333,763 +442,5333 @@ public:
             VerticalOffsetAnimationType type,
             float animatedSubjectHeight,
             std::function<void(OffsetAnimationUpdate)> onUpdateCallback,
-            std::function<void()> onAnimationEndCallback
-    ) : OffsetAnimation(duration, onUpdateCallback, onAnimationEndCallback)
-    {
-        switch (type) {
-            case VerticalOffsetAnimationType::TOP_TO_ORIGIN:
-                onUpdateCallback({
-                    OffsetAnimationUpdateType::SET_POSITION,
-                    sf::Vector2f(originPosition.x, originPosition.y - animatedSubjectHeight)
-                });
-                this->targetOffset = sf::Vector2f(0, animatedSubjectHeight);
-                break;
-            case VerticalOffsetAnimationType::ORIGIN_TO_TOP:
-                onUpdateCallback({
-                    OffsetAnimationUpdateType::SET_POSITION,
-                    originPosition
-                });
-                this->targetOffset = sf::Vector2f(0, -animatedSubjectHeight);
-                break;
-        }
-    }
+            std::function<void()> onAnimationEndCallback,
+            EasingFunction easing = Easing::linear
+    ) : OffsetAnimation(duration,
+                        getStartPosition(originPosition, type, animatedSubjectHeight),
+                        getTargetOffset(type, animatedSubjectHeight),
+                        onUpdateCallback, onAnimationEndCallback, easing) {}
 
     ~VerticalOffsetAnimation() = default;
 };
 
-class ActionTimer
+class AnimationTimeline
 {
 private:
-    sf::Clock clock;
-    sf::Time targetDuration;
-    std::function<void()> callback;
+    struct Entry
+    {
+        Animation* animation;
+        // Animations on the same channel move the same object, so they can't overlap
+        int channel;
+        // Blocking animations hold back input until they end (e.g. they change the screen state)
+        bool blocking;
+    };
+
+    // Advanced by frame deltas; sf::Time is integral so the sum never drifts
+    sf::Time currentTime;
+    std::list<Entry> animations;
 
 public:
-    ActionTimer(sf::Time targetDuration, std::function<void()> callback)
+    ~AnimationTimeline()
     {
-        this->targetDuration = targetDuration;
-        this->callback = callback;
+        clear();
     }
 
-    void update()
+    void add(Animation* animation, int channel = -1, bool blocking = true)
     {
-        sf::Time elapsedTime = clock.getElapsedTime();
-        if (elapsedTime <= targetDuration) return;
-        callback();
+        animation->start(currentTime);
+        animations.push_back(Entry { animation, channel, blocking });
     }
-};
 
-void handleOffsetAnimationUpdate(sf::Sprite* sprite, OffsetAnimationUpdate* update)
-{
-    switch (update->type)
+    bool empty() const
     {
-        case OffsetAnimationUpdateType::SET_POSITION:
-            sprite->setPosition(update->value);
-            break;
-        case OffsetAnimationUpdateType::MOVE:
-            sprite->move(update->value);
-            break;
+        return animations.empty();
     }
-}
-
-class Atm
-{
-private:
-    //- Title and Version
-    std::string title = "ATM Software RELOADED";
-    std::string ver = "1.1";
-
-    //- Screen Size
-    const int CANVAS_WIDTH = 960, CANVAS_HEIGHT = 620;
-    sf::Vector2u currentWindowSize;
-
-    //- States
-    bool cardVisible = true, cashLargeVisible = false, cashSmallVisible = false, receiptVisible = false;
-    unsigned short int scrState = 1;
-    unsigned short int pin = 0; unsigned short int pinCount = 0; unsigned short int pinRetry = 0;
-    int amount = 0; unsigned short int amountCount = 0;
-    bool blocked = false;
-    bool accountSuspendedFlag = false;
-    bool windowHasFocus = true;
 
-    //- User Data Structure
-    struct User
+    bool isChannelBusy(int channel) const
     {
-        std::string iban;
-        std::string lastName;
-        std::string firstName;
-        unsigned short int pin;
-        unsigned long long int balance;
-    };
-
-    //- General
-    sf::View view;
-    sf::VideoMode screen;
-    sf::RenderWindow window;
-    sf::Event event;
-    sf::Font font;
-    sf::Time elapsed;
-
-    //- Textures and Sprites
-    sf::Texture backgroundTexture;             sf::Sprite backgroundSprite;
+        for (const Entry& entry : animations)
+            if (entry.channel == channel) return true;
+        return false;
+    }
 
-    sf::Texture cardTexture;                   sf::Sprite cardSprite;
-    sf::Vector2f cardSpritePosition = sf::Vector2f(740, 198);
-    sf::RectangleShape cardMask;
+    bool hasBlockingAnimations() const
+    {
+        for (const Entry& entry : animations)
+            if (entry.blocking) return true;
+        return false;
+    }
 
-    sf::Texture cashLargeTexture;              sf::Sprite cashLargeSprite;
-    sf::Vector2f cashLargeSpritePosition = sf::Vector2f(90, 370);
-    sf::RectangleShape cashLargeMask;
+    sf::Time getCurrentTime() const
+    {
+        return currentTime;
+    }
 
-    sf::Texture cashSmallTexture;              sf::Sprite cashSmallSprite;
-    sf::Vector2f cashSmallSpritePosition = sf::Vector2f(695, 463);
-    sf::RectangleShape cashSmallMask;
+    // Evaluates every active track at the same timestamp and cleans up the ended ones
+    void advance(sf::Time deltaTime)
+    {
+        currentTime += deltaTime;
+        for (auto iterator = animations.begin(); iterator != animations.end();)
+        {
+            Animation* animation = iterator->animation;
+            animation->update(currentTime);
+            if (animation->isEnded())
+            {
+                delete animation;
+                iterator = animations.erase(iterator);
+            }
+            else
+                iterator++;
+        }
+    }
 
-    sf::Texture receiptTexture;                sf::Sprite receiptSprite;
-    sf::Vector2f receiptSpritePosition = sf::Vector2f(740, 54);
-    sf::RectangleShape receiptMask;
+    void clear()
+    {
+        for (Entry& entry : animations)
+            delete entry.animation;
+        animations.clear();
+    }
+};
 
-    //- Sound Buffers and Sounds
-    sf::SoundBuffer cardSndBuf;                sf::Sound cardSnd;
-    sf::SoundBuffer menuSndBuf;                sf::Sound menuSnd;
-    sf::SoundBuffer clickSndBuf;               sf::Sound clickSnd;
-    sf::SoundBuffer keySndBuf;                 sf::Sound keySnd;
-    sf::SoundBuffer cashSndBuf;                sf::Sound cashSnd;
-    sf::SoundBuffer printReceiptSndBuf;        sf::Sound printReceiptSnd;
+class CursorRipple : public sf::Drawable
+{
+private:
+    struct Ripple
+    {
+        sf::CircleShape circle;
+        sf::Time startTime;
+        bool active = false;
+    };
 
-    //- Processing Time
-    sf::Time processingTime = sf::seconds(2);
+    // One slot per finger; a new tap with the same finger restarts its ripple in place
+    static const int MAX_RIPPLES = 5;
+    Ripple ripples[MAX_RIPPLES];
+    KeyframeTrack<float> alphaTrack;
+    sf::Color color;
 
-    //- Text
-    sf::Text scrClock;
-    sf::Text usernameScr;
-    sf::Text ibanScr;
-    sf::Text L1Txt;
-    sf::Text R1Txt;
-    sf::Text R3Txt;
-    sf::Text dialog;
-    sf::Text liveTxt;
+    void setAlpha(Ripple& ripple, float alpha)
+    {
+        sf::Color fillColor = color;
+        fillColor.a = (sf::Uint8) std::lround(alpha);
+        ripple.circle.setFillColor(fillColor);
+    }
 
-    //- Shapes
-    sf::RectangleShape pinBorderShape;
-    sf::RectangleShape amountBorderShape;
+    virtual void draw(sf::RenderTarget& target, sf::RenderStates states) const
+    {
+        for (const Ripple& ripple : ripples)
+            if (ripple.active) target.draw(ripple.circle, states);
+    }
 
-    //- Users
-    std::vector<User> users;
-    User* user;
+public:
+    CursorRipple(float radius, sf::Color color, sf::Time fadeOutTime, int startAlpha = 127)
+    {
+        this->color = color;
+        alphaTrack.add(sf::Time::Zero, (float) startAlpha)
+                  .add(fadeOutTime, 0.f);
+        for (Ripple& ripple : ripples)
+        {
+            ripple.circle.setRadius(radius);
+            ripple.circle.setOrigin(radius, radius);
+            setAlpha(ripple, 0.f);
+        }
+    }
 
-    //- Text files
-    const std::string databasePath = "database/database.txt";
-    std::stringstream database;
-    std::ofstream log;
+    void trigger(sf::Vector2f position, sf::Time currentTime, unsigned int finger = 0)
+    {
+        Ripple& ripple = ripples[finger % MAX_RIPPLES];
+        ripple.circle.setPosition(position);
+        ripple.startTime = currentTime;
+        ripple.active = true;
+        setAlpha(ripple, alphaTrack.evaluate(sf::Time::Zero));
+    }
 
-    //- Out String Stream
-    std::ostringstream oss;
+    void update(sf::Time currentTime)
+    {
+        for (Ripple& ripple : ripples)
+        {
+            if (!ripple.active) continue;
+            sf::Time elapsedTime = currentTime - ripple.startTime;
+            setAlpha(ripple, alphaTrack.evaluate(elapsedTime));
+            if (elapsedTime >= alphaTrack.getDuration())
+                ripple.active = false;
+        }
+    }
 
-    //- Screen Info Strings
-    std::ostringstream usernameScrStr;
-    std::ostringstream ibanScrStr;
-    std::ostringstream convert;
-    std::ostringstream balance;
+    bool isActive() const
+    {
+        return getActiveCount() > 0;
+    }
 
-    //- Chat arrays for live text
-    std::string pinLiveTxt = "****"; std::string amountLiveTxt = "";
+    unsigned int getActiveCount() const
+    {
+        unsigned int activeCount = 0;
+        for (const Ripple& ripple : ripples)
+            if (ripple.active) activeCount++;
+        return activeCount;
+    }
+};
 
-    //- Outstanding Click / Touch Event
-    sf::Vector2i* outstandIngInteractionEvent;
+// A read-only view of a resource's bytes; stays valid for as long as the archive it came from
+struct ResourceView
+{
+    const char* data = nullptr;
+    size_t size = 0;
+};
 
-    //- Cursor
-    const int CURSOR_CIRCLE_RADIUS = 16;
-    sf::CircleShape cursorCircle = sf::CircleShape(CURSOR_CIRCLE_RADIUS);
-    sf::Color cursorCircleIdleColor = sf::Color(255, 0, 0, 0);
+// A read-only memory mapping of a whole file
+class MappedFile
+{
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef TARGET_WIN
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE fileMapping = nullptr;
+#else
+    int fileDescriptor = -1;
+#endif
 
-    //- Action Timer
-    ActionTimer* actionTimer;
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-    //- Animations
+    ~MappedFile()
+    {
+        close();
+    }
 
-    std::list<Animation*> runningAnimations;
-    Animation* cursorAnimation = nullptr;
-    // this is different than the card sound time because the end click is not at the end of the sound
-    sf::Time cardAnimationTime = sf::milliseconds(1002);
-    sf::Time cursorFadeOutAnimationTime = sf::seconds(1.5);
+    bool open(const std::string& path)
+    {
+        close();
+#ifdef TARGET_WIN
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER fileSize;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        {
+            close();
+            return false;
+        }
+        fileMapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (fileMapping != nullptr)
+            data = (const char*) MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+        size = (size_t) fileSize.QuadPart;
+#else
+        fileDescriptor = ::open(path.c_str(), O_RDONLY);
+        struct stat fileStat;
+        if (fileDescriptor < 0 || fstat(fileDescriptor, &fileStat) != 0 || fileStat.st_size == 0)
+        {
+            close();
+            return false;
+        }
+        void* address = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (address != MAP_FAILED)
+            data = (const char*) address;
+        size = fileStat.st_size;
+#endif
+        if (data == nullptr)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
 
-    //- Frame Delta Clock
-    sf::Clock frameDeltaClock;
+    void close()
+    {
+#ifdef TARGET_WIN
+        if (data != nullptr)
+            UnmapViewOfFile(data);
+        if (fileMapping != nullptr)
+            CloseHandle(fileMapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        fileMapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data != nullptr)
+            munmap((void*) data, size);
+        if (fileDescriptor >= 0)
+            ::close(fileDescriptor);
+        fileDescriptor = -1;
+#endif
+        data = nullptr;
+        size = 0;
+    }
 
-    //- Routine Action Codes
-    enum RoutineCode {
-        CARD_IN = 1,
-        CARD_OUT = 2,
-        KEY_SOUND = 3,
-        MENU_SOUND = 4,
-        CASH_LARGE_OUT = 5,
-        CASH_SMALL_IN = 6,
-        RECEIPT_OUT = 7
+    const char* getData() const
+    {
+        return data;
+    }
+
+    size_t getSize() const
+    {
+        return size;
+    }
+};
+
+// One entry of the generated embedded_resources.h
+struct EmbeddedResource
+{
+    const char* name;
+    const unsigned char* data;
+    size_t size;
+};
+
+#ifdef EMBED_RESOURCES
+#include "embedded_resources.h"
+#endif
+
+// All resources are packed into one file (magic, entry count, a table of contents and 16 byte aligned entries)
+//  that is mapped once, so loaders read straight from the mapping through loadFromMemory/openFromMemory.
+// The same table can instead point at resources embedded in the executable. Without either, the loose files
+//  under the resource directory are read into memory on first use.
+class ResourceArchive
+{
+private:
+    static const size_t NAME_LENGTH = 48;
+    static const size_t ALIGNMENT = 16;
+
+    struct Header
+    {
+        char magic[8];
+        sf::Uint32 entryCount;
+        sf::Uint32 reserved;
     };
 
-    //- Vibration Length
-    enum VibrationDuration {
-        SHORT = 20,
-        MEDIUM = 40
+    struct TocEntry
+    {
+        char name[NAME_LENGTH];
+        sf::Uint64 offset;
+        sf::Uint64 size;
     };
 
+    static const char* getMagic()
+    {
+        return "ATMPAK01";
+    }
+
+    const char* mapping = nullptr;
+    size_t mappingSize = 0;
 #ifdef TARGET_ANDROID
-    AndroidGlue androidGlue;
+    AAsset* asset = nullptr;
+#else
+    MappedFile file;
 #endif
+    std::map<std::string, ResourceView> entries;
+    bool hasTable = false;
 
-    void initWin()
+    std::string looseRoot;
+    std::map<std::string, std::vector<char>> looseFiles;
+    std::mutex looseFilesMutex;
+
+    bool map(const std::string& path)
     {
-#ifdef TARGET_ANDROID // We support letterbox mode on Android devices
-        screen = sf::VideoMode(sf::VideoMode::getDesktopMode());
-        view.setSize(CANVAS_WIDTH, CANVAS_HEIGHT);
-        view.setCenter(view.getSize().x / 2, view.getSize().y / 2);
-        view = getLetterboxView(view, screen.width, screen.height);
-        window.create(screen, "");
-        window.setView(view);
+#ifdef TARGET_ANDROID
+        // Stored uncompressed in the APK (see build.gradle), so the asset buffer is a mapping of the APK itself
+        asset = AAssetManager_open(sf::getNativeActivity()->assetManager, path.c_str(), AASSET_MODE_BUFFER);
+        if (asset == nullptr)
+            return false;
+        mapping = (const char*) AAsset_getBuffer(asset);
+        mappingSize = AAsset_getLength(asset);
 #else
-        screen = sf::VideoMode(CANVAS_WIDTH, CANVAS_HEIGHT);
-        window.create(screen, programTitle(), sf::Style::Titlebar | sf::Style::Close);
+        if (!file.open(path))
+            return false;
+        mapping = file.getData();
+        mappingSize = file.getSize();
 #endif
-        window.setFramerateLimit(60);
-        window.setKeyRepeatEnabled(false);
-        currentWindowSize = window.getSize();
+        return mapping != nullptr;
     }
 
-    // https://github.com/SFML/SFML/wiki/Source:-Letterbox-effect-using-a-view
-    sf::View getLetterboxView(sf::View view, int windowWidth, int windowHeight) {
-
-        // Compares the aspect ratio of the window to the aspect ratio of the view,
-        // and sets the view's viewport accordingly in order to achieve a letterbox effect.
-        // A new view (with a new viewport set) is returned.
-
-        float windowRatio = windowWidth / (float) windowHeight;
-        float viewRatio = view.getSize().x / (float) view.getSize().y;
-        float sizeX = 1;
-        float sizeY = 1;
-        float posX = 0;
-        float posY = 0;
-
-        bool horizontalSpacing = true;
-        if (windowRatio < viewRatio)
-            horizontalSpacing = false;
+    bool readLooseFile(const std::string& path, std::vector<char>& content)
+    {
+#ifdef TARGET_ANDROID
+        AAsset* looseAsset = AAssetManager_open(sf::getNativeActivity()->assetManager, path.c_str(), AASSET_MODE_BUFFER);
+        if (looseAsset == nullptr)
+            return false;
+        content.resize(AAsset_getLength(looseAsset));
+        bool ok = AAsset_read(looseAsset, content.data(), content.size()) == (int) content.size();
+        AAsset_close(looseAsset);
+        return ok;
+#else
+        std::ifstream fileStream(path.c_str(), std::ios::binary);
+        if (!fileStream.is_open())
+            return false;
+        content.assign(std::istreambuf_iterator<char>(fileStream), std::istreambuf_iterator<char>());
+        return true;
+#endif
+    }
 
-        // If horizontalSpacing is true, the black bars will appear on the left and right side.
-        // Otherwise, the black bars will appear on the top and bottom.
+public:
+    ~ResourceArchive()
+    {
+        close();
+    }
 
-        if (horizontalSpacing)
+    bool open(const std::string& archivePath, const std::string& looseRoot)
+    {
+        close();
+        this->looseRoot = looseRoot;
+        if (!map(archivePath))
         {
-            sizeX = viewRatio / windowRatio;
-            posX = (1 - sizeX) / 2.f;
+            close();
+            return false;
         }
-        else
+        const Header* header = (const Header*) mapping;
+        if (mappingSize < sizeof(Header) || std::memcmp(header->magic, getMagic(), sizeof(header->magic)) != 0
+            || mappingSize < sizeof(Header) + (size_t) header->entryCount * sizeof(TocEntry))
         {
-            sizeY = windowRatio / viewRatio;
-            posY = (1 - sizeY) / 2.f;
+            close();
+            return false;
         }
-        view.setViewport(sf::FloatRect(posX, posY, sizeX, sizeY));
-        return view;
+        const TocEntry* toc = (const TocEntry*) (mapping + sizeof(Header));
+        for (sf::Uint32 i = 0; i < header->entryCount; ++i)
+        {
+            const TocEntry& entry = toc[i];
+            if (entry.offset > mappingSize || entry.size > mappingSize - entry.offset)
+            {
+                close();
+                return false;
+            }
+            std::string name(entry.name, std::find(entry.name, entry.name + NAME_LENGTH, '\0'));
+            entries[name] = ResourceView { mapping + entry.offset, (size_t) entry.size };
+        }
+        hasTable = true;
+        return true;
+    }
+
+    void openEmbedded(const EmbeddedResource* resources, size_t count)
+    {
+        close();
+        for (size_t i = 0; i < count; ++i)
+            entries[resources[i].name] = ResourceView { (const char*) resources[i].data, resources[i].size };
+        hasTable = true;
     }
 
-    sf::Vector2i* getScaledPointerCoordinates(int originalX, int originalY)
+    void close()
     {
+        entries.clear();
+        hasTable = false;
 #ifdef TARGET_ANDROID
-        int left = view.getViewport().left * currentWindowSize.x;
-        int top = view.getViewport().top * currentWindowSize.y;
-        float scaleX = (currentWindowSize.x - 2 * left) / (float) CANVAS_WIDTH;
-        float scaleY = (currentWindowSize.y - 2 * top) / (float) CANVAS_HEIGHT;
-        int processedX = (originalX - left) / scaleX;
-        int processedY = (originalY - top) / scaleY;
-        return new sf::Vector2i(processedX, processedY);
+        if (asset != nullptr)
+            AAsset_close(asset);
+        asset = nullptr;
 #else
-        return new sf::Vector2i(originalX, originalY);
+        file.close();
 #endif
+        mapping = nullptr;
+        mappingSize = 0;
     }
 
-    void loadDatabase()
+    bool isMapped() const
     {
-#ifdef TARGET_ANDROID
-        // In order to properly read asset files in android, we use the Asset NDK Module
-        // Links:
-        // https://developer.android.com/ndk/reference/group/asset
-        // https://stackoverflow.com/a/33957074
-        if (androidGlue.assetManager != nullptr)
-        {
-            // Open your file
-            std::string filePath = res(databasePath);
-            AAsset* file = AAssetManager_open(androidGlue.assetManager, filePath.c_str(), AASSET_MODE_BUFFER);
-            // Get the file length
-            size_t fileLength = AAsset_getLength(file);
-
-            // Allocate memory to read your file
-            char* fileContent = new char[fileLength + 1];
-
-            // Read your file
-            AAsset_read(file, fileContent, fileLength);
-            // For safety you can add a 0 terminating character at the end of your file ...
-            fileContent[fileLength] = '\0';
-
-            // Do whatever you want with the content of the file
-            database << fileContent;
+        return mapping != nullptr;
+    }
 
-            // Free the memory you allocated earlier
-            delete [] fileContent;
+    // Safe to call from the asset loader threads
+    ResourceView get(const std::string& name)
+    {
+        if (hasTable)
+        {
+            auto entry = entries.find(name);
+            return entry == entries.end() ? ResourceView() : entry->second;
         }
-#else
-        std::ifstream fileStream(res(databasePath));
-        if (fileStream.is_open())
+        std::lock_guard<std::mutex> lock(looseFilesMutex);
+        auto looseFile = looseFiles.find(name);
+        if (looseFile == looseFiles.end())
         {
-            database << fileStream.rdbuf();
-            fileStream.close();
+            std::vector<char> content;
+            if (!readLooseFile(looseRoot + name, content))
+                return ResourceView();
+            looseFile = looseFiles.emplace(name, std::move(content)).first;
         }
-#endif
+        return ResourceView { looseFile->second.data(), looseFile->second.size() };
+    }
 
-        if (database.tellp() > std::streampos(0))
+    // Build step: packs the given files (relative to root) into one archive; missing files are skipped
+    static bool pack(const std::string& root, const std::vector<std::string>& names, const std::string& outputPath)
+    {
+        std::vector<std::string> packedNames;
+        std::vector<std::vector<char>> contents;
+        for (const std::string& name : names)
         {
-            oss << getTimeCli() << "User database loaded"; logMsg(oss.str());
-            loadClients();
+            std::ifstream fileStream((root + name).c_str(), std::ios::binary);
+            if (!fileStream.is_open() || name.size() >= NAME_LENGTH)
+            {
+                std::cerr << "Skipping \"" << name << "\"" << std::endl;
+                continue;
+            }
+            packedNames.push_back(name);
+            contents.push_back(std::vector<char>(std::istreambuf_iterator<char>(fileStream), std::istreambuf_iterator<char>()));
         }
-        else
+
+        Header header;
+        std::memcpy(header.magic, getMagic(), sizeof(header.magic));
+        header.entryCount = (sf::Uint32) packedNames.size();
+        header.reserved = 0;
+        std::vector<TocEntry> toc(packedNames.size());
+        sf::Uint64 offset = sizeof(Header) + toc.size() * sizeof(TocEntry);
+        for (size_t i = 0; i < toc.size(); ++i)
         {
-            oss << getTimeCli() << "User database not found"; logMsg(oss.str());
-            loadPlaceholderClient();
+            offset = (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+            std::memset(toc[i].name, 0, NAME_LENGTH);
+            std::memcpy(toc[i].name, packedNames[i].c_str(), packedNames[i].size());
+            toc[i].offset = offset;
+            toc[i].size = contents[i].size();
+            offset += contents[i].size();
+        }
+
+        std::ofstream archive(outputPath.c_str(), std::ios::binary | std::ios::trunc);
+        if (!archive.is_open())
+            return false;
+        archive.write((const char*) &header, sizeof(Header));
+        archive.write((const char*) toc.data(), toc.size() * sizeof(TocEntry));
+        for (size_t i = 0; i < toc.size(); ++i)
+        {
+            while ((sf::Uint64) archive.tellp() < toc[i].offset)
+                archive.put('\0');
+            archive.write(contents[i].data(), contents[i].size());
         }
+        return archive.good();
     }
 
-    void init()
+    // Build step: writes the given files (relative to root) as constexpr byte arrays for EMBED_RESOURCES
+    static bool embed(const std::string& root, const std::vector<std::string>& names, const std::string& outputPath)
     {
-        //- Create new log file
-#ifndef TARGET_ANDROID
-        log.open(getLogFileName().c_str());
-#endif
-
-        //- Init States
-        initStates();
+        std::ofstream header(outputPath.c_str(), std::ios::trunc);
+        if (!header.is_open())
+            return false;
+        header << "// Generated by --embed-resources, do not edit\n\n";
+        std::vector<std::string> embeddedNames;
+        for (const std::string& name : names)
+        {
+            std::ifstream fileStream((root + name).c_str(), std::ios::binary);
+            if (!fileStream.is_open())
+            {
+                std::cerr << "Skipping \"" << name << "\"" << std::endl;
+                continue;
+            }
+            std::vector<char> content((std::istreambuf_iterator<char>(fileStream)), std::istreambuf_iterator<char>());
+            header << "alignas(" << ALIGNMENT << ") static constexpr unsigned char EMBEDDED_RESOURCE_" << embeddedNames.size() << "[] = {";
+            for (size_t i = 0; i < content.size(); ++i)
+                header << (i % 32 == 0 ? "\n    " : "") << (unsigned int) (unsigned char) content[i] << ",";
+            // Empty files still need a non-empty array
+            if (content.empty())
+                header << "0";
+            header << "\n};\nstatic const size_t EMBEDDED_RESOURCE_" << embeddedNames.size() << "_SIZE = " << content.size() << ";\n\n";
+            embeddedNames.push_back(name);
+        }
+        header << "static const EmbeddedResource EMBEDDED_RESOURCES[] = {\n";
+        for (size_t i = 0; i < embeddedNames.size(); ++i)
+            header << "    { \"" << embeddedNames[i] << "\", EMBEDDED_RESOURCE_" << i << ", EMBEDDED_RESOURCE_" << i << "_SIZE },\n";
+        header << "};\nstatic const size_t EMBEDDED_RESOURCE_COUNT = " << embeddedNames.size() << ";\n";
+        return header.good();
+    }
+};
 
-        //- Initialize Window
-        initWin();
+// Raw RGBA handed to the texture atlas; owned by a decoded sf::Image or by a mapped cache entry
+struct ImagePixels
+{
+    const sf::Uint8* pixels = nullptr;
+    sf::Vector2u size;
+};
 
-        //- Initialize CLI
-        system("color 0A");
-        oss << "================================================================================"; logMsg(oss.str());
-        oss << "==================================ATM Software=================================="; logMsg(oss.str());
-        oss << "================================================================================"; logMsg(oss.str());
-        oss << getTimeCli() << "ATM is now powered on"; logMsg(oss.str());
+// Decoded RGBA of each image is stored on disk under the hash of its source file, so warm starts map the pixels
+//  instead of decoding the PNG/JPEG again; a changed source has a new hash and is simply decoded and stored again
+class DecodedImageCache
+{
+private:
+    struct Header
+    {
+        char magic[8];
+        sf::Uint64 sourceHash;
+        sf::Uint32 width;
+        sf::Uint32 height;
+        sf::Uint64 reserved;
+    };
 
-        //- Load database
-        loadDatabase();
+    static const char* getMagic()
+    {
+        return "ATMRGBA1";
+    }
 
-        //- Load fonts
-        if (font.loadFromFile(res("courier_new.ttf")))
-        {
-            oss << getTimeCli() << "Font loaded"; logMsg(oss.str());
-        }
-        else
+public:
+    // FNV-1a
+    static sf::Uint64 hash(const ResourceView& view)
+    {
+        sf::Uint64 result = 14695981039346656037ULL;
+        for (size_t i = 0; i < view.size; ++i)
         {
-            oss << getTimeCli() << "Font not found"; logMsg(oss.str());
-            window.close();
+            result ^= (unsigned char) view.data[i];
+            result *= 1099511628211ULL;
         }
+        return result;
+    }
+
+    static std::string getEntryPath(const std::string& directory, sf::Uint64 sourceHash)
+    {
+        std::ostringstream path;
+        path << directory << "texture-cache-" << std::hex << std::setw(16) << std::setfill('0') << sourceHash << ".rgba";
+        return path.str();
+    }
 
-        //- Load textures
-        if (!backgroundTexture.loadFromFile(res("backgnd_texture.png")) ||
-            !cardTexture.loadFromFile(res("card_texture.png")) ||
-            !cashLargeTexture.loadFromFile(res("cash_large_texture.jpg")) ||
-            !cashSmallTexture.loadFromFile(res("cash_small_texture.jpg")) ||
-            !receiptTexture.loadFromFile(res("receipt_texture.jpg")))
+    // Maps the entry; false when it is missing or does not belong to this source
+    static bool load(MappedFile& entry, const std::string& path, sf::Uint64 sourceHash, ImagePixels& pixels)
+    {
+        if (!entry.open(path))
+            return false;
+        const Header* header = (const Header*) entry.getData();
+        if (entry.getSize() < sizeof(Header) || std::memcmp(header->magic, getMagic(), sizeof(header->magic)) != 0
+            || header->sourceHash != sourceHash || entry.getSize() != sizeof(Header) + (size_t) header->width * header->height * 4)
         {
-            oss << getTimeCli() << "One or more textures not found"; logMsg(oss.str());
-            window.close();
+            entry.close();
+            return false;
         }
-        else
+        pixels.pixels = (const sf::Uint8*) (entry.getData() + sizeof(Header));
+        pixels.size = sf::Vector2u(header->width, header->height);
+        return true;
+    }
+
+    // Written to a temporary file first, so an interrupted write never leaves a truncated entry behind
+    static bool store(const std::string& path, sf::Uint64 sourceHash, const sf::Image& image)
+    {
+        Header header;
+        std::memcpy(header.magic, getMagic(), sizeof(header.magic));
+        header.sourceHash = sourceHash;
+        header.width = image.getSize().x;
+        header.height = image.getSize().y;
+        header.reserved = 0;
+        std::string temporaryPath = path + ".tmp";
         {
-            oss << getTimeCli() << "Textures loaded"; logMsg(oss.str());
+            std::ofstream entry(temporaryPath.c_str(), std::ios::binary | std::ios::trunc);
+            if (!entry.is_open())
+                return false;
+            entry.write((const char*) &header, sizeof(Header));
+            entry.write((const char*) image.getPixelsPtr(), (size_t) header.width * header.height * 4);
+            if (!entry.good())
+                return false;
         }
+        std::remove(path.c_str());
+        return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+    }
+};
 
-        //- Load sounds in the sound buffer
-        std::vector<sf::SoundBuffer*> soundPtr = { &cardSndBuf, &menuSndBuf, &clickSndBuf, &keySndBuf, &cashSndBuf, &printReceiptSndBuf };
-        std::vector<std::string> soundArr = {
-                res("card_snd.wav"),
-                res("menu_snd.wav"),
-                res("click_snd.wav"),
-                res("key_snd.wav"),
-                res("cash_snd.wav"),
-                res("print_receipt_snd.wav")
-        };
-        bool soundOk = true;
-        for (int i = 0; i < soundPtr.size(); ++i)
+// Packs several images into one texture so everything using them can be drawn in a single batch
+class TextureAtlas
+{
+private:
+    static const unsigned int PADDING = 2;
+    sf::Texture texture;
+    std::vector<sf::IntRect> regions;
+
+public:
+    // Rectangles are placed left to right on shelves, in the order they are given
+    static std::vector<sf::IntRect> pack(const std::vector<sf::Vector2u>& sizes, unsigned int maxWidth, sf::Vector2u& atlasSize)
+    {
+        std::vector<sf::IntRect> packedRegions;
+        unsigned int x = 0, y = 0, shelfHeight = 0, width = 0;
+        for (const sf::Vector2u& size : sizes)
         {
-            if (!soundPtr[i]->loadFromFile(soundArr[i]))
+            if (x > 0 && x + size.x > maxWidth)
             {
-                oss << getTimeCli() << "\"" << soundArr[i] << "\" not found"; logMsg(oss.str());
-                window.close();
-                soundOk = false;
-                break;
+                x = 0;
+                y += shelfHeight + PADDING;
+                shelfHeight = 0;
             }
+            packedRegions.push_back(sf::IntRect(x, y, size.x, size.y));
+            x += size.x + PADDING;
+            width = std::max(width, x);
+            shelfHeight = std::max(shelfHeight, size.y);
         }
-        if(soundOk)
-            oss << getTimeCli() << "Sounds loaded"; logMsg(oss.str());
-
-        //- Ready to go
-        oss << getTimeCli() << "ATM is ready to use"; logMsg(oss.str());
-
-        //- Assign font to text
-        scrClock.setFont(font);
-        usernameScr.setFont(font);
-        ibanScr.setFont(font);
-        L1Txt.setFont(font);
-        R1Txt.setFont(font);
-        R3Txt.setFont(font);
-        dialog.setFont(font);
-        liveTxt.setFont(font);
+        atlasSize = sf::Vector2u(width, y + shelfHeight);
+        return packedRegions;
+    }
 
-        //- Assign texture to sprite
-        backgroundSprite.setTexture(backgroundTexture);
+    bool build(const std::vector<ImagePixels>& images, unsigned int maxWidth)
+    {
+        std::vector<sf::Vector2u> sizes;
+        for (const ImagePixels& image : images)
+            sizes.push_back(image.size);
+        sf::Vector2u atlasSize;
+        regions = pack(sizes, maxWidth, atlasSize);
+        if (!texture.create(atlasSize.x, atlasSize.y))
+            return false;
+        for (size_t i = 0; i < images.size(); ++i)
+            texture.update(images[i].pixels, images[i].size.x, images[i].size.y, regions[i].left, regions[i].top);
+        return true;
+    }
 
-        sf::IntRect ir;
+    const sf::Texture& getTexture() const
+    {
+        return texture;
+    }
 
-        ir = sf::IntRect(716, 0, 197, 198);
-        cardSprite.setTexture(cardTexture);                             cardSprite.setPosition(cardSpritePosition);
-        cardMask.setSize(sf::Vector2f(ir.width, ir.height));            cardMask.setPosition(ir.left, ir.top);
-        cardMask.setTexture(&backgroundTexture);                        cardMask.setTextureRect(ir);
+    sf::IntRect getRegion(size_t index) const
+    {
+        return regions[index];
+    }
+};
 
-        ir = sf::IntRect(80, 0, 484, 370);
-        cashLargeSprite.setTexture(cashLargeTexture);                   cashLargeSprite.setPosition(cashLargeSpritePosition);
-        cashLargeMask.setSize(sf::Vector2f(ir.width, ir.height));       cashLargeMask.setPosition(ir.left, ir.top);
-        cashLargeMask.setTexture(&backgroundTexture);                   cashLargeMask.setTextureRect(ir);
+// Glyphs of the sizes and styles used on screen, rasterized once by "--bake-font" into an atlas image
+//  plus a metrics table, so that the runtime text path never needs FreeType for them
+class BitmapFont
+{
+private:
+    // Printable ASCII; anything else falls back to sf::Font
+    static const sf::Uint32 FIRST_CHARACTER = 32;
+    static const sf::Uint32 LAST_CHARACTER = 126;
+    static const unsigned int ATLAS_MAX_WIDTH = 1024;
 
-        ir = sf::IntRect(688, 250, 250, 213);
-        cashSmallSprite.setTexture(cashSmallTexture);                   cashSmallSprite.setPosition(cashSmallSpritePosition);
-        cashSmallMask.setSize(sf::Vector2f(ir.width, ir.height));       cashSmallMask.setPosition(ir.left, ir.top);
-        cashSmallMask.setTexture(&backgroundTexture);                   cashSmallMask.setTextureRect(ir);
+    struct BakedGlyph
+    {
+        bool present = false;
+        float advance = 0;
+        // Both include the one pixel padding sf::Text adds around each glyph quad
+        sf::FloatRect bounds;
+        sf::IntRect textureRect;
+    };
 
-        ir = sf::IntRect(716, 0, 197, 54);
-        receiptSprite.setTexture(receiptTexture);                       receiptSprite.setPosition(receiptSpritePosition);
-        receiptMask.setSize(sf::Vector2f(ir.width, ir.height));         receiptMask.setPosition(ir.left, ir.top);
-        receiptMask.setTexture(&backgroundTexture);                     receiptMask.setTextureRect(ir);
+    struct BakedStyle
+    {
+        float lineSpacing = 0;
+        BakedGlyph glyphs[LAST_CHARACTER - FIRST_CHARACTER + 1];
+    };
 
-        //- Assign buffer to sounds
-        cardSnd.setBuffer(cardSndBuf);
-        menuSnd.setBuffer(menuSndBuf);
-        clickSnd.setBuffer(clickSndBuf);
-        keySnd.setBuffer(keySndBuf);
-        cashSnd.setBuffer(cashSndBuf);
-        printReceiptSnd.setBuffer(printReceiptSndBuf);
+    sf::Texture texture;
+    std::map<unsigned int, BakedStyle> styles;
 
-        // Cursor
-        cursorCircle.setFillColor(cursorCircleIdleColor);
+    static unsigned int getStyleKey(unsigned int characterSize, bool bold)
+    {
+        return characterSize * 2 + (bold ? 1 : 0);
     }
 
-    void initStates()
+    const BakedStyle* findStyle(unsigned int characterSize, bool bold) const
     {
-        //- Initialize States
-        cardVisible = true; cashLargeVisible = false; cashSmallVisible = false; receiptVisible = false;
-        scrState = 1;
-        pin = 0; pinCount = 0; pinRetry = 0;
-        amount = 0; amountCount = 0;
-        amountLiveTxt = "";
-        convert.str("");
-        balance.str("");
-        outstandIngInteractionEvent = nullptr;
-        actionTimer = nullptr;
+        auto style = styles.find(getStyleKey(characterSize, bold));
+        return style == styles.end() ? nullptr : &style->second;
     }
 
-    void handleActionTimer()
+    static const BakedGlyph* findGlyph(const BakedStyle& style, sf::Uint32 character)
     {
-        if (actionTimer != nullptr)
-        {
-            actionTimer->update();
-        }
+        if (character < FIRST_CHARACTER || character > LAST_CHARACTER) return nullptr;
+        const BakedGlyph& glyph = style.glyphs[character - FIRST_CHARACTER];
+        return glyph.present ? &glyph : nullptr;
     }
 
-    void handleEvents()
+public:
+    // Build step: rasterizes every (size, bold) pair through sf::Font and writes the atlas and its metrics
+    static bool bake(const sf::Font& font, const std::vector<std::pair<unsigned int, bool>>& usedStyles,
+                     const std::string& imagePath, const std::string& metricsPath)
     {
-        while (window.pollEvent(event))
+        struct Entry
         {
-            switch (event.type)
+            unsigned int characterSize;
+            bool bold;
+            sf::Uint32 character;
+            sf::Glyph glyph;
+        };
+        std::vector<Entry> entries;
+        std::vector<sf::Vector2u> sizes;
+        std::map<unsigned int, sf::Image> pages;
+        for (const std::pair<unsigned int, bool>& style : usedStyles)
+        {
+            for (sf::Uint32 character = FIRST_CHARACTER; character <= LAST_CHARACTER; ++character)
             {
-#ifdef TARGET_ANDROID
-            // On Android MouseLeft/MouseEntered are (for now) triggered,
-            // whenever the app loses or gains focus.
-            //  ^ comment taken from the official SFML Android Sample Project:
-            // https://github.com/SFML/SFML/blob/2e6c363e644b430fd137a7dbed9836f965796610/examples/android/app/src/main/jni/main.cpp#L137
-            case sf::Event::MouseLeft:
-                windowHasFocus = false;
-                break;
-            case sf::Event::MouseEntered:
-                windowHasFocus = true;
-                break;
-            case sf::Event::KeyPressed:
-                if (event.key.code == sf::Keyboard::Escape) // Note: This is also triggered when the back button is pressed on Android
-                    window.close();
-                break;
-#endif
-            case sf::Event::Closed:
-                window.close();
-                break;
-            case sf::Event::Resized:
-                currentWindowSize = sf::Vector2u(event.size.width, event.size.height);
-#ifdef TARGET_ANDROID
-                view = getLetterboxView(view, event.size.width, event.size.height);
-                window.setView(view);
-#endif
-                break;
-            case sf::Event::TouchBegan:
-                if (event.touch.finger == 0)
-                    updatePointerLocation(event.touch.x, event.touch.y);
-                break;
-            case sf::Event::MouseButtonPressed:
-                updatePointerLocation(event.mouseButton.x, event.mouseButton.y);
-                break;
+                sf::Glyph glyph = font.getGlyph(character, style.first, style.second);
+                // Same padding sf::Text uses when it builds a glyph quad
+                glyph.bounds = sf::FloatRect(glyph.bounds.left - 1, glyph.bounds.top - 1, glyph.bounds.width + 2, glyph.bounds.height + 2);
+                glyph.textureRect = sf::IntRect(glyph.textureRect.left - 1, glyph.textureRect.top - 1, glyph.textureRect.width + 2, glyph.textureRect.height + 2);
+                entries.push_back(Entry { style.first, style.second, character, glyph });
+                sizes.push_back(sf::Vector2u(glyph.textureRect.width, glyph.textureRect.height));
             }
         }
+        // The glyph pages only grow while glyphs are added, so they are copied once everything is rasterized
+        for (const std::pair<unsigned int, bool>& style : usedStyles)
+            if (pages.find(style.first) == pages.end())
+                pages[style.first] = font.getTexture(style.first).copyToImage();
+
+        sf::Vector2u atlasSize;
+        std::vector<sf::IntRect> regions = TextureAtlas::pack(sizes, ATLAS_MAX_WIDTH, atlasSize);
+        sf::Image atlasImage;
+        atlasImage.create(atlasSize.x, atlasSize.y, sf::Color::Transparent);
+        std::ofstream metrics(metricsPath.c_str());
+        if (!metrics.is_open()) return false;
+        std::set<unsigned int> writtenStyles;
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            const Entry& entry = entries[i];
+            if (writtenStyles.insert(getStyleKey(entry.characterSize, entry.bold)).second)
+                metrics << "style " << entry.characterSize << " " << entry.bold << " " << font.getLineSpacing(entry.characterSize) << "\n";
+            if (regions[i].width > 0 && regions[i].height > 0)
+                atlasImage.copy(pages[entry.characterSize], regions[i].left, regions[i].top, entry.glyph.textureRect);
+            metrics << "glyph " << entry.characterSize << " " << entry.bold << " " << entry.character << " "
+                    << entry.glyph.advance << " "
+                    << entry.glyph.bounds.left << " " << entry.glyph.bounds.top << " "
+                    << entry.glyph.bounds.width << " " << entry.glyph.bounds.height << " "
+                    << regions[i].left << " " << regions[i].top << " "
+                    << regions[i].width << " " << regions[i].height << "\n";
+        }
+        return atlasImage.saveToFile(imagePath);
     }
 
-    void updatePointerLocation(int rawX, int rawY)
-    {
-        sf::Vector2i* position = getScaledPointerCoordinates(rawX, rawY);
-        cursorCircle.setPosition(
-                position->x - CURSOR_CIRCLE_RADIUS / (float) 2,
-                position->y - CURSOR_CIRCLE_RADIUS / (float) 2
-        );
-        addCursorAnimation(
-                new AlphaAnimation(
-                        cursorFadeOutAnimationTime, 127, 0,
-                        [this](int alpha) -> void {
-                            int currentColorInt = cursorCircle.getFillColor().toInteger();
-                            currentColorInt = currentColorInt >> 8; // get rid of the old alpha
-                            currentColorInt = currentColorInt << 8; // retreat
-                            int newColor = currentColorInt | alpha;
-                            cursorCircle.setFillColor(sf::Color(newColor));
-                        },
-                        [this]() -> void {
-                            cursorCircle.setFillColor(cursorCircleIdleColor);
-                            delete cursorAnimation;
-                            cursorAnimation = nullptr;
-                        }));
-        if (!canAcceptInput()) {
-            delete position;
-            return;
+    // Parsing the metrics needs no GL context, so it can run on a loader thread; the atlas image is
+    //  uploaded separately with loadTexture
+    bool loadMetrics(const ResourceView& view)
+    {
+        if (view.data == nullptr)
+            return false;
+        std::istringstream metrics(std::string(view.data, view.size));
+        std::string kind;
+        while (metrics >> kind)
+        {
+            unsigned int characterSize;
+            bool bold;
+            metrics >> characterSize >> bold;
+            BakedStyle& style = styles[getStyleKey(characterSize, bold)];
+            if (kind == "style")
+            {
+                metrics >> style.lineSpacing;
+            }
+            else if (kind == "glyph")
+            {
+                sf::Uint32 character;
+                BakedGlyph glyph;
+                metrics >> character >> glyph.advance
+                        >> glyph.bounds.left >> glyph.bounds.top >> glyph.bounds.width >> glyph.bounds.height
+                        >> glyph.textureRect.left >> glyph.textureRect.top >> glyph.textureRect.width >> glyph.textureRect.height;
+                if (character < FIRST_CHARACTER || character > LAST_CHARACTER) continue;
+                glyph.present = true;
+                style.glyphs[character - FIRST_CHARACTER] = glyph;
+            }
         }
-        if (outstandIngInteractionEvent != nullptr) delete outstandIngInteractionEvent;
-        outstandIngInteractionEvent = position;
+        return !styles.empty();
     }
 
-    bool canAcceptInput()
+    bool loadTexture(const sf::Image& image)
     {
-        return actionTimer == nullptr && runningAnimations.empty();
+        if (!texture.loadFromImage(image))
+            return false;
+        // Same filtering as the glyph pages of sf::Font, so both text paths look alike
+        texture.setSmooth(true);
+        return true;
     }
 
-    int getClickableObjectCode(int x, int y)
+    bool canRender(const std::string& text, unsigned int characterSize, bool bold) const
     {
-        //===============================
-        //Input Codes
-        //===============================
-        //Screen Buttons:
-        //L1 = 1    R1 = 5
-        //L2 = 2    R2 = 6
-        //L3 = 3    R3 = 7
-        //L4 = 4    R4 = 8
-        //===============================
-        //Keys:
-        //1 = 9     2 = 12    3 = 16
-        //4 = 10    5 = 13    6 = 17
-        //7 = 11    8 = 14    9 = 18
-        //          0 = 15
-        //===============================
-        //Action Buttons:
-        //Cancel = 25
-        //Clear  = 19
-        //OK     = 20
-        //===============================
-        //Objects:
-        //card       = 21
-        //cashLarge  = 22
-        //cashSmall  = 23
-        //receipt    = 24
-        //===============================
-        //exit = 26
-        //===============================
+        const BakedStyle* style = findStyle(characterSize, bold);
+        if (style == nullptr) return false;
+        for (char character : text)
+            if (character != '\n' && findGlyph(*style, (sf::Uint8) character) == nullptr)
+                return false;
+        return true;
+    }
 
-        if ((11 <= x) && (x <= 55)) //- Left Column Screen Buttons
+    // Lays out the quads the same way sf::Text does (baseline at characterSize, no kerning for this monospace font)
+    void buildVertices(sf::VertexArray& vertices, const std::string& text, unsigned int characterSize, bool bold,
+                       sf::Color color, sf::Vector2f position) const
+    {
+        vertices.setPrimitiveType(sf::Quads);
+        vertices.clear();
+        const BakedStyle* style = findStyle(characterSize, bold);
+        if (style == nullptr) return;
+        float x = 0, y = (float) characterSize;
+        for (char character : text)
         {
-            if ((125 <= y) && (y <= 163)) //- Button: L1
+            if (character == '\n')
             {
-                return 1;
-            }
-            if ((174 <= y) && (y <= 210)) //- Button: L2
-            {
-                return 2;
-            }
-            if ((221 <= y) && (y <= 259)) //- Button: L3
-            {
-                return 3;
+                x = 0;
+                y += style->lineSpacing;
+                continue;
             }
-            if ((269 <= y) && (y <= 305)) //- Button: L4
+            const BakedGlyph* glyph = findGlyph(*style, (sf::Uint8) character);
+            if (glyph == nullptr) continue;
+            if (character != ' ')
             {
-                return 4;
+                float left = position.x + x + glyph->bounds.left, top = position.y + y + glyph->bounds.top;
+                float right = left + glyph->bounds.width, bottom = top + glyph->bounds.height;
+                float u1 = (float) glyph->textureRect.left, v1 = (float) glyph->textureRect.top;
+                float u2 = u1 + glyph->textureRect.width, v2 = v1 + glyph->textureRect.height;
+                vertices.append(sf::Vertex(sf::Vector2f(left, top), color, sf::Vector2f(u1, v1)));
+                vertices.append(sf::Vertex(sf::Vector2f(right, top), color, sf::Vector2f(u2, v1)));
+                vertices.append(sf::Vertex(sf::Vector2f(right, bottom), color, sf::Vector2f(u2, v2)));
+                vertices.append(sf::Vertex(sf::Vector2f(left, bottom), color, sf::Vector2f(u1, v2)));
             }
+            x += glyph->advance;
         }
-        if ((588 <= x) && (x <= 632)) //- Right Column Screen Buttons
+    }
+
+    const sf::Texture& getTexture() const
+    {
+        return texture;
+    }
+};
+
+// sf::Text rebuilds its glyph geometry on every setString/setCharacterSize/setStyle,
+//  so the layout is applied once and the geometry is only rebuilt when the string changes.
+// Draws from the baked bitmap font when it covers the string, through sf::Font otherwise.
+class CachedText : public sf::Drawable
+{
+private:
+    sf::Text text;
+    std::string content;
+    const BitmapFont* bitmapFont = nullptr;
+    sf::VertexArray bitmapVertices;
+    bool usesBitmapFont = false;
+
+    virtual void draw(sf::RenderTarget& target, sf::RenderStates states) const
+    {
+        if (usesBitmapFont)
         {
-            if ((127 <= y) && (y <= 163)) //- Button: R1
-            {
-                return 5;
-            }
-            if ((175 <= y) && (y <= 212)) //- Button: R2
-            {
-                return 6;
-            }
-            if ((223 <= y) && (y <= 259)) //- Button: R3
-            {
-                return 7;
-            }
-            if ((270 <= y) && (y <= 308)) //- Button: R4
-            {
-                return 8;
-            }
+            states.texture = &bitmapFont->getTexture();
+            target.draw(bitmapVertices, states);
         }
-        if ((209 <= x) && (x <= 255) && !cashLargeVisible) //- Column 1 Keypad
+        else
+            target.draw(text, states);
+    }
+
+public:
+    void setup(const sf::Font& font, const BitmapFont* bitmapFont, float posX, float posY, unsigned int charSize, const sf::Color color, const sf::Uint32 style)
+    {
+        this->bitmapFont = bitmapFont;
+        text.setFont(font);
+        text.setPosition(posX, posY);
+        text.setCharacterSize(charSize);
+        text.setFillColor(color);
+        text.setOutlineColor(color);
+        text.setStyle(style);
+    }
+
+    void setString(const std::string& newContent)
+    {
+        if (newContent == content) return;
+        content = newContent;
+        bool bold = (text.getStyle() & sf::Text::Bold) != 0;
+        usesBitmapFont = bitmapFont != nullptr && bitmapFont->canRender(content, text.getCharacterSize(), bold);
+        if (usesBitmapFont)
+            bitmapFont->buildVertices(bitmapVertices, content, text.getCharacterSize(), bold, text.getFillColor(), text.getPosition());
+        else
+            text.setString(content);
+    }
+
+    const std::string& getString() const
+    {
+        return content;
+    }
+
+    const sf::Text& getText() const
+    {
+        return text;
+    }
+
+    const sf::Texture* getTexture() const
+    {
+        if (usesBitmapFont)
+            return &bitmapFont->getTexture();
+        return &text.getFont()->getTexture(text.getCharacterSize());
+    }
+};
+
+// Collects axis-aligned textured quads that share one texture and draws them with a single draw call
+class SpriteBatch : public sf::Drawable
+{
+private:
+    sf::VertexArray vertices = sf::VertexArray(sf::Quads);
+    const sf::Texture* texture = nullptr;
+
+    virtual void draw(sf::RenderTarget& target, sf::RenderStates states) const
+    {
+        states.texture = texture;
+        target.draw(vertices, states);
+    }
+
+public:
+    void begin(const sf::Texture* texture)
+    {
+        this->texture = texture;
+        vertices.clear();
+    }
+
+    void add(const sf::Sprite& sprite)
+    {
+        add(sprite.getGlobalBounds(), sprite.getTextureRect());
+    }
+
+    void add(const sf::RectangleShape& shape)
+    {
+        add(shape.getGlobalBounds(), shape.getTextureRect());
+    }
+
+    void add(sf::FloatRect bounds, sf::IntRect textureRect)
+    {
+        float left = (float) textureRect.left, top = (float) textureRect.top;
+        float right = left + textureRect.width, bottom = top + textureRect.height;
+        vertices.append(sf::Vertex(sf::Vector2f(bounds.left, bounds.top), sf::Vector2f(left, top)));
+        vertices.append(sf::Vertex(sf::Vector2f(bounds.left + bounds.width, bounds.top), sf::Vector2f(right, top)));
+        vertices.append(sf::Vertex(sf::Vector2f(bounds.left + bounds.width, bounds.top + bounds.height), sf::Vector2f(right, bottom)));
+        vertices.append(sf::Vertex(sf::Vector2f(bounds.left, bounds.top + bounds.height), sf::Vector2f(left, bottom)));
+    }
+
+    bool empty() const
+    {
+        return vertices.getVertexCount() == 0;
+    }
+};
+
+// Counts draw calls and texture switches the way SFML issues them (it skips rebinding the same texture)
+class DrawCallCounter
+{
+private:
+    const sf::Texture* boundTexture = nullptr;
+
+public:
+    unsigned int frameDrawCalls = 0, frameTextureBinds = 0;
+    unsigned long long int totalDrawCalls = 0, totalTextureBinds = 0;
+
+    void beginFrame()
+    {
+        frameDrawCalls = 0;
+        frameTextureBinds = 0;
+        boundTexture = nullptr;
+    }
+
+    void count(const sf::Texture* texture, unsigned int drawCalls = 1)
+    {
+        if (drawCalls == 0) return;
+        frameDrawCalls += drawCalls;
+        totalDrawCalls += drawCalls;
+        if (texture != boundTexture)
         {
-            if ((410 <= y) && (y <= 449)) //- Key: 1
-            {
-                return 9;
-            }
-            if ((457 <= y) && (y <= 496)) //- Key: 4
-            {
-                return 10;
-            }
-            if ((504 <= y) && (y <= 543)) //- Key: 7
+            boundTexture = texture;
+            if (texture != nullptr)
             {
-                return 11;
+                frameTextureBinds++;
+                totalTextureBinds++;
             }
         }
-        if ((264 <= x) && (x <= 310) && !cashLargeVisible) //- Column 2 Keypad
+    }
+};
+
+#ifdef ENABLE_PROFILER
+
+enum ProfilerPhase
+{
+    PHASE_EVENTS = 0,
+    PHASE_ACTION_TIMER,
+    PHASE_UPDATE,
+    PHASE_RENDER,
+    PHASE_SCR_RENDER,
+    PHASE_DISPLAY,
+    PHASE_FRAME,
+    PHASE_COUNT
+};
+
+// Keeps a rolling window of samples per frame phase (and per screen state for rendering)
+class FrameProfiler
+{
+private:
+    static const size_t HISTORY_SIZE = 240;
+
+    struct History
+    {
+        sf::Int64 samples[HISTORY_SIZE];
+        size_t count = 0;
+        size_t next = 0;
+
+        void add(sf::Time duration)
         {
-            if ((410 <= y) && (y <= 449)) //- Key: 2
-            {
-                return 12;
-            }
-            if ((457 <= y) && (y <= 496)) //- Key: 5
-            {
-                return 13;
-            }
-            if ((504 <= y) && (y <= 543)) //- Key: 8
-            {
-                return 14;
-            }
-            if ((551 <= y) && (y <= 590)) //- Key 0
-            {
-                return 15;
-            }
+            samples[next] = duration.asMicroseconds();
+            next = (next + 1) % HISTORY_SIZE;
+            if (count < HISTORY_SIZE) count++;
         }
-        if ((319 <= x) && (x <= 365) && !cashLargeVisible) //- Column 3 Keypad
+    };
+
+    History phases[PHASE_COUNT];
+    std::map<unsigned short int, History> stateRenders;
+
+    static sf::Int64 getPercentile(std::vector<sf::Int64>& sorted, float percentile)
+    {
+        size_t index = (size_t) (percentile * (sorted.size() - 1));
+        return sorted[index];
+    }
+
+    static void writeSummary(std::ostream& stream, const std::string& name, const History& history)
+    {
+        stream << std::left << std::setw(12) << name << std::right;
+        if (history.count == 0)
         {
-            if ((410 <= y) && (y <= 449)) //- Key: 3
-            {
-                return 16;
-            }
-            if ((457 <= y) && (y <= 496)) //- Key: 6
-            {
-                return 17;
-            }
-            if ((504 <= y) && (y <= 543)) //- Key: 9
-            {
-                return 18;
-            }
+            stream << "           -" << std::endl;
+            return;
         }
-        if ((385 <= x) && (x <= 455) && !cashLargeVisible) //- Column 4 Keypad
+        std::vector<sf::Int64> sorted(history.samples, history.samples + history.count);
+        std::sort(sorted.begin(), sorted.end());
+        stream << std::setw(8) << getPercentile(sorted, 0.50f)
+               << std::setw(8) << getPercentile(sorted, 0.99f)
+               << std::setw(8) << sorted.back() << std::endl;
+    }
+
+public:
+    void record(ProfilerPhase phase, sf::Time duration)
+    {
+        phases[phase].add(duration);
+    }
+
+    void recordStateRender(unsigned short int state, sf::Time duration)
+    {
+        stateRenders[state].add(duration);
+    }
+
+    // p50/p99/max in microseconds over the last HISTORY_SIZE samples
+    std::string report(bool includeStates) const
+    {
+        static const char* phaseNames[PHASE_COUNT] = { "events", "timer", "update", "render", "scrRender", "display", "frame" };
+        std::ostringstream stream;
+        stream << "phase (us)       p50     p99     max" << std::endl;
+        for (int phase = 0; phase < PHASE_COUNT; ++phase)
+            writeSummary(stream, phaseNames[phase], phases[phase]);
+        if (includeStates)
         {
-            if ((410 <= y) && (y <= 449)) //- Button: Cancel
-            {
-                return 25;
-            }
-            if ((457 <= y) && (y <= 496)) //- Button: Clear
-            {
-                return 19;
-            }
-            if ((504 <= y) && (y <= 543)) //- Button: OK
-            {
-                return 20;
-            }
+            stream << "render per screen state (us)" << std::endl;
+            for (const auto& stateRender : stateRenders)
+                writeSummary(stream, "state " + std::to_string(stateRender.first), stateRender.second);
         }
-        if ((cardSprite.getGlobalBounds().left <= x) && (x <= (cardSprite.getGlobalBounds().left + cardSprite.getGlobalBounds().width))) //- Object: card (x axis)
+        return stream.str();
+    }
+
+    bool dumpToFile(const std::string& path) const
+    {
+        std::ofstream file(path.c_str());
+        if (!file.is_open()) return false;
+        file << report(true);
+        return true;
+    }
+};
+
+class ScopedPhaseTimer
+{
+private:
+    FrameProfiler& profiler;
+    ProfilerPhase phase;
+    sf::Clock clock;
+
+public:
+    ScopedPhaseTimer(FrameProfiler& profiler, ProfilerPhase phase) : profiler(profiler), phase(phase) {}
+
+    ~ScopedPhaseTimer()
+    {
+        profiler.record(phase, clock.getElapsedTime());
+    }
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_PHASE(profiler, phase) ScopedPhaseTimer PROFILE_CONCAT(scopedPhaseTimer, __LINE__)(profiler, phase)
+
+#else
+
+#define PROFILE_PHASE(profiler, phase)
+
+#endif
+
+#ifdef ENABLE_TRACING
+
+struct TraceEvent
+{
+    // Names must outlive the tracer (string literals)
+    const char* name;
+    char phase;
+    sf::Int64 timestamp;
+    unsigned long long int id;
+};
+
+// Written only by its owning thread; the writer publishes each event with a release store,
+//  so recording never takes a lock. Oldest events are overwritten once the ring is full.
+struct TraceBuffer
+{
+    static const size_t CAPACITY = 1 << 16;
+    TraceEvent events[CAPACITY];
+    std::atomic<size_t> written;
+    unsigned int threadId;
+    std::string threadName;
+
+    TraceBuffer(unsigned int threadId) : written(0), threadId(threadId) {}
+
+    void push(const TraceEvent& event)
+    {
+        size_t index = written.load(std::memory_order_relaxed);
+        events[index % CAPACITY] = event;
+        written.store(index + 1, std::memory_order_release);
+    }
+};
+
+// Records spans and instant events per thread and exports them as Chrome trace JSON
+//  (chrome://tracing or https://ui.perfetto.dev)
+class Tracer
+{
+private:
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::mutex buffersMutex;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+
+    TraceBuffer& getThreadBuffer()
+    {
+        thread_local TraceBuffer* threadBuffer = nullptr;
+        if (threadBuffer == nullptr)
         {
-            if ((cardSprite.getGlobalBounds().top <= y) && (y <= (cardSprite.getGlobalBounds().top + cardSprite.getGlobalBounds().height)) && cardVisible) //- Object: card (y axis) and visibility
+            // Only taken once per thread
+            std::lock_guard<std::mutex> lock(buffersMutex);
+            buffers.push_back(std::unique_ptr<TraceBuffer>(new TraceBuffer((unsigned int) buffers.size() + 1)));
+            threadBuffer = buffers.back().get();
+        }
+        return *threadBuffer;
+    }
+
+    void record(const char* name, char phase, unsigned long long int id = 0)
+    {
+        sf::Int64 timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+        getThreadBuffer().push(TraceEvent { name, phase, timestamp, id });
+    }
+
+public:
+    static Tracer& instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    void setThreadName(const std::string& name)
+    {
+        getThreadBuffer().threadName = name;
+    }
+
+    void begin(const char* name)
+    {
+        record(name, 'B');
+    }
+
+    void end(const char* name)
+    {
+        record(name, 'E');
+    }
+
+    void instant(const char* name)
+    {
+        record(name, 'i');
+    }
+
+    // Async spans may start and end on different frames (or threads) without breaking the nesting of the others
+    void asyncBegin(const char* name, unsigned long long int id)
+    {
+        record(name, 'b', id);
+    }
+
+    void asyncEnd(const char* name, unsigned long long int id)
+    {
+        record(name, 'e', id);
+    }
+
+    bool writeChromeTrace(const std::string& path)
+    {
+        std::ofstream file(path.c_str());
+        if (!file.is_open()) return false;
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        for (const std::unique_ptr<TraceBuffer>& buffer : buffers)
+        {
+            if (!buffer->threadName.empty())
             {
-                return 21;
+                file << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+                     << ",\"args\":{\"name\":\"" << buffer->threadName << "\"}}";
+                first = false;
+            }
+            size_t written = buffer->written.load(std::memory_order_acquire);
+            size_t start = written > TraceBuffer::CAPACITY ? written - TraceBuffer::CAPACITY : 0;
+            for (size_t i = start; i < written; ++i)
+            {
+                const TraceEvent& event = buffer->events[i % TraceBuffer::CAPACITY];
+                file << (first ? "" : ",") << "\n{\"name\":\"" << event.name << "\",\"ph\":\"" << event.phase
+                     << "\",\"ts\":" << event.timestamp << ",\"pid\":1,\"tid\":" << buffer->threadId;
+                if (event.phase == 'b' || event.phase == 'e')
+                    file << ",\"cat\":\"async\",\"id\":" << event.id;
+                if (event.phase == 'i')
+                    file << ",\"s\":\"t\"";
+                file << "}";
+                first = false;
             }
         }
-        if ((cashLargeSprite.getGlobalBounds().left <= x) && (x <= (cashLargeSprite.getGlobalBounds().left + cashLargeSprite.getGlobalBounds().width))) //- Object: cashLarge (x axis)
+        file << "\n]}\n";
+        return true;
+    }
+};
+
+class ScopedTrace
+{
+private:
+    const char* name;
+
+public:
+    ScopedTrace(const char* name) : name(name)
+    {
+        Tracer::instance().begin(name);
+    }
+
+    ~ScopedTrace()
+    {
+        Tracer::instance().end(name);
+    }
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) ScopedTrace TRACE_CONCAT(scopedTrace, __LINE__)(name)
+#define TRACE_INSTANT(name) Tracer::instance().instant(name)
+#define TRACE_ASYNC_BEGIN(name, id) Tracer::instance().asyncBegin(name, id)
+#define TRACE_ASYNC_END(name, id) Tracer::instance().asyncEnd(name, id)
+#define TRACE_THREAD_NAME(name) Tracer::instance().setThreadName(name)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_INSTANT(name)
+#define TRACE_ASYNC_BEGIN(name, id)
+#define TRACE_ASYNC_END(name, id)
+#define TRACE_THREAD_NAME(name)
+
+#endif
+
+// Runs the decode step of each asset on worker threads and its upload step (anything that needs the GL context
+//  or touches state owned by the main thread) on the thread that polls it
+class AssetLoader
+{
+public:
+    typedef std::function<bool()> Step;
+
+private:
+    struct Job
+    {
+        const char* name;
+        Step decode;
+        Step upload;
+        bool required;
+        std::atomic<bool> decoded;
+        bool decodeOk = false;
+        bool uploaded = false;
+        bool uploadOk = false;
+        sf::Time decodeTime;
+        sf::Time uploadTime;
+    };
+
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> nextJob;
+    size_t finishedJobs = 0;
+
+    void work()
+    {
+        TRACE_THREAD_NAME("asset loader");
+        for (size_t i = nextJob++; i < jobs.size(); i = nextJob++)
         {
-            if ((cashLargeSprite.getGlobalBounds().top <= y) && (y <= (cashLargeSprite.getGlobalBounds().top + cashLargeSprite.getGlobalBounds().height)) && cashLargeVisible) //- Object: cashLarge (y axis) and visibility
+            Job& job = *jobs[i];
             {
-                return 22;
+                TRACE_SCOPE(job.name);
+                sf::Clock decodeClock;
+                job.decodeOk = job.decode();
+                job.decodeTime = decodeClock.getElapsedTime();
             }
+            job.decoded = true;
         }
-        if ((cashSmallSprite.getGlobalBounds().left <= x) && (x <= (cashSmallSprite.getGlobalBounds().left + cashSmallSprite.getGlobalBounds().width))) //- Object: cashSmall (x axis)
+    }
+
+public:
+    AssetLoader() : nextJob(0) {}
+
+    ~AssetLoader()
+    {
+        for (std::thread& worker : workers)
+            if (worker.joinable())
+                worker.join();
+    }
+
+    // Names must be string literals (they are used as trace names); all jobs are added before start()
+    size_t add(const char* name, Step decode, Step upload = Step(), bool required = true)
+    {
+        std::unique_ptr<Job> job(new Job());
+        job->name = name;
+        job->decode = decode;
+        job->upload = upload;
+        job->required = required;
+        job->decoded = false;
+        jobs.push_back(std::move(job));
+        return jobs.size() - 1;
+    }
+
+    void start(unsigned int workerCount)
+    {
+        workerCount = std::max(1u, std::min(workerCount, (unsigned int) jobs.size()));
+        for (unsigned int i = 0; i < workerCount; ++i)
+            workers.push_back(std::thread(&AssetLoader::work, this));
+    }
+
+    // Uploads whatever has been decoded since the last call; returns true once every asset is done
+    bool poll()
+    {
+        for (std::unique_ptr<Job>& job : jobs)
         {
-            if ((cashSmallSprite.getGlobalBounds().top <= y) && (y <= (cashSmallSprite.getGlobalBounds().top + cashSmallSprite.getGlobalBounds().height)) && cashSmallVisible) //- Object: cashSmall (y axis) and visibility
+            if (job->uploaded || !job->decoded)
+                continue;
+            job->uploaded = true;
+            job->uploadOk = job->decodeOk;
+            if (job->decodeOk && job->upload)
             {
-                return 23;
+                TRACE_SCOPE(job->name);
+                sf::Clock uploadClock;
+                job->uploadOk = job->upload();
+                job->uploadTime = uploadClock.getElapsedTime();
             }
+            finishedJobs++;
         }
-        if ((receiptSprite.getGlobalBounds().left <= x) && (x <= (receiptSprite.getGlobalBounds().left + receiptSprite.getGlobalBounds().width))) //- Object: receipt (x axis)
+        return finishedJobs == jobs.size();
+    }
+
+    float getProgress() const
+    {
+        return jobs.empty() ? 1.f : finishedJobs / (float) jobs.size();
+    }
+
+    bool isLoaded(size_t job) const
+    {
+        return jobs[job]->uploaded;
+    }
+
+    bool succeeded(size_t job) const
+    {
+        return jobs[job]->uploadOk;
+    }
+
+    bool isRequired(size_t job) const
+    {
+        return jobs[job]->required;
+    }
+
+    size_t getJobCount() const
+    {
+        return jobs.size();
+    }
+
+    const char* getName(size_t job) const
+    {
+        return jobs[job]->name;
+    }
+
+    sf::Time getDecodeTime(size_t job) const
+    {
+        return jobs[job]->decodeTime;
+    }
+
+    sf::Time getUploadTime(size_t job) const
+    {
+        return jobs[job]->uploadTime;
+    }
+};
+
+// A fixed set of preallocated voices shared by every sound effect. A new sound takes a free voice instead of
+//  restarting one that is still playing; when all are busy it steals the oldest voice of the lowest priority
+//  not above its own, and is dropped if every voice plays something more important.
+class VoicePool
+{
+private:
+    struct Voice
+    {
+        sf::Sound sound;
+        int priority = 0;
+        sf::Uint64 startOrder = 0;
+        // Time of the input that triggered the sound, until its first sample is heard
+        bool latencyPending = false;
+        sf::Time inputTime;
+    };
+
+    std::vector<Voice> voices;
+    sf::Uint64 playCount = 0;
+    sf::Clock clock;
+
+    Voice* findVoice(int priority)
+    {
+        for (Voice& voice : voices)
+            if (voice.sound.getStatus() != sf::Sound::Playing)
+                return &voice;
+        Voice* stolen = nullptr;
+        for (Voice& voice : voices)
         {
-            if ((receiptSprite.getGlobalBounds().top <= y) && (y <= (receiptSprite.getGlobalBounds().top + receiptSprite.getGlobalBounds().height)) && receiptVisible) //- Object: receipt (y axis) and visibility
+            if (voice.priority > priority) continue;
+            if (stolen == nullptr || voice.priority < stolen->priority
+                || (voice.priority == stolen->priority && voice.startOrder < stolen->startOrder))
+                stolen = &voice;
+        }
+        return stolen;
+    }
+
+    void start(const sf::SoundBuffer& buffer, int priority, bool measureLatency, sf::Time inputTime)
+    {
+        Voice* voice = findVoice(priority);
+        if (voice == nullptr)
+        {
+            droppedSounds++;
+            return;
+        }
+        if (voice->sound.getStatus() == sf::Sound::Playing)
+            stolenVoices++;
+        voice->sound.stop();
+        voice->sound.setBuffer(buffer);
+        voice->priority = priority;
+        voice->startOrder = ++playCount;
+        voice->latencyPending = measureLatency;
+        voice->inputTime = inputTime;
+        voice->sound.play();
+    }
+
+public:
+    //- Input to first audio sample latency
+    unsigned long long int latencySamples = 0;
+    sf::Time latencyTotal;
+    sf::Time latencyMax;
+    unsigned long long int stolenVoices = 0;
+    unsigned long long int droppedSounds = 0;
+
+    explicit VoicePool(size_t voiceCount = 0) : voices(voiceCount) {}
+
+    // Timestamps handed to play() must come from this clock
+    sf::Time getTime() const
+    {
+        return clock.getElapsedTime();
+    }
+
+    void play(const sf::SoundBuffer& buffer, int priority)
+    {
+        start(buffer, priority, false, sf::Time::Zero);
+    }
+
+    void play(const sf::SoundBuffer& buffer, int priority, sf::Time inputTime)
+    {
+        start(buffer, priority, true, inputTime);
+    }
+
+    // Called once per frame. The mixer has output the first sample once the playing offset moves; the offset
+    //  itself is subtracted so the estimate does not depend on how late in the frame it is noticed.
+    void update()
+    {
+        sf::Time now = getTime();
+        for (Voice& voice : voices)
+        {
+            if (!voice.latencyPending) continue;
+            if (voice.sound.getStatus() != sf::Sound::Playing)
             {
-                return 24;
+                voice.latencyPending = false;
+                continue;
             }
+            sf::Time offset = voice.sound.getPlayingOffset();
+            if (offset <= sf::Time::Zero) continue;
+            sf::Time latency = now - offset - voice.inputTime;
+            voice.latencyPending = false;
+            latencySamples++;
+            latencyTotal += latency;
+            latencyMax = std::max(latencyMax, latency);
         }
-        if ((12 <= x) && (x <= 92)) //- Exit Button (x axis)
+    }
+};
+
+// Runs commands on its own worker thread, so a slow device or host never stalls the frame loop.
+// Completions are queued by the worker and run on the main thread by dispatchCompletions().
+class CommandWorker
+{
+public:
+    typedef std::function<void(bool ok)> Completion;
+
+private:
+    struct Command
+    {
+        std::function<bool()> run;
+        Completion completion;
+    };
+
+    const char* name;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable commandAvailable;
+    std::deque<Command> commands;
+    std::deque<std::pair<Completion, bool>> completions;
+    size_t pendingCommands = 0;                // Submitted and not dispatched yet
+    bool stopping = false;
+    bool runsInline = false;
+
+    void work()
+    {
+        TRACE_THREAD_NAME(name);
+        while (true)
         {
-            if ((563 <= y) && (y <= 603)) //- Exit Button (y axis)
+            Command command;
             {
-                return 26;
+                std::unique_lock<std::mutex> lock(mutex);
+                commandAvailable.wait(lock, [this]() -> bool { return stopping || !commands.empty(); });
+                if (stopping) break;
+                command = std::move(commands.front());
+                commands.pop_front();
             }
+            bool ok;
+            {
+                TRACE_SCOPE(name);
+                ok = command.run();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            completions.push_back(std::make_pair(command.completion, ok));
         }
-        return 0;
+        onWorkerExit();
     }
 
-    void update(sf::Time deltaTime)
+protected:
+    void submit(std::function<bool()> run, Completion completion)
     {
-        //======================================================================================================================================================================================================================
-        //Screen States (scrState)
-        //======================================================================================================================================================================================================================
-        //(1)Insert card --> (23)Processing --> (2)Insert PIN --> (3)MAIN MENU --Withdraw----------> (4)Enter Amount --> (5)Confirm -------------------------> (6)Processing -----> (7)Receipt? --y/n--> (8)Another transaction?
-        //                                                    |                |                                     |
-        //                                                    |                |                                     |
-        //                                                    |                |                                     |
-        //                                                    |                |                                     --> (10)Not enough funds
-        //                                                    |                |
-        //                                                    |                --Deposit-----------> (11)Enter amount --> (12)Confirm --> (13)Insert cash ---> (24)Processing -->(14)Receipt? --y/n---> (15)Another transaction?
-        //                                                    |                |
-        //                                                    |                |
-        //                                                    |                |
-        //                                                    |                --Account Balance---> (17)Processing ----> (18)Balance = ***. Receipt? -y/n---> (19)Another transaction?
-        //                                                    |
-        //                                                    |
-        //                                                    |
-        //                                                    --> (21)Wrong PIN
-        //                                                    |
-        //                                                    --> (22)Account Blocked (3 Wrong Attempts)
-        //======================================================================================================================================================================================================================
-        //======================================================================================================================================================================================================================
-
-        int clickableObjectCode = -1;
-        if (outstandIngInteractionEvent != nullptr)
+        if (runsInline)
+        {
+            post(completion, run());
+            return;
+        }
         {
-            clickableObjectCode = getClickableObjectCode(outstandIngInteractionEvent->x, outstandIngInteractionEvent->y);
-            delete outstandIngInteractionEvent;
-            outstandIngInteractionEvent = nullptr;
+            std::lock_guard<std::mutex> lock(mutex);
+            commands.push_back(Command { run, completion });
+            pendingCommands++;
         }
+        commandAvailable.notify_one();
+    }
 
-        switch (scrState)
+    // Queues a completion from any thread, for work that finishes outside the command that started it
+    void post(Completion completion, bool ok)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        completions.push_back(std::make_pair(completion, ok));
+        pendingCommands++;
+    }
+
+    // Runs on the worker right before it exits
+    virtual void onWorkerExit() {}
+
+    // Inline workers get this call before their completions are dispatched, to collect work that finished elsewhere
+    virtual void pollInline() {}
+
+    bool isInline() const
+    {
+        return runsInline;
+    }
+
+public:
+    explicit CommandWorker(const char* name) : name(name) {}
+
+    // Only a last resort: by now the derived part is gone, so a command still running would call into a destroyed
+    //  object. Concrete workers stop themselves in their own destructors; devices are stopped by DeviceHal.
+    virtual ~CommandWorker()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        worker = std::thread(&CommandWorker::work, this);
+    }
+
+    // Instead of start(): commands then run on the thread that submits them, for simulated terminals that
+    //  cannot afford a thread per device
+    void runInline()
+    {
+        runsInline = true;
+    }
+
+    // Commands still queued are dropped, and no longer count towards isBusy()
+    void stop()
+    {
         {
-            case 1: //- (1) Insert Card
-                if (clickableObjectCode == 21)
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            pendingCommands -= commands.size();
+            commands.clear();
+        }
+        commandAvailable.notify_all();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // Main thread only; returns how many completions ran
+    size_t dispatchCompletions()
+    {
+        if (runsInline)
+            pollInline();
+        std::deque<std::pair<Completion, bool>> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.swap(completions);
+            pendingCommands -= ready.size();
+        }
+        for (std::pair<Completion, bool>& completion : ready)
+            if (completion.first)
+                completion.first(completion.second);
+        return ready.size();
+    }
+
+    bool isBusy()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pendingCommands > 0;
+    }
+
+    const char* getName() const
+    {
+        return name;
+    }
+};
+
+//- Device interfaces: the protected operations block on the worker, the public ones queue them
+
+class CardReader : public CommandWorker
+{
+protected:
+    virtual bool readCard() = 0;
+    virtual bool ejectCard() = 0;
+
+public:
+    CardReader() : CommandWorker("card reader") {}
+
+    void acceptCard(Completion completion)
+    {
+        submit([this]() -> bool { return readCard(); }, completion);
+    }
+
+    void returnCard(Completion completion)
+    {
+        submit([this]() -> bool { return ejectCard(); }, completion);
+    }
+};
+
+class CashDispenser : public CommandWorker
+{
+protected:
+    virtual bool dispenseNotes(unsigned int amount) = 0;
+
+public:
+    CashDispenser() : CommandWorker("cash dispenser") {}
+
+    void dispense(unsigned int amount, Completion completion)
+    {
+        submit([this, amount]() -> bool { return dispenseNotes(amount); }, completion);
+    }
+};
+
+class CashAcceptor : public CommandWorker
+{
+protected:
+    virtual bool acceptNotes() = 0;
+
+public:
+    CashAcceptor() : CommandWorker("cash acceptor") {}
+
+    void accept(Completion completion)
+    {
+        submit([this]() -> bool { return acceptNotes(); }, completion);
+    }
+};
+
+class ReceiptPrinter : public CommandWorker
+{
+protected:
+    virtual bool printReceipt(const std::string& text) = 0;
+
+public:
+    ReceiptPrinter() : CommandWorker("receipt printer") {}
+
+    void print(const std::string& text, Completion completion)
+    {
+        submit([this, text]() -> bool { return printReceipt(text); }, completion);
+    }
+};
+
+class Haptics : public CommandWorker
+{
+protected:
+    virtual bool pulse(int durationMillis) = 0;
+
+public:
+    Haptics() : CommandWorker("haptics") {}
+
+    void vibrate(int durationMillis)
+    {
+        submit([this, durationMillis]() -> bool { return pulse(durationMillis); }, Completion());
+    }
+};
+
+//- Mock devices: every command succeeds after the configured latency
+
+class MockCardReader : public CardReader
+{
+private:
+    sf::Time latency;
+
+protected:
+    bool readCard() override { sf::sleep(latency); return true; }
+    bool ejectCard() override { sf::sleep(latency); return true; }
+
+public:
+    explicit MockCardReader(sf::Time latency) : latency(latency) {}
+};
+
+class MockCashDispenser : public CashDispenser
+{
+private:
+    sf::Time latency;
+
+protected:
+    bool dispenseNotes(unsigned int amount) override { sf::sleep(latency); return true; }
+
+public:
+    explicit MockCashDispenser(sf::Time latency) : latency(latency) {}
+};
+
+class MockCashAcceptor : public CashAcceptor
+{
+private:
+    sf::Time latency;
+
+protected:
+    bool acceptNotes() override { sf::sleep(latency); return true; }
+
+public:
+    explicit MockCashAcceptor(sf::Time latency) : latency(latency) {}
+};
+
+class MockReceiptPrinter : public ReceiptPrinter
+{
+private:
+    sf::Time latency;
+
+protected:
+    bool printReceipt(const std::string& text) override { sf::sleep(latency); return true; }
+
+public:
+    explicit MockReceiptPrinter(sf::Time latency) : latency(latency) {}
+};
+
+class MockHaptics : public Haptics
+{
+private:
+    sf::Time latency;
+
+protected:
+    bool pulse(int durationMillis) override { sf::sleep(latency); return true; }
+
+public:
+    explicit MockHaptics(sf::Time latency) : latency(latency) {}
+};
+
+#ifdef TARGET_ANDROID
+class AndroidHaptics : public Haptics
+{
+private:
+    AndroidGlue& androidGlue;
+
+protected:
+    bool pulse(int durationMillis) override
+    {
+        androidGlue.vibrate(durationMillis);
+        return true;
+    }
+
+    void onWorkerExit() override
+    {
+        androidGlue.detachCurrentThread();
+    }
+
+public:
+    explicit AndroidHaptics(AndroidGlue& androidGlue) : androidGlue(androidGlue) {}
+};
+#endif
+
+// One of each device; the owner starts them once. Stopping them is the HAL's job: it stops every worker while
+//  the devices are still whole, before the unique_ptrs destroy them
+struct DeviceHal
+{
+    std::unique_ptr<CardReader> cardReader;
+    std::unique_ptr<CashDispenser> cashDispenser;
+    std::unique_ptr<CashAcceptor> cashAcceptor;
+    std::unique_ptr<ReceiptPrinter> receiptPrinter;
+    std::unique_ptr<Haptics> haptics;
+
+    ~DeviceHal()
+    {
+        stop();
+    }
+
+    // The devices there are: haptics is optional, and none are there before the owner creates them
+    std::vector<CommandWorker*> getDevices()
+    {
+        std::vector<CommandWorker*> devices = { cardReader.get(), cashDispenser.get(), cashAcceptor.get(), receiptPrinter.get(), haptics.get() };
+        devices.erase(std::remove(devices.begin(), devices.end(), nullptr), devices.end());
+        return devices;
+    }
+
+    void start()
+    {
+        for (CommandWorker* device : getDevices())
+            device->start();
+    }
+
+    void runInline()
+    {
+        for (CommandWorker* device : getDevices())
+            device->runInline();
+    }
+
+    void stop()
+    {
+        for (CommandWorker* device : getDevices())
+            device->stop();
+    }
+
+    size_t dispatchCompletions()
+    {
+        size_t dispatched = 0;
+        for (CommandWorker* device : getDevices())
+            dispatched += device->dispatchCompletions();
+        return dispatched;
+    }
+};
+
+//- Transaction core: authorizes what the processing screens wait for
+
+enum TransactionType
+{
+    CARD_CHECK = 1,
+    BALANCE_INQUIRY,
+    WITHDRAWAL,
+    DEPOSIT,
+    PIN_VERIFY,
+    // Advices: a withdrawal or deposit a terminal approved while standing in for the host, forwarded once it is back.
+    //  The cash has changed hands already, so the ledger posts them whatever the balance (see Ledger::apply)
+    FORCED_WITHDRAWAL,
+    FORCED_DEPOSIT,
+    // Advice: a wrong PIN the terminal was given for cardId while standing in, counted by the host once it is back
+    WRONG_PIN_ADVICE
+};
+
+struct TransactionRequest
+{
+    TransactionType type;
+    std::string iban;                          // Empty for CARD_CHECK and PIN_VERIFY
+    unsigned short int pin;                    // PIN_VERIFY only
+    unsigned long long int amount;
+    sf::Uint64 transactionId;                  // WITHDRAWAL and DEPOSIT: the same for every retry, 0 for none (see DedupTable)
+    sf::Uint64 cardId;                         // The card in the reader, 0 for none; CARD_CHECK and PIN_VERIFY consult its status
+};
+
+struct TransactionResponse
+{
+    bool answered = false;                     // False when the ledger could not be reached
+    bool approved = false;
+    bool standIn = false;                      // Decided by the terminal while the host could not be reached (never on the wire)
+    bool unknownOffline = false;               // Stood in for a card the terminal has not seen verified, so no PIN could be checked (never on the wire)
+    bool replayed = false;                     // The transaction id was applied before; this is the result it had then
+    bool cardSuspended = false;                // Declined because the card is suspended, or by the wrong PIN that suspended it
+    unsigned int pinAttemptsLeft = 0;          // After a wrong PIN, before the card is suspended
+    unsigned long long int balance = 0;
+    std::string iban;                          // Account details, for an approved PIN_VERIFY
+    std::string lastName;
+    std::string firstName;
+};
+
+//- Wire format between terminals and the host: every frame is a 4 byte payload length followed by a fixed-layout
+//   payload. Integers are little-endian and text fields are zero-padded, so every field sits at a fixed offset and
+//   is read in place from the receive buffer.
+//
+//   Request  (64 bytes):  id u32 | type u8 | reserved u8 | pin u16 | amount u64 | transaction id u64 | card id u64
+//                         | iban char[32]
+//   Response (112 bytes): id u32 | flags u8 (bit 0: approved, bit 1: replayed, bit 2: card suspended)
+//                         | PIN attempts left u8 | reserved u8[2] | balance u64
+//                         | iban char[32] | last name char[32] | first name char[32]
+//
+//   The id is chosen by the terminal and echoed by the host, so a terminal can have several requests in flight
+//   on one connection and match the replies as they come back.
+
+class TransactionCodec
+{
+private:
+    template <typename T>
+    static void write(char* destination, T value)
+    {
+        for (size_t i = 0; i < sizeof(T); i++)
+            destination[i] = static_cast<char>(value >> (8 * i));
+    }
+
+    template <typename T>
+    static T read(const char* source)
+    {
+        T value = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+            value |= static_cast<T>(static_cast<unsigned char>(source[i])) << (8 * i);
+        return value;
+    }
+
+    // Longer text is cut at the field size
+    static void writeText(char* destination, const std::string& text)
+    {
+        size_t length = text.size() < TEXT_FIELD_SIZE ? text.size() : TEXT_FIELD_SIZE;
+        std::memcpy(destination, text.data(), length);
+        std::memset(destination + length, 0, TEXT_FIELD_SIZE - length);
+    }
+
+    static void readText(const char* source, std::string& text)
+    {
+        text.assign(source, std::find(source, source + TEXT_FIELD_SIZE, '\0'));
+    }
+
+public:
+    static const size_t LENGTH_PREFIX_SIZE = 4;
+    static const size_t TEXT_FIELD_SIZE = 32;
+    static const size_t REQUEST_SIZE = 32 + TEXT_FIELD_SIZE;
+    static const size_t RESPONSE_SIZE = 16 + 3 * TEXT_FIELD_SIZE;
+    static const size_t REQUEST_FRAME_SIZE = LENGTH_PREFIX_SIZE + REQUEST_SIZE;
+    static const size_t RESPONSE_FRAME_SIZE = LENGTH_PREFIX_SIZE + RESPONSE_SIZE;
+    static const size_t MAX_PAYLOAD_SIZE = RESPONSE_SIZE;
+
+    static sf::Uint32 readLength(const char* frame)
+    {
+        return read<sf::Uint32>(frame);
+    }
+
+    // Writes REQUEST_FRAME_SIZE bytes
+    static void encodeRequest(sf::Uint32 id, const TransactionRequest& request, char* frame)
+    {
+        write<sf::Uint32>(frame, REQUEST_SIZE);
+        char* payload = frame + LENGTH_PREFIX_SIZE;
+        write<sf::Uint32>(payload, id);
+        write<sf::Uint8>(payload + 4, static_cast<sf::Uint8>(request.type));
+        write<sf::Uint8>(payload + 5, 0);
+        write<sf::Uint16>(payload + 6, request.pin);
+        write<sf::Uint64>(payload + 8, request.amount);
+        write<sf::Uint64>(payload + 16, request.transactionId);
+        write<sf::Uint64>(payload + 24, request.cardId);
+        writeText(payload + 32, request.iban);
+    }
+
+    static bool decodeRequest(const char* payload, size_t size, sf::Uint32& id, TransactionRequest& request)
+    {
+        if (size != REQUEST_SIZE) return false;
+        id = read<sf::Uint32>(payload);
+        request.type = static_cast<TransactionType>(read<sf::Uint8>(payload + 4));
+        request.pin = read<sf::Uint16>(payload + 6);
+        request.amount = read<sf::Uint64>(payload + 8);
+        request.transactionId = read<sf::Uint64>(payload + 16);
+        request.cardId = read<sf::Uint64>(payload + 24);
+        readText(payload + 32, request.iban);
+        return true;
+    }
+
+    // Writes RESPONSE_FRAME_SIZE bytes
+    static void encodeResponse(sf::Uint32 id, const TransactionResponse& response, char* frame)
+    {
+        write<sf::Uint32>(frame, RESPONSE_SIZE);
+        char* payload = frame + LENGTH_PREFIX_SIZE;
+        write<sf::Uint32>(payload, id);
+        write<sf::Uint8>(payload + 4, static_cast<sf::Uint8>((response.approved ? 1 : 0) | (response.replayed ? 2 : 0)
+                                                            | (response.cardSuspended ? 4 : 0)));
+        write<sf::Uint8>(payload + 5, static_cast<sf::Uint8>(std::min(response.pinAttemptsLeft, 255u)));
+        write<sf::Uint16>(payload + 6, 0);
+        write<sf::Uint64>(payload + 8, response.balance);
+        writeText(payload + 16, response.iban);
+        writeText(payload + 16 + TEXT_FIELD_SIZE, response.lastName);
+        writeText(payload + 16 + 2 * TEXT_FIELD_SIZE, response.firstName);
+    }
+
+    static bool decodeResponse(const char* payload, size_t size, sf::Uint32& id, TransactionResponse& response)
+    {
+        if (size != RESPONSE_SIZE) return false;
+        id = read<sf::Uint32>(payload);
+        response.answered = true;
+        sf::Uint8 flags = read<sf::Uint8>(payload + 4);
+        response.approved = (flags & 1) != 0;
+        response.replayed = (flags & 2) != 0;
+        response.cardSuspended = (flags & 4) != 0;
+        response.pinAttemptsLeft = read<sf::Uint8>(payload + 5);
+        response.balance = read<sf::Uint64>(payload + 8);
+        readText(payload + 16, response.iban);
+        readText(payload + 16 + TEXT_FIELD_SIZE, response.lastName);
+        readText(payload + 16 + 2 * TEXT_FIELD_SIZE, response.firstName);
+        return true;
+    }
+};
+
+// Bytes received from a socket, split into frames in place
+class FrameBuffer
+{
+private:
+    static const size_t RECEIVE_CHUNK = 4096;
+    std::vector<char> data;
+    size_t begin = 0, end = 0;                 // The unread bytes are [begin, end)
+
+public:
+    // Appends what the socket has (blocking sockets wait for at least one byte)
+    sf::Socket::Status receiveFrom(sf::TcpSocket& socket)
+    {
+        if (begin == end)
+            begin = end = 0;
+        else if (begin > 0 && data.size() - end < RECEIVE_CHUNK)
+        {
+            std::memmove(data.data(), data.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (data.size() - end < RECEIVE_CHUNK)
+            data.resize(end + RECEIVE_CHUNK);
+        size_t received = 0;
+        sf::Socket::Status status = socket.receive(data.data() + end, data.size() - end, received);
+        end += received;
+        return status;
+    }
+
+    // Points payload at the next complete frame; it stays valid until the next receiveFrom()
+    bool nextFrame(const char*& payload, size_t& size)
+    {
+        if (end - begin < TransactionCodec::LENGTH_PREFIX_SIZE) return false;
+        size_t length = TransactionCodec::readLength(data.data() + begin);
+        if (length > TransactionCodec::MAX_PAYLOAD_SIZE || end - begin < TransactionCodec::LENGTH_PREFIX_SIZE + length) return false;
+        payload = data.data() + begin + TransactionCodec::LENGTH_PREFIX_SIZE;
+        size = length;
+        begin += TransactionCodec::LENGTH_PREFIX_SIZE + length;
+        return true;
+    }
+
+    bool hasFrame() const
+    {
+        if (end - begin < TransactionCodec::LENGTH_PREFIX_SIZE) return false;
+        size_t length = TransactionCodec::readLength(data.data() + begin);
+        return end - begin >= TransactionCodec::LENGTH_PREFIX_SIZE + length;
+    }
+
+    // A length no frame can have; the peer is not speaking this protocol
+    bool isMalformed() const
+    {
+        return end - begin >= TransactionCodec::LENGTH_PREFIX_SIZE
+               && TransactionCodec::readLength(data.data() + begin) > TransactionCodec::MAX_PAYLOAD_SIZE;
+    }
+
+    void clear()
+    {
+        begin = end = 0;
+    }
+};
+
+// A line journal that survives a crash at any point. An appended line is on the disk when append() returns, and
+//  the journal is only ever rewritten as a whole: into a temporary file next to it that is synced and then
+//  renamed over it, so what is on the disk is either the old journal or the new one. Not thread-safe.
+class DurableJournal
+{
+private:
+    std::string path;
+    std::FILE* file = nullptr;
+
+    static bool sync(std::FILE* file)
+    {
+        if (std::fflush(file) != 0) return false;
+#ifdef TARGET_WIN
+        return _commit(_fileno(file)) == 0;
+#else
+        return fsync(fileno(file)) == 0;
+#endif
+    }
+
+    // Atomic on both; the directory is synced too on POSIX, so the rename itself is on the disk
+    static bool replace(const std::string& from, const std::string& to)
+    {
+#ifdef TARGET_WIN
+        return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        if (std::rename(from.c_str(), to.c_str()) != 0) return false;
+        size_t separator = to.find_last_of('/');
+        std::string directory = separator == std::string::npos ? "." : to.substr(0, separator + 1);
+        int descriptor = ::open(directory.c_str(), O_RDONLY);
+        if (descriptor < 0) return true;
+        fsync(descriptor);
+        ::close(descriptor);
+        return true;
+#endif
+    }
+
+public:
+    ~DurableJournal()
+    {
+        close();
+    }
+
+    // Keeps what is there and appends to it
+    bool open(const std::string& journalPath)
+    {
+        close();
+        path = journalPath;
+        file = std::fopen(path.c_str(), "ab");
+        return file != nullptr;
+    }
+
+    // Replaces the journal at path with content, then keeps it open for appending
+    bool rewrite(const std::string& journalPath, const std::string& content)
+    {
+        close();
+        path = journalPath;
+        std::string temporaryPath = path + ".tmp";
+        std::FILE* temporary = std::fopen(temporaryPath.c_str(), "wb");
+        if (temporary == nullptr) return false;
+        bool written = std::fwrite(content.data(), 1, content.size(), temporary) == content.size() && sync(temporary);
+        written = std::fclose(temporary) == 0 && written;
+        if (!written || !replace(temporaryPath, path))
+        {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+        file = std::fopen(path.c_str(), "ab");
+        return file != nullptr;
+    }
+
+    // Same path, new content: what compaction does
+    bool rewrite(const std::string& content)
+    {
+        return rewrite(path, content);
+    }
+
+    bool append(const std::string& line)
+    {
+        if (file == nullptr) return false;
+        return std::fwrite(line.data(), 1, line.size(), file) == line.size() && sync(file);
+    }
+
+    bool isOpen() const
+    {
+        return file != nullptr;
+    }
+
+    void close()
+    {
+        if (file != nullptr)
+            std::fclose(file);
+        file = nullptr;
+    }
+};
+
+// Transaction ids for a terminal's deposits and withdrawals: a random prefix in the high half and a counter in the
+//  low half, so ids from different terminals, and from one terminal across restarts, do not collide in practice.
+//  Never 0, which stands for no id.
+class TransactionIdSource
+{
+private:
+    sf::Uint32 prefix;
+    sf::Uint32 counter = 0;
+
+    void drawPrefix()
+    {
+        std::random_device device;
+        do
+            prefix = device() ^ static_cast<sf::Uint32>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+        while (prefix == 0);
+    }
+
+public:
+    TransactionIdSource()
+    {
+        drawPrefix();
+    }
+
+    sf::Uint64 next()
+    {
+        if (++counter == 0)
+        {
+            drawPrefix();
+            counter = 1;
+        }
+        return (static_cast<sf::Uint64>(prefix) << 32) | counter;
+    }
+};
+
+// The outcome of every deposit and withdrawal a ledger applied within the window, by transaction id, so one that
+//  comes again (a terminal retrying after a timeout, or forwarding what it stood in for) gets its original result
+//  instead of being applied twice. The table has a fixed number of buckets of six slots, each bucket two adjacent
+//  cache lines that are fetched together, and an id can only sit in its own bucket, so a lookup is one memory
+//  access however full the table is. An entry is free to be replaced
+//  once it is older than the window; when a bucket has no such entry its oldest one is replaced early (counted in
+//  getEarlyEvictions), which means the table is too small for the transactions of one window. Not thread-safe.
+class DedupTable
+{
+public:
+    struct Result
+    {
+        bool approved;
+        unsigned long long int balance;
+    };
+
+private:
+    static const size_t SLOTS_PER_BUCKET = 6;
+    static const size_t BUCKET_SIZE = 128;
+
+    struct Bucket
+    {
+        sf::Uint64 ids[SLOTS_PER_BUCKET];          // 0 for a slot never used
+        sf::Uint64 balances[SLOTS_PER_BUCKET];
+        sf::Uint32 stamps[SLOTS_PER_BUCKET];       // Caller's clock in milliseconds, when stored
+        sf::Uint32 approvedSlots;                  // Bit per slot
+        sf::Uint32 padding;
+    };
+    static_assert(sizeof(Bucket) == BUCKET_SIZE, "A bucket should fill two cache lines");
+
+    sf::Uint32 window;                             // Milliseconds
+    unsigned int bucketBits;
+    std::unique_ptr<char[]> memory;                // Allocated on the first insert; buckets points into it, aligned
+    Bucket* buckets = nullptr;
+    unsigned long long int earlyEvictions = 0;
+
+    size_t getBucketIndex(sf::Uint64 id) const
+    {
+        // Fibonacci hashing: the high bits of the product depend on all bits of the id, counter and prefix alike
+        return static_cast<size_t>((id * 0x9E3779B97F4A7C15ull) >> (64 - bucketBits));
+    }
+
+public:
+    // bucketBits: the table has 2^bucketBits buckets (128 bytes each) and holds six times as many entries
+    DedupTable(sf::Time window, unsigned int bucketBits)
+        : window(static_cast<sf::Uint32>(window.asMilliseconds())), bucketBits(bucketBits) {}
+
+    // Ids are only seen again within the window; now is in milliseconds and may wrap around
+    bool find(sf::Uint64 id, sf::Uint32 now, Result& result) const
+    {
+        if (buckets == nullptr) return false;
+        const Bucket& bucket = buckets[getBucketIndex(id)];
+        for (size_t i = 0; i < SLOTS_PER_BUCKET; i++)
+            if (bucket.ids[i] == id && now - bucket.stamps[i] < window)
+            {
+                result.approved = (bucket.approvedSlots >> i & 1) != 0;
+                result.balance = bucket.balances[i];
+                return true;
+            }
+        return false;
+    }
+
+    // For an id that find() did not return, or to replace the result find() returned for it
+    void insert(sf::Uint64 id, sf::Uint32 now, const Result& result)
+    {
+        if (buckets == nullptr)
+        {
+            size_t size = sizeof(Bucket) << bucketBits;
+            memory.reset(new char[size + BUCKET_SIZE]);
+            char* aligned = memory.get() + (BUCKET_SIZE - reinterpret_cast<size_t>(memory.get()) % BUCKET_SIZE);
+            std::memset(aligned, 0, size);
+            buckets = reinterpret_cast<Bucket*>(aligned);
+        }
+        Bucket& bucket = buckets[getBucketIndex(id)];
+        size_t slot = 0;
+        sf::Uint32 slotAge = 0;
+        for (size_t i = 0; i < SLOTS_PER_BUCKET; i++)
+        {
+            sf::Uint32 age = now - bucket.stamps[i];
+            if (bucket.ids[i] == id || bucket.ids[i] == 0 || age >= window)
+            {
+                slot = i;
+                slotAge = window;
+                break;
+            }
+            if (age >= slotAge)
+            {
+                slot = i;
+                slotAge = age;
+            }
+        }
+        if (slotAge < window)
+            earlyEvictions++;
+        bucket.ids[slot] = id;
+        bucket.balances[slot] = result.balance;
+        bucket.stamps[slot] = now;
+        if (result.approved)
+            bucket.approvedSlots |= 1u << slot;
+        else
+            bucket.approvedSlots &= ~(1u << slot);
+    }
+
+    size_t getCapacity() const
+    {
+        return SLOTS_PER_BUCKET << bucketBits;
+    }
+
+    unsigned long long int getEarlyEvictions() const
+    {
+        return earlyEvictions;
+    }
+};
+
+// Wrong PIN attempts and suspensions by card id, the cards a ledger consults before anything else. A card is
+//  suspended when its wrong PINs reach the limit, until the suspension runs out (on the wall clock, so it counts
+//  across restarts); the right PIN clears its count. Only cards with wrong PINs or a suspension have an entry.
+//  Cards are spread over shards by id, each with its own lock, so terminals checking different cards do not wait
+//  for each other or for the ledger. With a journal open, every change is appended as a line ("cardId wrongPins
+//  suspendedUntil") and on the disk before the call returns; opening it again keeps the last line of each card
+//  (see DurableJournal).
+class CardStatusTable
+{
+private:
+    struct Status
+    {
+        unsigned int wrongPins = 0;
+        std::time_t suspendedUntil = 0;        // 0 when not suspended
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_map<sf::Uint64, Status> cards;
+    };
+
+    static const unsigned int SHARD_BITS = 6;
+    Shard shards[1 << SHARD_BITS];
+    unsigned int maxWrongPins;
+    std::time_t suspensionSeconds;
+    std::mutex journalMutex;                   // Taken with a shard locked, never the other way around
+    DurableJournal journal;
+
+    Shard& getShard(sf::Uint64 cardId)
+    {
+        return shards[(cardId * 0x9E3779B97F4A7C15ull) >> (64 - SHARD_BITS)];
+    }
+
+    // With the card's shard locked, so the journal has its changes in order
+    void persist(sf::Uint64 cardId, const Status& status)
+    {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        std::ostringstream line;
+        line << cardId << " " << status.wrongPins << " " << status.suspendedUntil << "\n";
+        journal.append(line.str());
+    }
+
+    bool isActive(const Status& status, std::time_t now) const
+    {
+        return status.suspendedUntil > now || (status.suspendedUntil == 0 && status.wrongPins > 0);
+    }
+
+public:
+    CardStatusTable(unsigned int maxWrongPins, sf::Time suspension)
+        : maxWrongPins(maxWrongPins), suspensionSeconds(static_cast<std::time_t>(suspension.asSeconds())) {}
+
+    // Replays the journal, then rewrites it with the cards whose count or suspension still holds
+    bool open(const std::string& path)
+    {
+        std::map<sf::Uint64, Status> replayed;
+        std::ifstream previous(path);
+        std::string line;
+        while (std::getline(previous, line))
+        {
+            std::istringstream fields(line);
+            sf::Uint64 cardId;
+            Status status;
+            if (fields >> cardId >> status.wrongPins >> status.suspendedUntil)
+                replayed[cardId] = status;
+        }
+        previous.close();
+
+        std::time_t now = std::time(nullptr);
+        std::lock_guard<std::mutex> lock(journalMutex);
+        std::ostringstream compacted;
+        for (const std::pair<const sf::Uint64, Status>& card : replayed)
+        {
+            if (!isActive(card.second, now)) continue;
+            Shard& shard = getShard(card.first);
+            std::lock_guard<std::mutex> shardLock(shard.mutex);
+            shard.cards[card.first] = card.second;
+            compacted << card.first << " " << card.second.wrongPins << " " << card.second.suspendedUntil << "\n";
+        }
+        return journal.rewrite(path, compacted.str());
+    }
+
+    bool isSuspended(sf::Uint64 cardId)
+    {
+        Shard& shard = getShard(cardId);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::unordered_map<sf::Uint64, Status>::iterator found = shard.cards.find(cardId);
+        return found != shard.cards.end() && found->second.suspendedUntil > std::time(nullptr);
+    }
+
+    // Returns the attempts left before the card is suspended, 0 once it is
+    unsigned int recordWrongPin(sf::Uint64 cardId)
+    {
+        Shard& shard = getShard(cardId);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Status& status = shard.cards[cardId];
+        std::time_t now = std::time(nullptr);
+        if (status.suspendedUntil != 0 && status.suspendedUntil <= now)
+            status = Status();                 // A suspension that ran out starts the count over
+        if (status.suspendedUntil == 0)
+        {
+            status.wrongPins++;
+            if (status.wrongPins >= maxWrongPins)
+                status.suspendedUntil = now + suspensionSeconds;
+        }
+        persist(cardId, status);
+        return status.suspendedUntil != 0 ? 0 : maxWrongPins - status.wrongPins;
+    }
+
+    void recordRightPin(sf::Uint64 cardId)
+    {
+        Shard& shard = getShard(cardId);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.cards.erase(cardId) > 0)
+            persist(cardId, Status());
+    }
+
+    unsigned int getWrongPins(sf::Uint64 cardId)
+    {
+        Shard& shard = getShard(cardId);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::unordered_map<sf::Uint64, Status>::iterator found = shard.cards.find(cardId);
+        return found != shard.cards.end() ? found->second.wrongPins : 0;
+    }
+
+    size_t getSuspendedCount()
+    {
+        size_t suspended = 0;
+        std::time_t now = std::time(nullptr);
+        for (Shard& shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const std::pair<const sf::Uint64, Status>& card : shard.cards)
+                if (card.second.suspendedUntil > now)
+                    suspended++;
+        }
+        return suspended;
+    }
+};
+
+struct LedgerAccount
+{
+    std::string iban;
+    std::string lastName;
+    std::string firstName;
+    unsigned short int pin;
+    unsigned long long int balance;
+    sf::Uint64 cardId;                         // The account's card, 0 for none
+};
+
+// Accounts and their balances, and the only code that changes them. Thread-safe, so a host can share one
+//  ledger between all of its terminals. A deposit or withdrawal with a transaction id it has applied within the
+//  dedup window is not applied again, but answered with its original result. With a transaction journal open,
+//  every deposit and withdrawal is appended to it ("transactionId approved balance time iban": the balance after
+//  it, time on the wall clock) and on the disk before it is answered, so the balances and the dedup window it
+//  vouches for both hold across a restart. Card checks and PIN verifications that name a card
+//  consult and update its status, so a card suspended at one terminal is at all of them.
+class Ledger
+{
+private:
+    std::mutex mutex;
+    std::map<std::string, LedgerAccount> accounts;             // By IBAN
+    std::map<sf::Uint64, std::string> ibansByCard;             // The card picks the account and the PIN must match it
+    std::map<unsigned short int, std::string> ibansByPin;      // Only for requests that name no card
+    // Long enough for a terminal that stood in for the host through an outage to forward what it approved;
+    //  2^16 buckets hold 393216 transactions (8 MB, allocated with the first one)
+    const sf::Time DEDUP_WINDOW = sf::seconds(24 * 60 * 60);
+    static const unsigned int DEDUP_BUCKET_BITS = 16;
+    static const unsigned int MAX_WRONG_PINS = 3;
+    const sf::Time CARD_SUSPENSION = sf::seconds(24 * 60 * 60);
+    sf::Clock clock;                                           // For the dedup window
+    DedupTable applied;
+    DurableJournal transactionJournal;
+    unsigned long long int replays = 0;
+    CardStatusTable cardStatuses;                              // Has its own locks
+
+public:
+    // A forced withdrawal that went past the balance: the account was left at zero and is short by amount
+    struct Shortfall
+    {
+        std::string iban;
+        sf::Uint64 transactionId;
+        unsigned long long int amount;
+    };
+
+private:
+    std::vector<Shortfall> shortfalls;                         // Not taken by takeShortfalls() yet
+
+    LedgerAccount* find(const TransactionRequest& request)
+    {
+        std::string iban = request.iban;
+        if (request.type == TransactionType::PIN_VERIFY && request.cardId != 0)
+        {
+            std::map<sf::Uint64, std::string>::iterator found = ibansByCard.find(request.cardId);
+            if (found == ibansByCard.end()) return nullptr;
+            iban = found->second;
+        }
+        else if (request.type == TransactionType::PIN_VERIFY)
+        {
+            std::map<unsigned short int, std::string>::iterator found = ibansByPin.find(request.pin);
+            if (found == ibansByPin.end()) return nullptr;
+            iban = found->second;
+        }
+        std::map<std::string, LedgerAccount>::iterator found = accounts.find(iban);
+        return found != accounts.end() ? &found->second : nullptr;
+    }
+
+    // Everything but the card status, under the ledger's lock
+    TransactionResponse apply(const TransactionRequest& request)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        TransactionResponse response;
+        response.answered = true;
+        bool forced = request.type == TransactionType::FORCED_WITHDRAWAL || request.type == TransactionType::FORCED_DEPOSIT;
+        bool changesBalance = request.type == TransactionType::WITHDRAWAL || request.type == TransactionType::DEPOSIT || forced;
+        bool applies = changesBalance && request.transactionId != 0;
+        sf::Uint32 now = static_cast<sf::Uint32>(clock.getElapsedTime().asMilliseconds());
+        DedupTable::Result original;
+        // An advice for an online attempt that was declined (and whose reply the terminal never got) is posted now:
+        //  the terminal paid out or took in the cash after all
+        if (applies && applied.find(request.transactionId, now, original) && (original.approved || !forced))
+        {
+            replays++;
+            response.approved = original.approved;
+            response.balance = original.balance;
+            response.replayed = true;
+            return response;
+        }
+        LedgerAccount* account = find(request);
+        if (account == nullptr) return response;
+        switch (request.type)
+        {
+        case TransactionType::PIN_VERIFY:
+            response.approved = account->pin == request.pin;
+            if (!response.approved) break;
+            response.iban = account->iban;
+            response.lastName = account->lastName;
+            response.firstName = account->firstName;
+            break;
+        case TransactionType::BALANCE_INQUIRY:
+            response.approved = true;
+            break;
+        case TransactionType::WITHDRAWAL:
+            response.approved = request.amount <= account->balance;
+            if (response.approved)
+                account->balance -= request.amount;
+            break;
+        case TransactionType::DEPOSIT:
+        case TransactionType::FORCED_DEPOSIT:
+            response.approved = true;
+            account->balance += request.amount;
+            break;
+        case TransactionType::FORCED_WITHDRAWAL:
+            response.approved = true;
+            // Balances can't go below zero, so what is missing is kept for reconciliation instead
+            if (request.amount > account->balance)
+                shortfalls.push_back(Shortfall { account->iban, request.transactionId, request.amount - account->balance });
+            account->balance -= std::min(request.amount, account->balance);
+            break;
+        }
+        if (response.approved)
+            response.balance = account->balance;
+        if (applies)
+            applied.insert(request.transactionId, now, DedupTable::Result { response.approved, response.balance });
+        if (changesBalance && transactionJournal.isOpen())
+        {
+            std::ostringstream line;
+            line << request.transactionId << " " << response.approved << " " << response.balance << " " << std::time(nullptr)
+                 << " " << account->iban << "\n";
+            transactionJournal.append(line.str());
+        }
+        return response;
+    }
+
+public:
+    Ledger() : applied(DEDUP_WINDOW, DEDUP_BUCKET_BITS), cardStatuses(MAX_WRONG_PINS, CARD_SUSPENSION) {}
+
+    // Keeps the card statuses in a journal, so suspensions survive a restart; without one they last as long as
+    //  the process
+    bool openCardStatuses(const std::string& path)
+    {
+        return cardStatuses.open(path);
+    }
+
+    // After the accounts are added: replays the transaction journal, so every account the journal has an approved
+    //  transaction for takes the balance after the last one and the dedup table gets the results still within the
+    //  window. Then rewrites the journal with those results, followed by the last approved transaction of every
+    //  account, so the balances replay the same way even when that one is older (or the wall clock went back).
+    bool openTransactionJournal(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::time_t wallNow = std::time(nullptr);
+        sf::Uint32 now = static_cast<sf::Uint32>(clock.getElapsedTime().asMilliseconds());
+        sf::Uint32 window = static_cast<sf::Uint32>(DEDUP_WINDOW.asMilliseconds());
+        std::map<std::string, std::string> lastApproved;       // By IBAN
+        std::ostringstream withinWindow;
+        std::ifstream previous(path);
+        std::string line;
+        while (std::getline(previous, line))
+        {
+            std::istringstream fields(line);
+            sf::Uint64 transactionId;
+            DedupTable::Result result;
+            std::time_t stored;
+            std::string iban;
+            if (!(fields >> transactionId >> result.approved >> result.balance >> stored >> iban)) continue;   // Cut short by a crash
+            std::map<std::string, LedgerAccount>::iterator account = accounts.find(iban);
+            if (result.approved && account != accounts.end())
+                account->second.balance = result.balance;
+            if (stored > wallNow) stored = wallNow;
+            sf::Uint32 age = static_cast<sf::Uint32>(std::min<std::time_t>(wallNow - stored, window / 1000)) * 1000;
+            if (age < window)
+            {
+                // In journal order, so a later result for the same id replaces the earlier one as it did when applied
+                if (transactionId != 0)
+                    applied.insert(transactionId, now - age, result);
+                withinWindow << line << "\n";
+            }
+            if (result.approved)
+                lastApproved[iban] = line;
+        }
+        previous.close();
+        std::ostringstream compacted;
+        compacted << withinWindow.str();
+        for (const std::pair<const std::string, std::string>& account : lastApproved)
+            compacted << account.second << "\n";
+        return transactionJournal.rewrite(path, compacted.str());
+    }
+
+    // The first account with a given PIN keeps it for requests without a card; a card belongs to one account
+    void add(const LedgerAccount& account)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        accounts[account.iban] = account;
+        if (account.cardId != 0)
+            ibansByCard[account.cardId] = account.iban;
+        ibansByPin.insert(std::make_pair(account.pin, account.iban));
+    }
+
+    std::vector<LedgerAccount> getAccounts()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<LedgerAccount> copies;
+        for (const std::pair<const std::string, LedgerAccount>& account : accounts)
+            copies.push_back(account.second);
+        return copies;
+    }
+
+    std::vector<std::string> getIbans()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string> ibans;
+        for (const std::pair<const std::string, LedgerAccount>& account : accounts)
+            ibans.push_back(account.first);
+        return ibans;
+    }
+
+    TransactionResponse authorize(const TransactionRequest& request)
+    {
+        TransactionResponse response;
+        response.answered = true;
+        bool checksCard = request.cardId != 0
+                          && (request.type == TransactionType::CARD_CHECK || request.type == TransactionType::PIN_VERIFY);
+        if (checksCard && cardStatuses.isSuspended(request.cardId))
+        {
+            response.cardSuspended = true;
+            return response;
+        }
+        if (request.type == TransactionType::CARD_CHECK)
+        {
+            response.approved = true;
+            return response;
+        }
+        if (request.type == TransactionType::WRONG_PIN_ADVICE)
+        {
+            response.approved = request.cardId != 0;
+            if (response.approved)
+                cardStatuses.recordWrongPin(request.cardId);
+            return response;
+        }
+        response = apply(request);
+        if (checksCard && response.approved)
+            cardStatuses.recordRightPin(request.cardId);
+        else if (checksCard)
+        {
+            response.pinAttemptsLeft = cardStatuses.recordWrongPin(request.cardId);
+            response.cardSuspended = response.pinAttemptsLeft == 0;
+        }
+        return response;
+    }
+
+    // The shortfalls since the last call, for the host to log for reconciliation
+    std::vector<Shortfall> takeShortfalls()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Shortfall> taken;
+        taken.swap(shortfalls);
+        return taken;
+    }
+
+    // Deposits and withdrawals answered from the dedup table instead of being applied again
+    unsigned long long int getReplayCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return replays;
+    }
+
+    // Non-zero when the dedup table is too small for the window (see DedupTable)
+    unsigned long long int getDedupEarlyEvictions()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return applied.getEarlyEvictions();
+    }
+
+    size_t getSuspendedCardCount()
+    {
+        return cardStatuses.getSuspendedCount();
+    }
+
+    unsigned int getWrongPinCount(sf::Uint64 cardId)
+    {
+        return cardStatuses.getWrongPins(cardId);
+    }
+};
+
+// Answers requests off the main thread; the ATM only sees this interface. Handlers run in dispatchCompletions().
+class TransactionCore : public CommandWorker
+{
+public:
+    typedef std::function<void(const TransactionResponse& response)> ResponseHandler;
+
+    TransactionCore() : CommandWorker("transaction core") {}
+
+    virtual void request(const TransactionRequest& request, ResponseHandler handler) = 0;
+};
+
+// Authorizes against a ledger in this process, after the configured latency (a standalone terminal)
+class LocalTransactionCore : public TransactionCore
+{
+private:
+    Ledger& ledger;
+    sf::Time latency;
+
+public:
+    LocalTransactionCore(Ledger& ledger, sf::Time latency) : ledger(ledger), latency(latency) {}
+
+    ~LocalTransactionCore()
+    {
+        stop();
+    }
+
+    void request(const TransactionRequest& request, ResponseHandler handler) override
+    {
+        std::shared_ptr<TransactionResponse> response = std::make_shared<TransactionResponse>();
+        submit([this, request, response]() -> bool {
+            sf::sleep(latency);
+            *response = ledger.authorize(request);
+            return true;
+        }, [handler, response](bool ok) -> void {
+            handler(*response);
+        });
+    }
+};
+
+// A terminal's connection to a host. Requests carry an id chosen by the caller and the replies come back with it,
+//  so several can be in flight at once; sending and receiving may happen on different threads.
+class TransactionClient
+{
+private:
+    sf::TcpSocket socket;
+    FrameBuffer inbound;
+
+public:
+    bool connect(const sf::IpAddress& address, unsigned short int port, sf::Time timeout)
+    {
+        inbound.clear();
+        return socket.connect(address, port, timeout) == sf::Socket::Done;
+    }
+
+    void disconnect()
+    {
+        socket.disconnect();
+    }
+
+    bool send(sf::Uint32 id, const TransactionRequest& request)
+    {
+        char frame[TransactionCodec::REQUEST_FRAME_SIZE];
+        TransactionCodec::encodeRequest(id, request, frame);
+        // A non-blocking socket retries until the whole frame is out; it is small, so that is rare
+        size_t offset = 0;
+        while (offset < sizeof(frame))
+        {
+            size_t sent = 0;
+            sf::Socket::Status status = socket.send(frame + offset, sizeof(frame) - offset, sent);
+            offset += sent;
+            if (status == sf::Socket::Disconnected || status == sf::Socket::Error) return false;
+        }
+        return true;
+    }
+
+    // Done with the next reply. A blocking socket waits for it; a non-blocking one returns NotReady until it has
+    //  fully arrived. Error when the host sent something else.
+    sf::Socket::Status receive(sf::Uint32& id, TransactionResponse& response)
+    {
+        const char* payload;
+        size_t size;
+        while (!inbound.nextFrame(payload, size))
+        {
+            if (inbound.isMalformed()) return sf::Socket::Error;
+            sf::Socket::Status status = inbound.receiveFrom(socket);
+            if (status != sf::Socket::Done) return status;
+        }
+        return TransactionCodec::decodeResponse(payload, size, id, response) ? sf::Socket::Done : sf::Socket::Error;
+    }
+
+    // A reply that receive() returns without touching the socket
+    bool hasBufferedReply() const
+    {
+        return inbound.hasFrame();
+    }
+
+    sf::TcpSocket& getSocket()
+    {
+        return socket;
+    }
+};
+
+// Authorizes against a host's ledger over TCP. Requests are sent by the worker as they are made and replies are
+//  matched to them by id on a reader thread, so a prefetched request does not hold up the next one. Connects on
+//  the first request and again after a failure; requests the host did not answer come back unanswered. So does
+//  every request in flight once one of them has waited requestTimeout: a host that stops answering without hanging
+//  up fails the connection, which is made anew for the next request.
+//  Run inline, it sends on the caller's thread and collects the replies without blocking in pollInline().
+class RemoteTransactionCore : public TransactionCore
+{
+private:
+    sf::IpAddress address;
+    unsigned short int port;
+    sf::Time connectTimeout;
+    sf::Time requestTimeout;
+    TransactionClient client;
+    std::thread reader;
+    std::atomic<bool> stopping;
+    std::mutex pendingMutex;
+
+    struct PendingRequest
+    {
+        ResponseHandler handler;
+        sf::Time deadline;                                     // On deadlineClock
+    };
+
+    std::map<sf::Uint32, PendingRequest> pending;              // Sent and waiting for their replies, by id
+    sf::Clock deadlineClock;
+    bool connected = false;                                    // Replies are being read; guarded by pendingMutex
+    sf::Uint32 nextRequestId = 1;                              // Main thread only
+    const sf::Time READER_POLL_INTERVAL = sf::milliseconds(100);
+
+    void answer(ResponseHandler handler, const TransactionResponse& response)
+    {
+        post([handler, response](bool ok) -> void {
+            handler(response);
+        }, response.answered);
+    }
+
+    ResponseHandler takePending(sf::Uint32 id)
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        std::map<sf::Uint32, PendingRequest>::iterator found = pending.find(id);
+        if (found == pending.end()) return ResponseHandler();
+        ResponseHandler handler = found->second.handler;
+        pending.erase(found);
+        return handler;
+    }
+
+    // Some request has waited past its deadline
+    bool isOverdue()
+    {
+        sf::Time now = deadlineClock.getElapsedTime();
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        for (const std::pair<const sf::Uint32, PendingRequest>& request : pending)
+            if (request.second.deadline <= now) return true;
+        return false;
+    }
+
+    // Every request still waiting gets an unanswered response
+    void failPending()
+    {
+        std::map<sf::Uint32, PendingRequest> unanswered;
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            connected = false;
+            unanswered.swap(pending);
+        }
+        for (std::pair<const sf::Uint32, PendingRequest>& request : unanswered)
+            answer(request.second.handler, TransactionResponse());
+    }
+
+    // Worker thread
+    bool connectIfNeeded()
+    {
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            if (connected) return true;
+        }
+        if (reader.joinable())
+            reader.join();
+        client.disconnect();
+        if (!client.connect(address, port, connectTimeout)) return false;
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        connected = true;
+        if (isInline())
+            client.getSocket().setBlocking(false);
+        else
+            reader = std::thread(&RemoteTransactionCore::read, this);
+        return true;
+    }
+
+    // Worker thread
+    bool send(sf::Uint32 id, const TransactionRequest& request, ResponseHandler handler)
+    {
+        if (!connectIfNeeded())
+        {
+            answer(handler, TransactionResponse());
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            if (!connected)
+            {
+                answer(handler, TransactionResponse());
+                return false;
+            }
+            pending[id] = PendingRequest { handler, deadlineClock.getElapsedTime() + requestTimeout };
+        }
+        if (client.send(id, request)) return true;
+        handler = takePending(id);
+        if (handler)
+            answer(handler, TransactionResponse());
+        return false;
+    }
+
+    // Reader thread: runs until the connection fails, a request is overdue or the core stops, then answers
+    //  whatever is still pending
+    void read()
+    {
+        TRACE_THREAD_NAME("transaction core reader");
+        sf::SocketSelector selector;
+        selector.add(client.getSocket());
+        while (!stopping && !isOverdue())
+        {
+            if (!client.hasBufferedReply() && !selector.wait(READER_POLL_INTERVAL)) continue;
+            sf::Uint32 id;
+            TransactionResponse response;
+            if (client.receive(id, response) != sf::Socket::Done) break;
+            ResponseHandler handler = takePending(id);
+            if (handler)
+                answer(handler, response);
+        }
+        failPending();
+    }
+
+protected:
+    void onWorkerExit() override
+    {
+        stopping = true;
+        if (reader.joinable())
+            reader.join();
+        client.disconnect();
+    }
+
+    void pollInline() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            if (!connected) return;
+        }
+        if (isOverdue())
+        {
+            client.disconnect();
+            failPending();
+            return;
+        }
+        while (true)
+        {
+            sf::Uint32 id;
+            TransactionResponse response;
+            sf::Socket::Status status = client.receive(id, response);
+            if (status == sf::Socket::NotReady) return;
+            if (status != sf::Socket::Done)
+            {
+                client.disconnect();
+                failPending();
+                return;
+            }
+            ResponseHandler handler = takePending(id);
+            if (handler)
+                answer(handler, response);
+        }
+    }
+
+public:
+    RemoteTransactionCore(const std::string& address, unsigned short int port, sf::Time connectTimeout, sf::Time requestTimeout)
+        : address(address), port(port), connectTimeout(connectTimeout), requestTimeout(requestTimeout), stopping(false) {}
+
+    // Stops here, while onWorkerExit() still joins the reader
+    ~RemoteTransactionCore()
+    {
+        stop();
+    }
+
+    void request(const TransactionRequest& request, ResponseHandler handler) override
+    {
+        sf::Uint32 id = nextRequestId++;
+        submit([this, id, request, handler]() -> bool {
+            return send(id, request, handler);
+        }, Completion());
+    }
+};
+
+// A transaction the terminal approved while the host could not be reached, waiting to be forwarded to it
+struct OfflineAdvice
+{
+    sf::Uint32 sequence;                       // Also the id it is forwarded with; kept when the journal is replayed
+    TransactionRequest request;
+};
+
+// Offline approvals, kept in a journal file until the host has answered them, so they survive a restart. Every
+//  change is appended as a line ("Q sequence type iban amount transactionId cardId" when an advice is queued, with
+//  "-" for no IBAN, "A sequence" when the host answered it) and is on the disk before the call returns. Opening replays the journal and rewrites
+//  it with what is left, and it is rewritten empty whenever the queue empties, both through DurableJournal. The host
+//  force-posts advices, so it only declines one it cannot post at all (an unknown account); those are kept in a
+//  second journal (".rejected", in the same format) for reconciliation, since the cash has already changed hands.
+//  Thread-safe: the terminal queues, the sync thread forwards.
+class OfflineQueue
+{
+public:
+    struct Metrics
+    {
+        size_t depth = 0;
+        size_t peakDepth = 0;
+        unsigned long long int queued = 0;
+        unsigned long long int forwarded = 0;  // Answered by the host, approved or not
+        unsigned long long int rejected = 0;   // Declined by the host when forwarded, and left for reconciliation
+        unsigned long long int replayed = 0;   // Already applied by the host (its reply to the online attempt was lost)
+        sf::Time forwardingTime;               // Spent sending batches and waiting for their replies
+
+        // Advices per second while forwarding
+        float getDrainRate() const
+        {
+            return forwardingTime > sf::Time::Zero ? forwarded / forwardingTime.asSeconds() : 0.f;
+        }
+    };
+
+private:
+    std::mutex mutex;
+    DurableJournal journal;
+    DurableJournal rejectedJournal;
+    std::deque<OfflineAdvice> advices;         // Oldest first
+    std::vector<OfflineAdvice> rejected;       // Not taken by takeRejected() yet
+    std::set<sf::Uint32> inFlight;             // Handed out by takeBatch() and not answered or released yet
+    sf::Uint32 nextSequence = 1;
+    size_t capacity;
+    Metrics metrics;
+
+    static std::string formatQueued(const OfflineAdvice& advice)
+    {
+        std::ostringstream line;
+        line << "Q " << advice.sequence << " " << (int) advice.request.type << " "
+             << (advice.request.iban.empty() ? "-" : advice.request.iban) << " " << advice.request.amount << " "
+             << advice.request.transactionId << " " << advice.request.cardId << "\n";
+        return line.str();
+    }
+
+    void updateDepth()
+    {
+        metrics.depth = advices.size();
+        metrics.peakDepth = std::max(metrics.peakDepth, metrics.depth);
+    }
+
+public:
+    explicit OfflineQueue(size_t capacity) : capacity(capacity) {}
+
+    bool open(const std::string& journalPath)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<sf::Uint32, TransactionRequest> replayed;     // An advice journaled twice is queued once
+        std::ifstream previous(journalPath);
+        std::string line;
+        while (std::getline(previous, line))
+        {
+            std::istringstream fields(line);
+            char kind;
+            sf::Uint32 sequence;
+            if (!(fields >> kind >> sequence)) continue;       // Cut short by a crash
+            nextSequence = std::max(nextSequence, sequence + 1);
+            int type;
+            TransactionRequest request {};
+            if (kind == 'A')
+                replayed.erase(sequence);
+            else if (kind == 'Q' && fields >> type >> request.iban >> request.amount >> request.transactionId)
+            {
+                if (!(fields >> request.cardId))
+                    request.cardId = 0;                        // Journaled before advices had cards
+                if (request.iban == "-")
+                    request.iban.clear();
+                request.type = (TransactionType) type;
+                replayed[sequence] = request;
+            }
+        }
+        previous.close();
+
+        advices.clear();
+        inFlight.clear();
+        std::string compacted;
+        for (const std::pair<const sf::Uint32, TransactionRequest>& advice : replayed)
+        {
+            advices.push_back(OfflineAdvice { advice.first, advice.second });
+            compacted += formatQueued(advices.back());
+        }
+        updateDepth();
+        return journal.rewrite(journalPath, compacted) && rejectedJournal.open(journalPath + ".rejected");
+    }
+
+    // False when the queue is full or the advice could not be journaled
+    bool push(const TransactionRequest& request)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (advices.size() >= capacity || !journal.isOpen()) return false;
+        OfflineAdvice advice { nextSequence, request };
+        if (!journal.append(formatQueued(advice))) return false;
+        nextSequence++;
+        advices.push_back(advice);
+        metrics.queued++;
+        updateDepth();
+        return true;
+    }
+
+    // The oldest advices that are not in flight yet, which they then are
+    std::vector<OfflineAdvice> takeBatch(size_t maxSize)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<OfflineAdvice> batch;
+        for (const OfflineAdvice& advice : advices)
+        {
+            if (batch.size() == maxSize) break;
+            if (inFlight.insert(advice.sequence).second)
+                batch.push_back(advice);
+        }
+        return batch;
+    }
+
+    // The host answered an advice in flight, so it leaves the queue; anything else (a reply sent twice) is ignored
+    void acknowledge(sf::Uint32 sequence, const TransactionResponse& response)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (inFlight.erase(sequence) == 0) return;
+        std::deque<OfflineAdvice>::iterator found = std::find_if(advices.begin(), advices.end(),
+            [sequence](const OfflineAdvice& advice) -> bool { return advice.sequence == sequence; });
+        if (found == advices.end()) return;
+        if (!response.approved)
+        {
+            // Kept before the advice leaves the queue journal, so a crash in between leaves it in both, not in neither
+            rejectedJournal.append(formatQueued(*found));
+            rejected.push_back(*found);
+            metrics.rejected++;
+        }
+        advices.erase(found);
+        metrics.forwarded++;
+        if (response.replayed)
+            metrics.replayed++;
+        updateDepth();
+        if (advices.empty())
+            journal.rewrite("");
+        else
+            journal.append("A " + std::to_string(sequence) + "\n");
+    }
+
+    // Advices of a batch that went unanswered go out again with a later one
+    void release(const std::vector<OfflineAdvice>& batch)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const OfflineAdvice& advice : batch)
+            inFlight.erase(advice.sequence);
+    }
+
+    void addForwardingTime(sf::Time time)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        metrics.forwardingTime += time;
+    }
+
+    // What the withdrawals still in the queue for an account add up to, in flight or not
+    unsigned long long int getQueuedWithdrawals(const std::string& iban)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        unsigned long long int total = 0;
+        for (const OfflineAdvice& advice : advices)
+            if (advice.request.type == TransactionType::WITHDRAWAL && advice.request.iban == iban)
+                total += advice.request.amount;
+        return total;
+    }
+
+    // Some advice is waiting and not in flight
+    bool hasWaiting()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return advices.size() > inFlight.size();
+    }
+
+    Metrics getMetrics()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return metrics;
+    }
+
+    // The advices the host declined since the last call; the rejected journal keeps them all
+    std::vector<OfflineAdvice> takeRejected()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<OfflineAdvice> taken;
+        taken.swap(rejected);
+        return taken;
+    }
+};
+
+// A remote core that keeps the terminal working while the host cannot be reached. It remembers the cards the host
+//  recently verified and their balances; when a request goes unanswered it stands in for the host: it approves the
+//  PINs of remembered cards, their balance inquiries and deposits, and withdrawals within the last known balance
+//  and the card's offline limit. Deposits and withdrawals it approves are queued durably and forwarded by a sync
+//  thread over a connection of its own, in pipelined batches, once the host answers again. They keep their
+//  transaction ids, so one the host applied before its reply was lost is not applied twice. Until then requests
+//  are stood in for at once, without trying the host.
+class StoreAndForwardCore : public RemoteTransactionCore
+{
+public:
+    struct Policy
+    {
+        unsigned long long int withdrawalLimit;    // Per card, withdrawn offline and not forwarded to the host yet
+        size_t maxCachedCards;                     // The least recently used one is forgotten first
+        size_t maxQueuedAdvices;                   // Beyond this, offline deposits and withdrawals are declined
+        unsigned int maxWrongPins;                 // Offline, before the card is suspended at this terminal
+    };
+
+private:
+    struct CachedCard
+    {
+        unsigned short int pin;
+        std::string lastName;
+        std::string firstName;
+        unsigned long long int balance;            // As the host last reported it, with what was stood in for since
+        unsigned long long int withdrawnOffline;
+        unsigned long long int lastUsed;
+    };
+
+    Policy policy;
+    OfflineQueue queue;
+    bool journalOpen;
+    std::atomic<bool> hostReachable;
+
+    //- Main thread
+    std::map<std::string, CachedCard> cards;                   // By IBAN
+    std::map<sf::Uint64, std::string> ibansByCard;             // The card the host verified a PIN for
+    std::map<unsigned short int, std::string> ibansByPin;      // Only for requests that name no card
+    std::set<sf::Uint64> suspendedCards;                       // As the host reported them, or suspended offline
+    std::map<sf::Uint64, unsigned int> offlineWrongPins;
+    unsigned long long int useCounter = 0;
+    unsigned long long int stoodIn = 0;
+    unsigned long long int declinedOffline = 0;
+
+    //- Sync thread
+    sf::IpAddress syncAddress;
+    unsigned short int syncPort;
+    sf::Time syncConnectTimeout;
+    TransactionClient syncClient;
+    std::thread syncThread;
+    std::mutex syncMutex;
+    std::condition_variable syncWake;
+    bool syncStopping = false;                                 // Guarded by syncMutex
+    const size_t SYNC_BATCH_SIZE = 64;
+    const sf::Time SYNC_RETRY_INTERVAL = sf::seconds(1);
+    const sf::Time SYNC_REPLY_TIMEOUT = sf::seconds(5);
+
+    void wakeSync()
+    {
+        {
+            std::lock_guard<std::mutex> lock(syncMutex);
+        }
+        syncWake.notify_one();
+    }
+
+    void forgetLeastRecentlyUsed()
+    {
+        std::map<std::string, CachedCard>::iterator oldest = cards.begin();
+        for (std::map<std::string, CachedCard>::iterator card = cards.begin(); card != cards.end(); ++card)
+            if (card->second.lastUsed < oldest->second.lastUsed)
+                oldest = card;
+        if (oldest == cards.end()) return;
+        std::map<unsigned short int, std::string>::iterator pin = ibansByPin.find(oldest->second.pin);
+        if (pin != ibansByPin.end() && pin->second == oldest->first)
+            ibansByPin.erase(pin);
+        for (std::map<sf::Uint64, std::string>::iterator card = ibansByCard.begin(); card != ibansByCard.end();)
+            if (card->second == oldest->first)
+                card = ibansByCard.erase(card);
+            else
+                ++card;
+        cards.erase(oldest);
+    }
+
+    // An answer from the host refreshes what the terminal knows of the card
+    void remember(const TransactionRequest& request, const TransactionResponse& response)
+    {
+        if (request.cardId != 0 && (request.type == TransactionType::CARD_CHECK || request.type == TransactionType::PIN_VERIFY))
+        {
+            if (response.cardSuspended)
+                suspendedCards.insert(request.cardId);
+            else if (response.approved)
+            {
+                suspendedCards.erase(request.cardId);
+                offlineWrongPins.erase(request.cardId);
+            }
+        }
+        if (!response.approved || request.type == TransactionType::CARD_CHECK) return;
+        std::map<std::string, CachedCard>::iterator card;
+        if (request.type == TransactionType::PIN_VERIFY)
+        {
+            card = cards.find(response.iban);
+            if (card == cards.end())
+            {
+                if (cards.size() >= policy.maxCachedCards)
+                    forgetLeastRecentlyUsed();
+                card = cards.insert(std::make_pair(response.iban, CachedCard())).first;
+            }
+            card->second.pin = request.pin;
+            card->second.lastName = response.lastName;
+            card->second.firstName = response.firstName;
+            if (request.cardId != 0)
+                ibansByCard[request.cardId] = response.iban;
+            else
+                ibansByPin[request.pin] = response.iban;
+        }
+        else
+        {
+            card = cards.find(request.iban);
+            if (card == cards.end()) return;
+        }
+        // Withdrawals approved offline and not forwarded yet are not in the host's balance, and still count towards
+        //  the offline limit. One the host applied but whose answer the sync thread has not taken yet is counted
+        //  twice for a moment, which errs on the safe side; queued deposits are left out for the same reason.
+        unsigned long long int queuedWithdrawals = queue.getQueuedWithdrawals(card->first);
+        card->second.balance = response.balance - std::min(response.balance, queuedWithdrawals);
+        card->second.withdrawnOffline = queuedWithdrawals;
+        card->second.lastUsed = ++useCounter;
+    }
+
+    // Offline wrong PINs count towards a suspension at this terminal, and are queued as advices so the host counts
+    //  them too once it is back (best effort: with the queue full, only this terminal counts them)
+    void recordWrongPin(sf::Uint64 cardId, TransactionResponse& response)
+    {
+        if (queue.push(TransactionRequest { TransactionType::WRONG_PIN_ADVICE, "", 0, 0, 0, cardId }))
+            wakeSync();
+        unsigned int& wrongPins = offlineWrongPins[cardId];
+        wrongPins++;
+        if (wrongPins < policy.maxWrongPins)
+        {
+            response.pinAttemptsLeft = policy.maxWrongPins - wrongPins;
+            return;
+        }
+        offlineWrongPins.erase(cardId);
+        suspendedCards.insert(cardId);
+        response.cardSuspended = true;
+    }
+
+    TransactionResponse standIn(const TransactionRequest& request)
+    {
+        TransactionResponse response;
+        response.answered = true;
+        response.standIn = true;
+        stoodIn++;
+        bool checksCard = request.cardId != 0
+                          && (request.type == TransactionType::CARD_CHECK || request.type == TransactionType::PIN_VERIFY);
+        if (checksCard && suspendedCards.count(request.cardId) > 0)
+        {
+            response.cardSuspended = true;
+            declinedOffline++;
+            return response;
+        }
+        if (request.type == TransactionType::CARD_CHECK)
+        {
+            response.approved = true;
+            return response;
+        }
+        std::string iban = request.iban;
+        if (request.type == TransactionType::PIN_VERIFY && request.cardId != 0)
+        {
+            std::map<sf::Uint64, std::string>::iterator found = ibansByCard.find(request.cardId);
+            if (found != ibansByCard.end())
+                iban = found->second;
+        }
+        else if (request.type == TransactionType::PIN_VERIFY)
+        {
+            std::map<unsigned short int, std::string>::iterator found = ibansByPin.find(request.pin);
+            if (found != ibansByPin.end())
+                iban = found->second;
+        }
+        std::map<std::string, CachedCard>::iterator found = cards.find(iban);
+        // A card this terminal has not seen verified: its PIN cannot be checked, which does not make it a wrong one
+        if (found == cards.end())
+        {
+            response.unknownOffline = request.type == TransactionType::PIN_VERIFY;
+            declinedOffline++;
+            return response;
+        }
+        // The card's own PIN, as the host last verified it
+        if (request.type == TransactionType::PIN_VERIFY && found->second.pin != request.pin)
+        {
+            if (checksCard)
+                recordWrongPin(request.cardId, response);
+            declinedOffline++;
+            return response;
+        }
+        CachedCard& card = found->second;
+        card.lastUsed = ++useCounter;
+        switch (request.type)
+        {
+        case TransactionType::PIN_VERIFY:
+            response.approved = true;
+            offlineWrongPins.erase(request.cardId);
+            response.iban = iban;
+            response.lastName = card.lastName;
+            response.firstName = card.firstName;
+            break;
+        case TransactionType::BALANCE_INQUIRY:
+            response.approved = true;
+            break;
+        case TransactionType::WITHDRAWAL:
+            response.approved = request.amount <= card.balance
+                                 && card.withdrawnOffline + request.amount <= policy.withdrawalLimit
+                                 && queue.push(request);
+            if (response.approved)
+            {
+                card.balance -= request.amount;
+                card.withdrawnOffline += request.amount;
+            }
+            break;
+        case TransactionType::DEPOSIT:
+            response.approved = queue.push(request);
+            if (response.approved)
+                card.balance += request.amount;
+            break;
+        }
+        if (response.approved)
+            response.balance = card.balance;
+        else
+            declinedOffline++;
+        if (response.approved && (request.type == TransactionType::WITHDRAWAL || request.type == TransactionType::DEPOSIT))
+            wakeSync();
+        return response;
+    }
+
+    // Sync thread: forwards the queue while there is something in it, and while the host is unreachable keeps
+    //  trying it every SYNC_RETRY_INTERVAL
+    void sync()
+    {
+        TRACE_THREAD_NAME("offline sync");
+        bool connected = false;
+        bool retrying = false;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(syncMutex);
+                if (retrying)
+                    syncWake.wait_for(lock, std::chrono::milliseconds(SYNC_RETRY_INTERVAL.asMilliseconds()),
+                                      [this]() -> bool { return syncStopping; });
+                else
+                    syncWake.wait(lock, [this]() -> bool { return syncStopping || !hostReachable || queue.hasWaiting(); });
+                if (syncStopping) break;
+            }
+            if (!connected)
+                connected = syncClient.connect(syncAddress, syncPort, syncConnectTimeout);
+            if (connected)
+                connected = forwardBatch();
+            if (!connected)
+                syncClient.disconnect();
+            retrying = !connected;
+        }
+        syncClient.disconnect();
+    }
+
+    // Sync thread: sends a batch of advices at once and collects their replies. With nothing queued it sends a card
+    //  check, to find out whether the host is back. Returns false when the connection failed.
+    bool forwardBatch()
+    {
+        sf::Clock clock;
+        std::vector<OfflineAdvice> batch = queue.takeBatch(SYNC_BATCH_SIZE);
+        bool probing = batch.empty();
+        if (probing)
+            batch.push_back(OfflineAdvice { 0, TransactionRequest { TransactionType::CARD_CHECK, "", 0, 0 } });
+        bool ok = true;
+        size_t sent = 0;
+        for (; sent < batch.size() && ok; sent++)
+        {
+            // The cash has changed hands, so the host posts it whatever the balance is now
+            TransactionRequest advice = batch[sent].request;
+            if (advice.type == TransactionType::WITHDRAWAL)
+                advice.type = TransactionType::FORCED_WITHDRAWAL;
+            else if (advice.type == TransactionType::DEPOSIT)
+                advice.type = TransactionType::FORCED_DEPOSIT;
+            ok = syncClient.send(batch[sent].sequence, advice);
+        }
+        sf::SocketSelector selector;
+        selector.add(syncClient.getSocket());
+        size_t answered = 0;
+        while (ok && answered < sent)
+        {
+            sf::Uint32 id;
+            TransactionResponse response;
+            ok = (syncClient.hasBufferedReply() || selector.wait(SYNC_REPLY_TIMEOUT))
+                 && syncClient.receive(id, response) == sf::Socket::Done;
+            if (!ok) break;
+            if (!probing)
+                queue.acknowledge(id, response);
+            answered++;
+        }
+        if (!probing)
+        {
+            queue.release(batch);
+            if (answered > 0)
+                queue.addForwardingTime(clock.getElapsedTime());
+        }
+        if (answered > 0)
+            hostReachable = true;
+        return ok;
+    }
+
+public:
+    StoreAndForwardCore(const std::string& address, unsigned short int port, sf::Time connectTimeout, sf::Time requestTimeout,
+                        const std::string& journalPath, const Policy& policy)
+        : RemoteTransactionCore(address, port, connectTimeout, requestTimeout), policy(policy), queue(policy.maxQueuedAdvices),
+          hostReachable(true), syncAddress(address), syncPort(port), syncConnectTimeout(connectTimeout)
+    {
+        journalOpen = queue.open(journalPath);
+        syncThread = std::thread(&StoreAndForwardCore::sync, this);
+    }
+
+    ~StoreAndForwardCore()
+    {
+        stop();
+        stopSync();
+    }
+
+    // Stops forwarding; whatever is still queued stays in the journal for the next start
+    void stopSync()
+    {
+        {
+            std::lock_guard<std::mutex> lock(syncMutex);
+            syncStopping = true;
+        }
+        syncWake.notify_all();
+        if (syncThread.joinable())
+            syncThread.join();
+    }
+
+    void request(const TransactionRequest& request, ResponseHandler handler) override
+    {
+        if (!hostReachable)
+        {
+            post([this, request, handler](bool ok) -> void {
+                handler(standIn(request));
+            }, true);
+            return;
+        }
+        RemoteTransactionCore::request(request, [this, request, handler](const TransactionResponse& response) -> void {
+            if (response.answered)
+            {
+                remember(request, response);
+                handler(response);
+                return;
+            }
+            hostReachable = false;
+            wakeSync();
+            handler(standIn(request));
+        });
+    }
+
+    // False when the journal could not be opened; nothing is then approved offline that would need forwarding
+    bool isDurable() const
+    {
+        return journalOpen;
+    }
+
+    bool isHostReachable() const
+    {
+        return hostReachable;
+    }
+
+    std::vector<OfflineAdvice> takeRejectedAdvices()
+    {
+        return queue.takeRejected();
+    }
+
+    OfflineQueue::Metrics getQueueMetrics()
+    {
+        return queue.getMetrics();
+    }
+
+    // Main thread
+    unsigned long long int getStoodInCount() const
+    {
+        return stoodIn;
+    }
+
+    unsigned long long int getDeclinedOfflineCount() const
+    {
+        return declinedOffline;
+    }
+};
+
+// Serves a ledger to many terminals over TCP from a single thread; poll() runs one round of its event loop.
+//  Linux waits on epoll, so the cost of a round follows the terminals that are active rather than those
+//  connected. Elsewhere it falls back to sf::SocketSelector (select), which is fine for a few terminals and
+//  holds 64 sockets at most with Winsock; terminals beyond MAX_SELECTED_CONNECTIONS are hung up on at once
+//  rather than left unread.
+//  Requests that arrive together are answered together, and their replies go out in as few sends as possible.
+class AtmHost
+{
+private:
+    class Listener : public sf::TcpListener
+    {
+    public:
+        using sf::TcpListener::getHandle;
+    };
+
+    class Connection : public sf::TcpSocket
+    {
+    public:
+        using sf::TcpSocket::getHandle;
+        FrameBuffer inbound;
+        std::vector<char> outbound;            // Encoded replies; the first outboundSent bytes are already sent
+        size_t outboundSent = 0;
+        bool waitingToWrite = false;
+    };
+
+    Ledger& ledger;
+    Listener listener;
+    std::map<sf::SocketHandle, std::unique_ptr<Connection>> connections;
+#ifdef TARGET_LINUX
+    int epollFd = -1;
+    std::vector<epoll_event> readyEvents;
+    const size_t MAX_READY_EVENTS = 512;
+#else
+    sf::SocketSelector selector;
+    static const size_t MAX_SELECTED_CONNECTIONS = 63;    // FD_SETSIZE with Winsock, less the listener
+#endif
+    unsigned long long int requestsServed = 0;
+    unsigned long long int connectionsRefused = 0;
+    size_t peakConnections = 0;
+    bool paused = false;
+
+#ifdef TARGET_LINUX
+    void watch(int operation, sf::SocketHandle handle, unsigned int events)
+    {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = handle;
+        epoll_ctl(epollFd, operation, handle, &event);
+    }
+#endif
+
+    void acceptAll()
+    {
+        while (true)
+        {
+            std::unique_ptr<Connection> connection(new Connection());
+            if (listener.accept(*connection) != sf::Socket::Done) return;
+#ifndef TARGET_LINUX
+            if (connections.size() >= MAX_SELECTED_CONNECTIONS)
+            {
+                connectionsRefused++;
+                continue;
+            }
+#endif
+            connection->setBlocking(false);
+            sf::SocketHandle handle = connection->getHandle();
+#ifdef TARGET_LINUX
+            watch(EPOLL_CTL_ADD, handle, EPOLLIN);
+#else
+            selector.add(*connection);
+#endif
+            connections[handle] = std::move(connection);
+            peakConnections = std::max(peakConnections, connections.size());
+        }
+    }
+
+    // Answers every complete request that has arrived; returns false once the terminal is gone
+    bool receive(Connection& connection)
+    {
+        while (true)
+        {
+            sf::Socket::Status status = connection.inbound.receiveFrom(connection);
+            if (status == sf::Socket::NotReady) return true;
+            if (status != sf::Socket::Done) return false;
+            const char* payload;
+            size_t size;
+            while (connection.inbound.nextFrame(payload, size))
+            {
+                sf::Uint32 id;
+                TransactionRequest request;
+                if (!TransactionCodec::decodeRequest(payload, size, id, request)) return false;
+                size_t offset = connection.outbound.size();
+                connection.outbound.resize(offset + TransactionCodec::RESPONSE_FRAME_SIZE);
+                TransactionCodec::encodeResponse(id, ledger.authorize(request), connection.outbound.data() + offset);
+                requestsServed++;
+            }
+            if (connection.inbound.isMalformed()) return false;
+        }
+    }
+
+    // Sends what the socket takes without blocking; the rest waits until it is writable again
+    bool flush(Connection& connection)
+    {
+        while (connection.outboundSent < connection.outbound.size())
+        {
+            size_t sent = 0;
+            sf::Socket::Status status = connection.send(connection.outbound.data() + connection.outboundSent,
+                                                        connection.outbound.size() - connection.outboundSent, sent);
+            connection.outboundSent += sent;
+            if (status == sf::Socket::Partial || status == sf::Socket::NotReady) break;
+            if (status != sf::Socket::Done) return false;
+        }
+        if (connection.outboundSent == connection.outbound.size())
+        {
+            connection.outbound.clear();
+            connection.outboundSent = 0;
+        }
+        bool waitingToWrite = !connection.outbound.empty();
+#ifdef TARGET_LINUX
+        if (waitingToWrite != connection.waitingToWrite)
+            watch(EPOLL_CTL_MOD, connection.getHandle(), waitingToWrite ? EPOLLIN | EPOLLOUT : EPOLLIN);
+#endif
+        connection.waitingToWrite = waitingToWrite;
+        return true;
+    }
+
+    void disconnect(sf::SocketHandle handle)
+    {
+        std::map<sf::SocketHandle, std::unique_ptr<Connection>>::iterator found = connections.find(handle);
+        if (found == connections.end()) return;
+#ifdef TARGET_LINUX
+        watch(EPOLL_CTL_DEL, handle, 0);
+#else
+        selector.remove(*found->second);
+#endif
+        connections.erase(found);
+    }
+
+public:
+    explicit AtmHost(Ledger& ledger) : ledger(ledger) {}
+
+    ~AtmHost()
+    {
+        close();
+    }
+
+    // Port 0 picks a free one (see getLocalPort)
+    bool listen(unsigned short int port, const sf::IpAddress& address = sf::IpAddress::Any)
+    {
+        if (listener.listen(port, address) != sf::Socket::Done) return false;
+        listener.setBlocking(false);
+#ifdef TARGET_LINUX
+        epollFd = epoll_create1(0);
+        if (epollFd < 0) return false;
+        readyEvents.resize(MAX_READY_EVENTS);
+        watch(EPOLL_CTL_ADD, listener.getHandle(), EPOLLIN);
+#else
+        selector.add(listener);
+#endif
+        return true;
+    }
+
+    void close()
+    {
+        connections.clear();
+        listener.close();
+#ifdef TARGET_LINUX
+        if (epollFd >= 0)
+            ::close(epollFd);
+        epollFd = -1;
+#else
+        selector.clear();
+#endif
+    }
+
+    // Stops reading, accepting and answering until resume(), but keeps every connection open: as if the host hung
+    //  without hanging up, to test how terminals cope. What arrives meanwhile is served after resume().
+    void pause()
+    {
+        paused = true;
+    }
+
+    void resume()
+    {
+        paused = false;
+    }
+
+    bool isPaused() const
+    {
+        return paused;
+    }
+
+    // Waits up to timeout for terminals to become ready, then serves all that are
+    void poll(sf::Time timeout)
+    {
+        if (paused)
+        {
+            sf::sleep(timeout);
+            return;
+        }
+#ifdef TARGET_LINUX
+        int readyCount = epoll_wait(epollFd, readyEvents.data(), (int) readyEvents.size(), timeout.asMilliseconds());
+        for (int i = 0; i < readyCount; i++)
+        {
+            sf::SocketHandle handle = readyEvents[i].data.fd;
+            if (handle == listener.getHandle())
+            {
+                acceptAll();
+                continue;
+            }
+            std::map<sf::SocketHandle, std::unique_ptr<Connection>>::iterator found = connections.find(handle);
+            if (found == connections.end()) continue;
+            bool alive = true;
+            if (readyEvents[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                alive = receive(*found->second);
+            if (alive)
+                alive = flush(*found->second);
+            if (!alive)
+                disconnect(handle);
+        }
+#else
+        bool waitingToWrite = false;
+        for (const std::pair<const sf::SocketHandle, std::unique_ptr<Connection>>& connection : connections)
+            waitingToWrite = waitingToWrite || connection.second->waitingToWrite;
+        // select cannot wait for a socket to become writable here, so retry pending replies soon
+        if (!selector.wait(waitingToWrite ? sf::milliseconds(1) : timeout) && !waitingToWrite) return;
+        if (selector.isReady(listener))
+            acceptAll();
+        std::vector<sf::SocketHandle> gone;
+        for (const std::pair<const sf::SocketHandle, std::unique_ptr<Connection>>& connection : connections)
+        {
+            bool alive = true;
+            if (selector.isReady(*connection.second))
+                alive = receive(*connection.second);
+            if (alive)
+                alive = flush(*connection.second);
+            if (!alive)
+                gone.push_back(connection.first);
+        }
+        for (sf::SocketHandle handle : gone)
+            disconnect(handle);
+#endif
+    }
+
+    unsigned short int getLocalPort() const
+    {
+        return listener.getLocalPort();
+    }
+
+    size_t getConnectionCount() const
+    {
+        return connections.size();
+    }
+
+    size_t getPeakConnectionCount() const
+    {
+        return peakConnections;
+    }
+
+    unsigned long long int getRequestsServed() const
+    {
+        return requestsServed;
+    }
+
+    // Hung up on because select could not have watched them too (never on Linux)
+    unsigned long long int getConnectionsRefused() const
+    {
+        return connectionsRefused;
+    }
+};
+
+// A loopback test holds both ends of every connection in this process
+void raiseOpenFileLimit()
+{
+#ifdef TARGET_LINUX
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+// A host on loopback, served on its own thread, for the load test, the protocol benchmark, the fleet and the
+//  offline test
+class LoopbackHost
+{
+private:
+    AtmHost host;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    std::atomic<bool> pauseRequested;
+    std::atomic<bool> paused;                  // As applied by the host thread
+    const sf::Time POLL_TIMEOUT = sf::milliseconds(100);
+
+    void setPaused(bool pause)
+    {
+        pauseRequested = pause;
+        while (thread.joinable() && paused != pause)
+            sf::sleep(sf::milliseconds(1));
+    }
+
+public:
+    explicit LoopbackHost(Ledger& ledger) : host(ledger), stopping(false), pauseRequested(false), paused(false) {}
+
+    ~LoopbackHost()
+    {
+        stop();
+    }
+
+    bool start()
+    {
+        if (!host.listen(sf::Socket::AnyPort, sf::IpAddress::LocalHost)) return false;
+        thread = std::thread([this]() -> void {
+            TRACE_THREAD_NAME("host");
+            while (!stopping)
+            {
+                if (pauseRequested != host.isPaused())
+                {
+                    if (pauseRequested)
+                        host.pause();
+                    else
+                        host.resume();
+                    paused = host.isPaused();
+                }
+                host.poll(POLL_TIMEOUT);
+            }
+        });
+        return true;
+    }
+
+    void stop()
+    {
+        stopping = true;
+        if (thread.joinable())
+            thread.join();
+    }
+
+    // Returns once the host has gone silent (see AtmHost::pause)
+    void pause()
+    {
+        setPaused(true);
+    }
+
+    void resume()
+    {
+        setPaused(false);
+    }
+
+    unsigned short int getPort() const
+    {
+        return host.getLocalPort();
+    }
+};
+
+// Drives many terminals against a host. Every client thread keeps a request in flight on each of its terminals at
+//  once: it sends one on all of them, then collects the replies, so the host sees them all concurrently.
+class HostLoadTest
+{
+public:
+    struct Result
+    {
+        size_t terminalsConnected = 0;
+        unsigned long long int requestsAnswered = 0;
+        unsigned long long int requestsFailed = 0;
+        sf::Time elapsed;
+        std::vector<sf::Int64> latencies;      // Microseconds from send to reply, sorted
+    };
+
+    static sf::Int64 getPercentile(const std::vector<sf::Int64>& sorted, float percentile)
+    {
+        if (sorted.empty()) return 0;
+        size_t index = (size_t) (percentile * (sorted.size() - 1) + 0.5f);
+        return sorted[std::min(index, sorted.size() - 1)];
+    }
+
+private:
+    typedef std::vector<std::unique_ptr<TransactionClient>> Terminals;
+
+    // Balance inquiries, deposits and withdrawals of the same amount in turn, so balances end where they started
+    static TransactionRequest getRequest(size_t round, const std::string& iban, TransactionIdSource& transactionIds)
+    {
+        const unsigned long long int AMOUNT = 10;
+        switch (round % 3)
+        {
+        case 0: return TransactionRequest { TransactionType::BALANCE_INQUIRY, iban, 0, 0, 0 };
+        case 1: return TransactionRequest { TransactionType::DEPOSIT, iban, 0, AMOUNT, transactionIds.next() };
+        default: return TransactionRequest { TransactionType::WITHDRAWAL, iban, 0, AMOUNT, transactionIds.next() };
+        }
+    }
+
+    static void drive(Terminals& terminals, size_t rounds, const std::vector<std::string>& ibans, Result& result)
+    {
+        std::vector<sf::Clock> sentAt(terminals.size());
+        std::vector<bool> sent(terminals.size());
+        std::vector<TransactionIdSource> transactionIds(terminals.size());
+        for (size_t round = 0; round < rounds; round++)
+        {
+            for (size_t i = 0; i < terminals.size(); i++)
+            {
+                sent[i] = terminals[i]->send((sf::Uint32) round, getRequest(round, ibans[i % ibans.size()], transactionIds[i]));
+                sentAt[i].restart();
+            }
+            for (size_t i = 0; i < terminals.size(); i++)
+            {
+                sf::Uint32 id;
+                TransactionResponse response;
+                if (sent[i] && terminals[i]->receive(id, response) == sf::Socket::Done && id == round)
+                {
+                    result.latencies.push_back(sentAt[i].getElapsedTime().asMicroseconds());
+                    result.requestsAnswered++;
+                }
+                else
+                    result.requestsFailed++;
+            }
+        }
+    }
+
+public:
+    static Result run(const sf::IpAddress& address, unsigned short int port, size_t terminalCount, size_t rounds,
+                      const std::vector<std::string>& ibans, size_t threadCount)
+    {
+        Result result;
+        if (ibans.empty() || threadCount == 0) return result;
+        std::vector<Terminals> terminals(threadCount);
+        std::vector<Result> threadResults(threadCount);
+        std::vector<std::thread> threads;
+
+        //- Connect every terminal first, so the timed part only measures requests
+        for (size_t t = 0; t < threadCount; t++)
+            threads.push_back(std::thread([&, t]() -> void {
+                for (size_t i = t; i < terminalCount; i += threadCount)
+                {
+                    std::unique_ptr<TransactionClient> terminal(new TransactionClient());
+                    if (terminal->connect(address, port, sf::seconds(5)))
+                        terminals[t].push_back(std::move(terminal));
+                }
+            }));
+        for (std::thread& thread : threads)
+            thread.join();
+        threads.clear();
+        for (const Terminals& share : terminals)
+            result.terminalsConnected += share.size();
+
+        sf::Clock clock;
+        for (size_t t = 0; t < threadCount; t++)
+            threads.push_back(std::thread([&, t]() -> void {
+                drive(terminals[t], rounds, ibans, threadResults[t]);
+            }));
+        for (std::thread& thread : threads)
+            thread.join();
+        result.elapsed = clock.getElapsedTime();
+
+        for (const Result& threadResult : threadResults)
+        {
+            result.requestsAnswered += threadResult.requestsAnswered;
+            result.requestsFailed += threadResult.requestsFailed;
+            result.latencies.insert(result.latencies.end(), threadResult.latencies.begin(), threadResult.latencies.end());
+        }
+        std::sort(result.latencies.begin(), result.latencies.end());
+        return result;
+    }
+};
+
+// What a terminal saw of its transactions, with the round trips in real time
+struct TransactionStats
+{
+    std::vector<sf::Int64> latencies;          // Microseconds from request to answer
+    unsigned long long int declined = 0;
+    unsigned long long int unanswered = 0;
+};
+
+// Times are on the terminal's clock, which only moves with the frames
+class ActionTimer
+{
+private:
+    sf::Time startTime;
+    sf::Time targetDuration;
+    std::function<void()> callback;
+
+public:
+    ActionTimer(sf::Time startTime, sf::Time targetDuration, std::function<void()> callback)
+    {
+        this->startTime = startTime;
+        this->targetDuration = targetDuration;
+        this->callback = callback;
+    }
+
+    void update(sf::Time currentTime)
+    {
+        sf::Time elapsedTime = currentTime - startTime;
+        if (elapsedTime <= targetDuration) return;
+        callback();
+    }
+};
+
+void handleOffsetAnimationUpdate(sf::Sprite* sprite, OffsetAnimationUpdate* update)
+{
+    switch (update->type)
+    {
+        case OffsetAnimationUpdateType::SET_POSITION:
+            sprite->setPosition(update->value);
+            break;
+        case OffsetAnimationUpdateType::MOVE:
+            sprite->move(update->value);
+            break;
+    }
+}
+
+class Atm
+{
+private:
+    //- Title and Version
+    std::string title = "ATM Software RELOADED";
+    std::string ver = "1.1";
+
+    //- Screen Size
+    const int CANVAS_WIDTH = 960, CANVAS_HEIGHT = 620;
+    sf::Vector2u currentWindowSize;
+
+    //- States
+    bool cardVisible = true, cashLargeVisible = false, cashSmallVisible = false, receiptVisible = false;
+    unsigned short int scrState = 1;
+    unsigned short int pin = 0; unsigned short int pinCount = 0;
+    int amount = 0; unsigned short int amountCount = 0;
+    bool accountSuspendedFlag = false;
+    bool windowHasFocus = true;
+
+    //- Signed-in Cardholder (as the transaction core last reported it)
+    struct User
+    {
+        std::string iban;
+        std::string lastName;
+        std::string firstName;
+        unsigned long long int balance = 0;
+    };
+
+    //- General
+    sf::View view;
+    sf::VideoMode screen;
+    std::unique_ptr<sf::RenderWindow> window;  // The window, the textures and the sound buffers are allocated in init(), so
+                                               //  headless terminals never create a GL context or open the audio device
+    sf::Event event;
+    sf::Font font;
+    sf::Time elapsed;
+
+    //- Textures and Sprites (all sprites live in one atlas and are drawn as a single batch)
+    std::unique_ptr<TextureAtlas> atlas;       SpriteBatch spriteBatch;
+    //- Static Layers (background and static text of a screen, pre-rendered once and shared by identical screens)
+    std::map<std::string, std::unique_ptr<sf::RenderTexture>> staticLayers;
+    std::map<unsigned short int, const sf::Texture*> stateLayers;
+    SpriteBatch layerBatch;                    SpriteBatch maskBatch;
+    const unsigned int ATLAS_MAX_WIDTH = 1024;
+    enum AtlasRegion {
+        BACKGROUND_REGION = 0,
+        CARD_REGION = 1,
+        CASH_LARGE_REGION = 2,
+        CASH_SMALL_REGION = 3,
+        RECEIPT_REGION = 4
+    };
+    DrawCallCounter drawCallCounter;
+
+    sf::Sprite backgroundSprite;
+
+    sf::Sprite cardSprite;
+    sf::Vector2f cardSpritePosition = sf::Vector2f(740, 198);
+    sf::RectangleShape cardMask;
+
+    sf::Sprite cashLargeSprite;
+    sf::Vector2f cashLargeSpritePosition = sf::Vector2f(90, 370);
+    sf::RectangleShape cashLargeMask;
+
+    sf::Sprite cashSmallSprite;
+    sf::Vector2f cashSmallSpritePosition = sf::Vector2f(695, 463);
+    sf::RectangleShape cashSmallMask;
+
+    sf::Sprite receiptSprite;
+    sf::Vector2f receiptSpritePosition = sf::Vector2f(740, 54);
+    sf::RectangleShape receiptMask;
+
+    //- Sound Buffers and Voices
+    std::unique_ptr<sf::SoundBuffer> cardSndBuf;
+    std::unique_ptr<sf::SoundBuffer> menuSndBuf;
+    std::unique_ptr<sf::SoundBuffer> clickSndBuf;
+    std::unique_ptr<sf::SoundBuffer> keySndBuf;
+    std::unique_ptr<sf::SoundBuffer> cashSndBuf;
+    std::unique_ptr<sf::SoundBuffer> printReceiptSndBuf;
+    const size_t VOICE_COUNT = 8;
+    VoicePool voicePool;                       // Allocated in init(), so headless terminals never open the audio device
+    // Key clicks may be cut short by anything; the device sounds only by each other
+    enum SoundPriority
+    {
+        KEY_PRIORITY = 0,
+        MENU_PRIORITY,
+        DEVICE_PRIORITY
+    };
+
+    //- Processing (the screen stays up until the transaction core answers, but at least this long)
+    sf::Time minProcessingDisplayTime = sf::milliseconds(600);
+    std::unique_ptr<TransactionCore> transactionCore;
+    const sf::Time LOCAL_TRANSACTION_CORE_LATENCY = sf::milliseconds(150);
+    TransactionIdSource transactionIds;
+    bool transactionPending = false;
+    unsigned short int transactionStartedInState = 0;
+    sf::Time processingStartedAt;
+
+    //- Prefetch (sent when the card is tapped, so it overlaps the insertion animation). Only the card check is: the
+    //   account record, PIN included, stays with the ledger, which verifies the PIN and counts the wrong ones, so
+    //   PIN entry still waits for a round trip (a stand-in core checks remembered cards itself, see standIn)
+    struct PrefetchedResponse
+    {
+        bool arrived = false;
+        TransactionResponse response;
+        std::function<void(const TransactionResponse&)> onArrival;
+    };
+    std::shared_ptr<PrefetchedResponse> cardCheckPrefetch;
+
+    //- Transaction Statistics
+    TransactionStats transactionStats;
+    // Static layers of the screens that follow the card insertion, rendered one per frame during the animation
+    std::deque<unsigned short int> layerWarmUpQueue;
+
+    //- Text
+    CachedText scrClock;                       std::time_t scrClockSecond = 0;
+    CachedText usernameScr;
+    CachedText ibanScr;
+    CachedText pinTxt;
+    CachedText amountTxt;
+    CachedText balanceTxt;
+    CachedText okHintTxt;
+    std::map<unsigned short int, std::vector<CachedText>> screenLayouts;
+    std::unique_ptr<BitmapFont> bitmapFont;    bool bitmapFontOk = false;
+
+    //- Font sizes and styles used on screen (keep in sync with the text layouts)
+    struct FontStyleUsage
+    {
+        unsigned int characterSize;
+        bool bold;
+    };
+    const std::vector<FontStyleUsage> FONT_STYLES_USED = {
+        { 13, true }, { 13, false }, { 18, true }, { 20, true }, { 22, true }, { 23, true }, { 24, true }, { 25, true }
+    };
+
+    //- Shapes
+    sf::RectangleShape inputBorderShape;
+    const float SPLASH_BAR_WIDTH = 400, SPLASH_BAR_HEIGHT = 16;
+
+    //- Users
+    Ledger ledger;                             // Authorizes a standalone terminal; one started with --connect uses the host's
+    User user;
+    // The card the cardholder holds; its number goes with every request, so the ledger verifies the PIN against the
+    //  card's account and keeps count of its wrong PINs. "--card <number>" holds one card for every session; without
+    //  it, each insertion takes the next card of the user database in turn. 0 when there is none.
+    sf::Uint64 presentedCard = 0;
+    bool cardHeld = false;
+    std::vector<sf::Uint64> databaseCards;
+    size_t nextDatabaseCard = 0;
+    const std::string CARD_STATUS_JOURNAL = "card_status.txt";
+    const std::string TRANSACTION_JOURNAL = "applied_transactions.txt";   // The host's, see Ledger
+
+    //- Host ("--host" serves the ledger to terminals started with "--connect")
+    std::string hostAddress;                   // Empty for a standalone terminal
+    unsigned short int hostPort = 0;
+    const unsigned short int DEFAULT_HOST_PORT = 53000;
+    const sf::Time HOST_CONNECT_TIMEOUT = sf::seconds(2);
+    const sf::Time HOST_REQUEST_TIMEOUT = sf::seconds(5);      // Then the host counts as unreachable
+    const sf::Time HOST_POLL_TIMEOUT = sf::milliseconds(100);
+    const sf::Time HOST_STATS_INTERVAL = sf::seconds(10);
+
+    //- Offline (a terminal started with "--connect" stands in for the host while it cannot be reached)
+    StoreAndForwardCore* storeAndForward = nullptr;           // The transaction core, when it is one
+    const std::string OFFLINE_QUEUE_JOURNAL = "offline_queue.txt";
+    // Withdrawal limit per card (RON), cards remembered, advices queued, wrong PINs before a card is suspended
+    const StoreAndForwardCore::Policy OFFLINE_POLICY = { 500, 1000, 10000, 3 };
+    const sf::Time OFFLINE_STATS_INTERVAL = sf::seconds(10);
+    sf::Clock offlineStatsClock;
+    unsigned long long int offlineForwardedLogged = 0;
+
+    //- Resources (packed by "--pack-resources"; names are relative to the resource directory)
+    ResourceArchive resources;
+    const char* RESOURCE_ARCHIVE = "resources.pak";
+    const char* EMBEDDED_RESOURCES_HEADER = "embedded_resources.h";
+    const std::vector<std::string> RESOURCE_FILES = {
+        "courier_new.ttf", "font_atlas.png", "font_atlas.txt",
+        "backgnd_texture.png", "card_texture.png", "cash_large_texture.jpg", "cash_small_texture.jpg", "receipt_texture.jpg",
+        "card_snd.wav", "menu_snd.wav", "click_snd.wav", "key_snd.wav", "cash_snd.wav", "print_receipt_snd.wav",
+        "database/database.txt"
+    };
+
+    //- Text files
+    const std::string databasePath = "database/database.txt";
+    std::stringstream database;
+    std::ofstream log;
+
+    //- Out String Stream
+    std::ostringstream oss;
+
+    //- Screen Info Strings
+    std::ostringstream usernameScrStr;
+    std::ostringstream ibanScrStr;
+    std::ostringstream convert;
+    std::ostringstream balance;
+
+    //- Chat arrays for live text
+    std::string pinLiveTxt = "****"; std::string amountLiveTxt = "";
+
+    //- Pending Click / Touch Events (clickable object codes, resolved when tapped)
+    struct PendingInteraction
+    {
+        int clickableObjectCode;
+        unsigned short int screen;             // scrState the tap was resolved against
+        sf::Time receivedAt;                   // voicePool time, for the time spent in the queue
+    };
+    std::deque<PendingInteraction> pendingInteractions;
+    // Set while update() applies an interaction, so the sounds it starts are measured from when it was applied;
+    //  the wait in the queue behind blocking animations is reported on its own
+    bool applyingInteraction = false;          sf::Time interactionTime;
+    const size_t MAX_PENDING_INTERACTIONS = 16;
+    unsigned long long int interactionsApplied = 0;
+    sf::Time interactionQueueWaitTotal;
+    sf::Time interactionQueueWaitMax;
+
+    //- Cursor
+    const int CURSOR_CIRCLE_RADIUS = 16;
+    const sf::Time CURSOR_FADE_OUT_TIME = sf::seconds(1.5);
+    CursorRipple cursorRipple = CursorRipple(CURSOR_CIRCLE_RADIUS, sf::Color::Red, CURSOR_FADE_OUT_TIME);
+
+    //- Action Timer
+    ActionTimer* actionTimer;
+
+    //- Animations
+
+    AnimationTimeline runningAnimations;
+    // this is different than the card sound time because the end click is not at the end of the sound
+    sf::Time cardAnimationTime = sf::milliseconds(1002);
+
+    //- Frame Delta Clock
+    sf::Clock frameDeltaClock;
+    // The terminal's own clock, advanced by the frame deltas; timed actions and durations use it, so a headless
+    //  terminal can run on simulated time
+    sf::Time terminalTime;
+
+    //- Tracing (screen state last seen by the tracer)
+    unsigned short int tracedState = 0;
+    unsigned long long int tracedTransactionId = 0;
+
+#ifdef ENABLE_PROFILER
+    //- Profiler
+    FrameProfiler profiler;
+    bool profilerOverlayVisible = false;
+    sf::Text profilerOverlayTxt;
+    sf::RectangleShape profilerOverlayShape;
+    sf::Clock profilerOverlayClock;
+    const sf::Time PROFILER_OVERLAY_REFRESH_TIME = sf::milliseconds(500);
+#endif
+
+    //- Damage Tracking (a frame is only drawn when something on screen changed)
+    bool frameDirty = true;
+    unsigned long long int framesDrawn = 0, framesSkipped = 0;
+    // Loop passes while unfocused skip drawing by design, so they don't count as skipped frames
+    unsigned long long int framesUnfocused = 0;
+    sf::Clock renderStatsClock;
+    const sf::Time RENDER_STATS_INTERVAL = sf::seconds(600);
+    // SFML 2.5 has no waitEvent with a timeout, so an idle loop polls at this interval instead
+    const sf::Time IDLE_POLL_INTERVAL = sf::milliseconds(20);
+    const sf::Time UNFOCUSED_POLL_INTERVAL = sf::milliseconds(100);
+
+    //- Routine Action Codes
+    enum RoutineCode {
+        CARD_IN = 1,
+        CARD_OUT = 2,
+        KEY_SOUND = 3,
+        MENU_SOUND = 4,
+        CASH_LARGE_OUT = 5,
+        CASH_SMALL_IN = 6,
+        RECEIPT_OUT = 7
+    };
+
+    //- Animated Objects (one animation per object at a time)
+    enum AnimatedObject {
+        CARD = 1,
+        CASH_LARGE = 2,
+        CASH_SMALL = 3,
+        RECEIPT = 4
+    };
+
+    //- Session Duration (card in to card out)
+    sf::Time sessionStartedAt;
+    unsigned long long int sessionsEnded = 0;
+    sf::Time sessionTimeTotal;
+    sf::Time sessionTimeMax;
+
+    //- Vibration Length
+    enum VibrationDuration {
+        SHORT = 20,
+        MEDIUM = 40
+    };
+
+    //- Devices (mocks answer after these latencies)
+    DeviceHal devices;
+    unsigned int blockingDeviceCommands = 0;
+    // Device routines started while their device was still busy, run in order once it is free (e.g. a second receipt)
+    struct DeferredRoutine
+    {
+        unsigned short int routine;
+        std::function<void()> callback;
+        std::function<void()> onFault;
+    };
+    std::deque<DeferredRoutine> deferredRoutines;
+    const sf::Time MOCK_CARD_READER_LATENCY = sf::milliseconds(400);
+    const sf::Time MOCK_CASH_DISPENSER_LATENCY = sf::milliseconds(1500);
+    const sf::Time MOCK_CASH_ACCEPTOR_LATENCY = sf::milliseconds(1200);
+    const sf::Time MOCK_RECEIPT_PRINTER_LATENCY = sf::milliseconds(2500);
+    const sf::Time MOCK_HAPTICS_LATENCY = sf::milliseconds(5);
+
+#ifdef TARGET_ANDROID
+    AndroidGlue androidGlue;
+#endif
+
+    //- Headless (a simulated terminal: no window, assets, sound or log, and time only moves in stepHeadless())
+    bool headless = false;
+
+    void initWin()
+    {
+#ifdef TARGET_ANDROID // We support letterbox mode on Android devices
+        screen = sf::VideoMode(sf::VideoMode::getDesktopMode());
+        view.setSize(CANVAS_WIDTH, CANVAS_HEIGHT);
+        view.setCenter(view.getSize().x / 2, view.getSize().y / 2);
+        view = getLetterboxView(view, screen.width, screen.height);
+        window->create(screen, "");
+        window->setView(view);
+#else
+        screen = sf::VideoMode(CANVAS_WIDTH, CANVAS_HEIGHT);
+        window->create(screen, programTitle(), sf::Style::Titlebar | sf::Style::Close);
+#endif
+        window->setFramerateLimit(60);
+        window->setKeyRepeatEnabled(false);
+        currentWindowSize = window->getSize();
+    }
+
+    // https://github.com/SFML/SFML/wiki/Source:-Letterbox-effect-using-a-view
+    sf::View getLetterboxView(sf::View view, int windowWidth, int windowHeight) {
+
+        // Compares the aspect ratio of the window to the aspect ratio of the view,
+        // and sets the view's viewport accordingly in order to achieve a letterbox effect.
+        // A new view (with a new viewport set) is returned.
+
+        float windowRatio = windowWidth / (float) windowHeight;
+        float viewRatio = view.getSize().x / (float) view.getSize().y;
+        float sizeX = 1;
+        float sizeY = 1;
+        float posX = 0;
+        float posY = 0;
+
+        bool horizontalSpacing = true;
+        if (windowRatio < viewRatio)
+            horizontalSpacing = false;
+
+        // If horizontalSpacing is true, the black bars will appear on the left and right side.
+        // Otherwise, the black bars will appear on the top and bottom.
+
+        if (horizontalSpacing)
+        {
+            sizeX = viewRatio / windowRatio;
+            posX = (1 - sizeX) / 2.f;
+        }
+        else
+        {
+            sizeY = windowRatio / viewRatio;
+            posY = (1 - sizeY) / 2.f;
+        }
+        view.setViewport(sf::FloatRect(posX, posY, sizeX, sizeY));
+        return view;
+    }
+
+    sf::Vector2i getScaledPointerCoordinates(int originalX, int originalY)
+    {
+#ifdef TARGET_ANDROID
+        int left = view.getViewport().left * currentWindowSize.x;
+        int top = view.getViewport().top * currentWindowSize.y;
+        float scaleX = (currentWindowSize.x - 2 * left) / (float) CANVAS_WIDTH;
+        float scaleY = (currentWindowSize.y - 2 * top) / (float) CANVAS_HEIGHT;
+        int processedX = (originalX - left) / scaleX;
+        int processedY = (originalY - top) / scaleY;
+        return sf::Vector2i(processedX, processedY);
+#else
+        return sf::Vector2i(originalX, originalY);
+#endif
+    }
+
+    void openResources()
+    {
+#ifdef EMBED_RESOURCES
+        resources.openEmbedded(EMBEDDED_RESOURCES, EMBEDDED_RESOURCE_COUNT);
+        oss << getTimeCli() << "Using embedded resources"; logMsg(oss.str());
+#else
+        if (resources.open(res(RESOURCE_ARCHIVE), res("")))
+        {
+            oss << getTimeCli() << "Resource archive mapped"; logMsg(oss.str());
+        }
+        else
+        {
+            oss << getTimeCli() << "Resource archive not found, reading loose files"; logMsg(oss.str());
+        }
+#endif
+    }
+
+    void loadDatabase()
+    {
+        ResourceView view = resources.get(databasePath);
+        if (view.data != nullptr)
+            database.write(view.data, view.size);
+
+        if (database.tellp() > std::streampos(0))
+        {
+            oss << getTimeCli() << "User database loaded"; logMsg(oss.str());
+            loadClients();
+        }
+        else
+        {
+            oss << getTimeCli() << "User database not found"; logMsg(oss.str());
+            loadPlaceholderClient();
+        }
+    }
+
+    void init()
+    {
+        sf::Clock startupClock;
+
+        //- Create new log file
+#ifndef TARGET_ANDROID
+        log.open(getLogFileName().c_str());
+#endif
+
+        //- Init States
+        initStates();
+
+        //- Initialize Window
+        window.reset(new sf::RenderWindow());
+        initWin();
+
+        //- Initialize CLI
+        system("color 0A");
+        oss << "================================================================================"; logMsg(oss.str());
+        oss << "==================================ATM Software=================================="; logMsg(oss.str());
+        oss << "================================================================================"; logMsg(oss.str());
+        oss << getTimeCli() << "ATM is now powered on"; logMsg(oss.str());
+
+        //- Map the resource archive (or the embedded resources); every asset below is loaded from it
+        {
+            TRACE_SCOPE("map resources.pak");
+            openResources();
+        }
+
+        //- Load database
+        {
+            TRACE_SCOPE("load database.txt");
+            loadDatabase();
+        }
+
+        voicePool = VoicePool(VOICE_COUNT);
+        atlas.reset(new TextureAtlas());
+        bitmapFont.reset(new BitmapFont());
+        for (std::unique_ptr<sf::SoundBuffer>* buffer : { &cardSndBuf, &menuSndBuf, &clickSndBuf, &keySndBuf, &cashSndBuf, &printReceiptSndBuf })
+            buffer->reset(new sf::SoundBuffer());
+
+        //- Load the font, textures and sounds: files are read and decoded on worker threads, while this
+        //   thread uploads them as they become ready and shows the splash screen
+        const char* imageFiles[] = {
+                "backgnd_texture.png",
+                "card_texture.png",
+                "cash_large_texture.jpg",
+                "cash_small_texture.jpg",
+                "receipt_texture.jpg"
+        };
+        std::vector<sf::SoundBuffer*> soundPtr = { cardSndBuf.get(), menuSndBuf.get(), clickSndBuf.get(), keySndBuf.get(), cashSndBuf.get(), printReceiptSndBuf.get() };
+        std::vector<const char*> soundArr = {
+                "card_snd.wav",
+                "menu_snd.wav",
+                "click_snd.wav",
+                "key_snd.wav",
+                "cash_snd.wav",
+                "print_receipt_snd.wav"
+        };
+        struct DecodedSound
+        {
+            std::vector<sf::Int16> samples;
+            unsigned int channelCount = 0;
+            unsigned int sampleRate = 0;
+        };
+        std::vector<sf::Image> images(5);
+        std::vector<MappedFile> cachedImages(images.size());
+        std::vector<ImagePixels> imagePixels(images.size());
+        std::vector<char> imageCacheHits(images.size(), false);
+        std::string cacheDirectory = getCacheDirectory();
+        std::vector<DecodedSound> decodedSounds(soundPtr.size());
+        sf::Image bitmapFontImage;
+
+        AssetLoader loader;
+        size_t fontJob = loader.add("courier_new.ttf", [this]() -> bool {
+            ResourceView view = resources.get("courier_new.ttf");
+            return view.data != nullptr && font.loadFromMemory(view.data, view.size);
+        });
+        size_t bitmapFontJob = loader.add("font_atlas.png", [this, &bitmapFontImage]() -> bool {
+            ResourceView view = resources.get("font_atlas.png");
+            return bitmapFont->loadMetrics(resources.get("font_atlas.txt"))
+                   && view.data != nullptr && bitmapFontImage.loadFromMemory(view.data, view.size);
+        }, [this, &bitmapFontImage]() -> bool {
+            return bitmapFont->loadTexture(bitmapFontImage);
+        }, false);
+        size_t firstImageJob = loader.getJobCount();
+        for (size_t i = 0; i < images.size(); ++i)
+        {
+            loader.add(imageFiles[i], [this, &images, &imageFiles, &cachedImages, &imagePixels, &imageCacheHits, &cacheDirectory, i]() -> bool {
+                ResourceView view = resources.get(imageFiles[i]);
+                if (view.data == nullptr)
+                    return false;
+                sf::Uint64 sourceHash = DecodedImageCache::hash(view);
+                std::string cachePath = DecodedImageCache::getEntryPath(cacheDirectory, sourceHash);
+                if (DecodedImageCache::load(cachedImages[i], cachePath, sourceHash, imagePixels[i]))
+                {
+                    imageCacheHits[i] = true;
+                    return true;
+                }
+                if (!images[i].loadFromMemory(view.data, view.size))
+                    return false;
+                DecodedImageCache::store(cachePath, sourceHash, images[i]);
+                imagePixels[i].pixels = images[i].getPixelsPtr();
+                imagePixels[i].size = images[i].getSize();
+                return true;
+            });
+        }
+        size_t firstSoundJob = loader.getJobCount();
+        for (size_t i = 0; i < soundPtr.size(); ++i)
+        {
+            loader.add(soundArr[i], [this, &decodedSounds, &soundArr, i]() -> bool {
+                ResourceView view = resources.get(soundArr[i]);
+                sf::InputSoundFile file;
+                if (view.data == nullptr || !file.openFromMemory(view.data, view.size))
+                    return false;
+                DecodedSound& sound = decodedSounds[i];
+                sound.samples.resize((size_t) file.getSampleCount());
+                sound.channelCount = file.getChannelCount();
+                sound.sampleRate = file.getSampleRate();
+                return file.read(sound.samples.data(), sound.samples.size()) == sound.samples.size();
+            }, [&soundPtr, &decodedSounds, i]() -> bool {
+                DecodedSound& sound = decodedSounds[i];
+                return soundPtr[i]->loadFromSamples(sound.samples.data(), sound.samples.size(), sound.channelCount, sound.sampleRate);
+            });
+        }
+        loader.start(std::max(2u, std::thread::hardware_concurrency()));
+
+        //- Pre-warm the glyphs on another worker once the font is open; nothing else touches the font until the
+        //   thread is joined below. Not needed when the baked atlas covers them.
+        sf::Time glyphPrewarmTime;
+        std::thread glyphPrewarmThread;
+        bool glyphPrewarmChecked = false;
+        bool assetsLoaded = false;
+        while (!assetsLoaded)
+        {
+            assetsLoaded = loader.poll();
+            if (!glyphPrewarmChecked && loader.isLoaded(fontJob) && loader.isLoaded(bitmapFontJob))
+            {
+                glyphPrewarmChecked = true;
+                bitmapFontOk = loader.succeeded(bitmapFontJob);
+                if (loader.succeeded(fontJob) && !bitmapFontOk)
+                {
+                    glyphPrewarmThread = std::thread([this, &glyphPrewarmTime]() -> void {
+                        TRACE_THREAD_NAME("glyph pre-warm");
+                        TRACE_SCOPE("pre-warm glyphs");
+                        sf::Clock prewarmClock;
+                        prewarmGlyphs();
+                        glyphPrewarmTime = prewarmClock.getElapsedTime();
+                    });
+                }
+            }
+            sf::Event event;
+            while (window->pollEvent(event))
+                if (event.type == sf::Event::Closed)
+                    window->close();
+            if (window->isOpen())
+                drawSplash(loader.getProgress());
+            else
+                sf::sleep(sf::milliseconds(5));
+        }
+
+        for (size_t i = 0; i < loader.getJobCount(); ++i)
+        {
+            if (loader.succeeded(i))
+            {
+                oss << getTimeCli() << "\"" << loader.getName(i) << "\" decoded in " << loader.getDecodeTime(i).asMicroseconds() / 1000.f
+                    << " ms, uploaded in " << loader.getUploadTime(i).asMicroseconds() / 1000.f << " ms"; logMsg(oss.str());
+            }
+            else if (loader.isRequired(i))
+            {
+                oss << getTimeCli() << "\"" << loader.getName(i) << "\" not found"; logMsg(oss.str());
+            }
+        }
+
+        if (loader.succeeded(fontJob))
+        {
+            oss << getTimeCli() << "Font loaded"; logMsg(oss.str());
+        }
+        else
+        {
+            oss << getTimeCli() << "Font not found"; logMsg(oss.str());
+            window->close();
+        }
+        if (bitmapFontOk)
+        {
+            oss << getTimeCli() << "Bitmap font loaded"; logMsg(oss.str());
+        }
+        else
+        {
+            oss << getTimeCli() << "Bitmap font not found, glyphs will be rasterized at runtime"; logMsg(oss.str());
+        }
+
+        //- Textures (indexed by AtlasRegion) are uploaded together as one atlas
+        bool texturesOk = true;
+        for (size_t i = 0; i < images.size(); ++i)
+            texturesOk = texturesOk && loader.succeeded(firstImageJob + i);
+        if (texturesOk)
+        {
+            TRACE_SCOPE("build texture atlas");
+            sf::Clock atlasClock;
+            texturesOk = atlas->build(imagePixels, ATLAS_MAX_WIDTH);
+            oss << getTimeCli() << "Texture atlas uploaded in " << atlasClock.getElapsedTime().asMicroseconds() / 1000.f << " ms"; logMsg(oss.str());
+        }
+        if (!texturesOk)
+        {
+            oss << getTimeCli() << "One or more textures not found"; logMsg(oss.str());
+            window->close();
+        }
+        else
+        {
+            oss << getTimeCli() << "Textures loaded ("
+                << std::count(imageCacheHits.begin(), imageCacheHits.end(), true) << " of " << images.size() << " from the decoded image cache)"; logMsg(oss.str());
+        }
+
+        bool soundOk = true;
+        for (size_t i = 0; i < soundPtr.size(); ++i)
+            soundOk = soundOk && loader.succeeded(firstSoundJob + i);
+        if (soundOk)
+        {
+            oss << getTimeCli() << "Sounds loaded"; logMsg(oss.str());
+        }
+        else
+            window->close();
+
+        if (glyphPrewarmThread.joinable())
+        {
+            glyphPrewarmThread.join();
+            oss << getTimeCli() << "Glyphs pre-warmed in " << glyphPrewarmTime.asMilliseconds() << " ms"; logMsg(oss.str());
+        }
+
+        //- Ready to go
+        oss << getTimeCli() << "ATM is ready to use (startup took " << startupClock.getElapsedTime().asMilliseconds() << " ms)"; logMsg(oss.str());
+
+        //- Lay out the texts that change at runtime; static screen text is built per state on first use
+        const BitmapFont* baked = getBitmapFont();
+        scrClock.setup(font, baked, 490, 25, 13, sf::Color::Red, sf::Text::Bold);
+        usernameScr.setup(font, baked, 85, 25, 13, sf::Color::Cyan, sf::Text::Regular);
+        ibanScr.setup(font, baked, 85, 290, 13, sf::Color::White, sf::Text::Regular);
+        pinTxt.setup(font, baked, 290, 150, 25, sf::Color::White, sf::Text::Bold);
+        amountTxt.setup(font, baked, 270, 150, 23, sf::Color::White, sf::Text::Bold);
+        balanceTxt.setup(font, baked, 280, 150, 23, sf::Color::White, sf::Text::Bold);
+        okHintTxt.setup(font, baked, 350, 200, 18, sf::Color::Yellow, sf::Text::Bold);
+        okHintTxt.setString("Apasati OK");
+
+#ifdef ENABLE_PROFILER
+        //- Profiler overlay
+        profilerOverlayTxt.setFont(font);
+        profilerOverlayTxt.setCharacterSize(13);
+        profilerOverlayTxt.setFillColor(sf::Color::Yellow);
+        profilerOverlayTxt.setPosition(8, 8);
+        profilerOverlayShape.setPosition(0, 0);
+        profilerOverlayShape.setFillColor(sf::Color(0, 0, 0, 192));
+#endif
+
+        //- Devices
+        devices.cardReader.reset(new MockCardReader(MOCK_CARD_READER_LATENCY));
+        devices.cashDispenser.reset(new MockCashDispenser(MOCK_CASH_DISPENSER_LATENCY));
+        devices.cashAcceptor.reset(new MockCashAcceptor(MOCK_CASH_ACCEPTOR_LATENCY));
+        devices.receiptPrinter.reset(new MockReceiptPrinter(MOCK_RECEIPT_PRINTER_LATENCY));
+#ifdef TARGET_ANDROID
+        devices.haptics.reset(new AndroidHaptics(androidGlue));
+#else
+        devices.haptics.reset(new MockHaptics(MOCK_HAPTICS_LATENCY));
+#endif
+        devices.start();
+        if (hostAddress.empty())
+        {
+            if (!ledger.openCardStatuses(CARD_STATUS_JOURNAL))
+            {
+                oss << getTimeCli() << "Could not open " << CARD_STATUS_JOURNAL << ", card suspensions will not survive a restart"; logMsg(oss.str());
+            }
+            transactionCore.reset(new LocalTransactionCore(ledger, LOCAL_TRANSACTION_CORE_LATENCY));
+        }
+        else
+        {
+            storeAndForward = new StoreAndForwardCore(hostAddress, hostPort, HOST_CONNECT_TIMEOUT, HOST_REQUEST_TIMEOUT, OFFLINE_QUEUE_JOURNAL, OFFLINE_POLICY);
+            transactionCore.reset(storeAndForward);
+            oss << getTimeCli() << "Transactions are authorized by the host at " << hostAddress << ":" << hostPort; logMsg(oss.str());
+            if (!storeAndForward->isDurable())
+            {
+                oss << getTimeCli() << "Could not open " << OFFLINE_QUEUE_JOURNAL << ", no deposits or withdrawals will be approved offline"; logMsg(oss.str());
+            }
+            else if (storeAndForward->getQueueMetrics().depth > 0)
+            {
+                oss << getTimeCli() << storeAndForward->getQueueMetrics().depth << " offline transactions left to forward to the host"; logMsg(oss.str());
+            }
+        }
+        transactionCore->start();
+
+        //- Input border (PIN and amount)
+        inputBorderShape.setPosition(230, 150);
+        inputBorderShape.setSize(sf::Vector2f(180, 30));
+        inputBorderShape.setFillColor(sf::Color::Black);
+        inputBorderShape.setOutlineColor(sf::Color::White);
+        inputBorderShape.setOutlineThickness(2);
+
+        //- Assign atlas regions to sprites (masks are cut from the static layer of the current screen)
+        const sf::Texture& atlasTexture = atlas->getTexture();
+        backgroundSprite.setTexture(atlasTexture);                      backgroundSprite.setTextureRect(atlas->getRegion(AtlasRegion::BACKGROUND_REGION));
+
+        sf::IntRect ir;
+
+        ir = sf::IntRect(716, 0, 197, 198);
+        cardSprite.setTexture(atlasTexture);                            cardSprite.setTextureRect(atlas->getRegion(AtlasRegion::CARD_REGION));
+        cardSprite.setPosition(cardSpritePosition);
+        cardMask.setSize(sf::Vector2f(ir.width, ir.height));            cardMask.setPosition(ir.left, ir.top);
+
+        ir = sf::IntRect(80, 0, 484, 370);
+        cashLargeSprite.setTexture(atlasTexture);                       cashLargeSprite.setTextureRect(atlas->getRegion(AtlasRegion::CASH_LARGE_REGION));
+        cashLargeSprite.setPosition(cashLargeSpritePosition);
+        cashLargeMask.setSize(sf::Vector2f(ir.width, ir.height));       cashLargeMask.setPosition(ir.left, ir.top);
+
+        ir = sf::IntRect(688, 250, 250, 213);
+        cashSmallSprite.setTexture(atlasTexture);                       cashSmallSprite.setTextureRect(atlas->getRegion(AtlasRegion::CASH_SMALL_REGION));
+        cashSmallSprite.setPosition(cashSmallSpritePosition);
+        cashSmallMask.setSize(sf::Vector2f(ir.width, ir.height));       cashSmallMask.setPosition(ir.left, ir.top);
+
+        ir = sf::IntRect(716, 0, 197, 54);
+        receiptSprite.setTexture(atlasTexture);                         receiptSprite.setTextureRect(atlas->getRegion(AtlasRegion::RECEIPT_REGION));
+        receiptSprite.setPosition(receiptSpritePosition);
+        receiptMask.setSize(sf::Vector2f(ir.width, ir.height));         receiptMask.setPosition(ir.left, ir.top);
+
+    }
+
+    // Decoded image cache entries live next to the logs (app-private storage on Android)
+    std::string getCacheDirectory()
+    {
+#ifdef TARGET_ANDROID
+        return std::string(sf::getNativeActivity()->internalDataPath) + "/";
+#else
+        return "";
+#endif
+    }
+
+    // Shown while the assets load, so it only uses shapes
+    void drawSplash(float progress)
+    {
+        sf::RectangleShape barShape(sf::Vector2f(SPLASH_BAR_WIDTH, SPLASH_BAR_HEIGHT));
+        barShape.setPosition((CANVAS_WIDTH - SPLASH_BAR_WIDTH) / 2.f, (CANVAS_HEIGHT - SPLASH_BAR_HEIGHT) / 2.f);
+        barShape.setFillColor(sf::Color::Transparent);
+        barShape.setOutlineColor(sf::Color::White);
+        barShape.setOutlineThickness(2);
+        sf::RectangleShape fillShape(sf::Vector2f(SPLASH_BAR_WIDTH * progress, SPLASH_BAR_HEIGHT));
+        fillShape.setPosition(barShape.getPosition());
+        fillShape.setFillColor(sf::Color::Green);
+
+        window->clear();
+        window->draw(fillShape);
+        window->draw(barShape);
+        window->display();
+    }
+
+    // FreeType rasterizes a glyph the first time it is drawn, which makes the first PIN and balance
+    //  screens hitch; render every printable ASCII glyph of every size and style used on screen upfront
+    void prewarmGlyphs()
+    {
+        for (const FontStyleUsage& usage : FONT_STYLES_USED)
+        {
+            for (sf::Uint32 character = 32; character < 127; ++character)
+                font.getGlyph(character, usage.characterSize, usage.bold);
+            font.getTexture(usage.characterSize);
+        }
+    }
+
+    const BitmapFont* getBitmapFont()
+    {
+        return bitmapFontOk ? bitmapFont.get() : nullptr;
+    }
+
+    void initStates()
+    {
+        //- Initialize States
+        cardVisible = true; cashLargeVisible = false; cashSmallVisible = false; receiptVisible = false;
+        scrState = 1;
+        pin = 0; pinCount = 0;
+        amount = 0; amountCount = 0;
+        amountLiveTxt = "";
+        convert.str("");
+        balance.str("");
+        pendingInteractions.clear();
+        actionTimer = nullptr;
+    }
+
+    void handleActionTimer()
+    {
+        if (actionTimer != nullptr)
+        {
+            actionTimer->update(terminalTime);
+        }
+    }
+
+    void handleEvents()
+    {
+        while (window->pollEvent(event))
+        {
+            frameDirty = true;
+            switch (event.type)
+            {
+#ifdef TARGET_ANDROID
+            // On Android MouseLeft/MouseEntered are (for now) triggered,
+            // whenever the app loses or gains focus.
+            //  ^ comment taken from the official SFML Android Sample Project:
+            // https://github.com/SFML/SFML/blob/2e6c363e644b430fd137a7dbed9836f965796610/examples/android/app/src/main/jni/main.cpp#L137
+            case sf::Event::MouseLeft:
+                windowHasFocus = false;
+                break;
+            case sf::Event::MouseEntered:
+                windowHasFocus = true;
+                break;
+#endif
+            case sf::Event::KeyPressed:
+#ifdef TARGET_ANDROID
+                if (event.key.code == sf::Keyboard::Escape) // Note: This is also triggered when the back button is pressed on Android
+                    window->close();
+#endif
+#ifdef ENABLE_PROFILER
+                if (event.key.code == sf::Keyboard::F3)
+                    toggleProfilerOverlay();
+                if (event.key.code == sf::Keyboard::F4)
+                    dumpProfiler();
+#endif
+                break;
+            case sf::Event::Closed:
+                window->close();
+                break;
+            case sf::Event::Resized:
+                currentWindowSize = sf::Vector2u(event.size.width, event.size.height);
+#ifdef TARGET_ANDROID
+                view = getLetterboxView(view, event.size.width, event.size.height);
+                window->setView(view);
+#endif
+                break;
+            case sf::Event::TouchBegan:
+                updatePointerLocation(event.touch.x, event.touch.y, event.touch.finger);
+#ifdef ENABLE_PROFILER
+                if (event.touch.finger == 2)
+                    toggleProfilerOverlay();
+#endif
+                break;
+            case sf::Event::MouseButtonPressed:
+                updatePointerLocation(event.mouseButton.x, event.mouseButton.y);
+                break;
+            }
+        }
+    }
+
+    void updatePointerLocation(int rawX, int rawY, unsigned int finger = 0)
+    {
+        sf::Vector2i position = getScaledPointerCoordinates(rawX, rawY);
+        cursorRipple.trigger(sf::Vector2f(position), runningAnimations.getCurrentTime(), finger);
+        // Every finger gets feedback, but only the first one drives the ATM
+        if (finger == 0)
+            queueInteraction(getClickableObjectCode(position.x, position.y));
+    }
+
+    // Taps are resolved against what was on screen when they happened and applied
+    //  in order by update() once nothing blocks the state machine anymore
+    void queueInteraction(int clickableObjectCode)
+    {
+        if (clickableObjectCode == 0) return;
+        if (pendingInteractions.size() >= MAX_PENDING_INTERACTIONS)
+        {
+            oss << getTimeCli() << "Input queue is full, dropping interaction " << clickableObjectCode; logMsg(oss.str());
+            return;
+        }
+        pendingInteractions.push_back(PendingInteraction { clickableObjectCode, scrState, voicePool.getTime() });
+    }
+
+    // A digit, Clear or OK tapped on the insert card (1) or card check (23) screen still means the same on the way
+    //  to the PIN screen (2), and is applied there
+    bool isTypedAhead(const PendingInteraction& interaction) const
+    {
+        bool keypad = interaction.clickableObjectCode >= 9 && interaction.clickableObjectCode <= 20;
+        return keypad && (interaction.screen == 1 || interaction.screen == 23) && (scrState == 23 || scrState == 2);
+    }
+
+    bool canAcceptInput()
+    {
+        return actionTimer == nullptr && !runningAnimations.hasBlockingAnimations() && blockingDeviceCommands == 0
+               && !transactionPending && !hasBlockingDeferredRoutines();
+    }
+
+    int getClickableObjectCode(int x, int y)
+    {
+        //===============================
+        //Input Codes
+        //===============================
+        //Screen Buttons:
+        //L1 = 1    R1 = 5
+        //L2 = 2    R2 = 6
+        //L3 = 3    R3 = 7
+        //L4 = 4    R4 = 8
+        //===============================
+        //Keys:
+        //1 = 9     2 = 12    3 = 16
+        //4 = 10    5 = 13    6 = 17
+        //7 = 11    8 = 14    9 = 18
+        //          0 = 15
+        //===============================
+        //Action Buttons:
+        //Cancel = 25
+        //Clear  = 19
+        //OK     = 20
+        //===============================
+        //Objects:
+        //card       = 21
+        //cashLarge  = 22
+        //cashSmall  = 23
+        //receipt    = 24
+        //===============================
+        //exit = 26
+        //===============================
+
+        if ((11 <= x) && (x <= 55)) //- Left Column Screen Buttons
+        {
+            if ((125 <= y) && (y <= 163)) //- Button: L1
+            {
+                return 1;
+            }
+            if ((174 <= y) && (y <= 210)) //- Button: L2
+            {
+                return 2;
+            }
+            if ((221 <= y) && (y <= 259)) //- Button: L3
+            {
+                return 3;
+            }
+            if ((269 <= y) && (y <= 305)) //- Button: L4
+            {
+                return 4;
+            }
+        }
+        if ((588 <= x) && (x <= 632)) //- Right Column Screen Buttons
+        {
+            if ((127 <= y) && (y <= 163)) //- Button: R1
+            {
+                return 5;
+            }
+            if ((175 <= y) && (y <= 212)) //- Button: R2
+            {
+                return 6;
+            }
+            if ((223 <= y) && (y <= 259)) //- Button: R3
+            {
+                return 7;
+            }
+            if ((270 <= y) && (y <= 308)) //- Button: R4
+            {
+                return 8;
+            }
+        }
+        if ((209 <= x) && (x <= 255) && !cashLargeVisible) //- Column 1 Keypad
+        {
+            if ((410 <= y) && (y <= 449)) //- Key: 1
+            {
+                return 9;
+            }
+            if ((457 <= y) && (y <= 496)) //- Key: 4
+            {
+                return 10;
+            }
+            if ((504 <= y) && (y <= 543)) //- Key: 7
+            {
+                return 11;
+            }
+        }
+        if ((264 <= x) && (x <= 310) && !cashLargeVisible) //- Column 2 Keypad
+        {
+            if ((410 <= y) && (y <= 449)) //- Key: 2
+            {
+                return 12;
+            }
+            if ((457 <= y) && (y <= 496)) //- Key: 5
+            {
+                return 13;
+            }
+            if ((504 <= y) && (y <= 543)) //- Key: 8
+            {
+                return 14;
+            }
+            if ((551 <= y) && (y <= 590)) //- Key 0
+            {
+                return 15;
+            }
+        }
+        if ((319 <= x) && (x <= 365) && !cashLargeVisible) //- Column 3 Keypad
+        {
+            if ((410 <= y) && (y <= 449)) //- Key: 3
+            {
+                return 16;
+            }
+            if ((457 <= y) && (y <= 496)) //- Key: 6
+            {
+                return 17;
+            }
+            if ((504 <= y) && (y <= 543)) //- Key: 9
+            {
+                return 18;
+            }
+        }
+        if ((385 <= x) && (x <= 455) && !cashLargeVisible) //- Column 4 Keypad
+        {
+            if ((410 <= y) && (y <= 449)) //- Button: Cancel
+            {
+                return 25;
+            }
+            if ((457 <= y) && (y <= 496)) //- Button: Clear
+            {
+                return 19;
+            }
+            if ((504 <= y) && (y <= 543)) //- Button: OK
+            {
+                return 20;
+            }
+        }
+        if ((cardSprite.getGlobalBounds().left <= x) && (x <= (cardSprite.getGlobalBounds().left + cardSprite.getGlobalBounds().width))) //- Object: card (x axis)
+        {
+            if ((cardSprite.getGlobalBounds().top <= y) && (y <= (cardSprite.getGlobalBounds().top + cardSprite.getGlobalBounds().height)) && cardVisible) //- Object: card (y axis) and visibility
+            {
+                return 21;
+            }
+        }
+        if ((cashLargeSprite.getGlobalBounds().left <= x) && (x <= (cashLargeSprite.getGlobalBounds().left + cashLargeSprite.getGlobalBounds().width))) //- Object: cashLarge (x axis)
+        {
+            if ((cashLargeSprite.getGlobalBounds().top <= y) && (y <= (cashLargeSprite.getGlobalBounds().top + cashLargeSprite.getGlobalBounds().height)) && cashLargeVisible) //- Object: cashLarge (y axis) and visibility
+            {
+                return 22;
+            }
+        }
+        if ((cashSmallSprite.getGlobalBounds().left <= x) && (x <= (cashSmallSprite.getGlobalBounds().left + cashSmallSprite.getGlobalBounds().width))) //- Object: cashSmall (x axis)
+        {
+            if ((cashSmallSprite.getGlobalBounds().top <= y) && (y <= (cashSmallSprite.getGlobalBounds().top + cashSmallSprite.getGlobalBounds().height)) && cashSmallVisible) //- Object: cashSmall (y axis) and visibility
+            {
+                return 23;
+            }
+        }
+        if ((receiptSprite.getGlobalBounds().left <= x) && (x <= (receiptSprite.getGlobalBounds().left + receiptSprite.getGlobalBounds().width))) //- Object: receipt (x axis)
+        {
+            if ((receiptSprite.getGlobalBounds().top <= y) && (y <= (receiptSprite.getGlobalBounds().top + receiptSprite.getGlobalBounds().height)) && receiptVisible) //- Object: receipt (y axis) and visibility
+            {
+                return 24;
+            }
+        }
+        if ((12 <= x) && (x <= 92)) //- Exit Button (x axis)
+        {
+            if ((563 <= y) && (y <= 603)) //- Exit Button (y axis)
+            {
+                return 26;
+            }
+        }
+        return 0;
+    }
+
+    void update(sf::Time deltaTime)
+    {
+        //======================================================================================================================================================================================================================
+        //Screen States (scrState)
+        //======================================================================================================================================================================================================================
+        //(1)Insert card --> (23)Processing --> (2)Insert PIN --> (3)MAIN MENU --Withdraw----------> (4)Enter Amount --> (5)Confirm -------------------------> (6)Processing -----> (7)Receipt? --y/n--> (8)Another transaction?
+        //                                                    |                |                                     |
+        //                                                    |                |                                     |
+        //                                                    |                |                                     |
+        //                                                    |                |                                     --> (10)Not enough funds
+        //                                                    |                |
+        //                                                    |                --Deposit-----------> (11)Enter amount --> (12)Confirm --> (13)Insert cash ---> (24)Processing -->(14)Receipt? --y/n---> (15)Another transaction?
+        //                                                    |                |
+        //                                                    |                |
+        //                                                    |                |
+        //                                                    |                --Account Balance---> (17)Processing ----> (18)Balance = ***. Receipt? -y/n---> (19)Another transaction?
+        //                                                    |
+        //                                                    |
+        //                                                    |
+        //                                                    --> (21)Wrong PIN
+        //                                                    |
+        //                                                    --> (22)Account Blocked (3 Wrong Attempts)
+        //
+        //(25)Device fault: the card reader, the dispenser (the withdrawal is reversed) or the acceptor failed its command
+        //(26)Card unavailable offline: the host is unreachable and this terminal has not seen the card verified
+        //======================================================================================================================================================================================================================
+        //======================================================================================================================================================================================================================
+
+        //- Device and transaction answers (may finish a routine and move the state machine)
+        if (devices.dispatchCompletions() + transactionCore->dispatchCompletions() > 0)
+            frameDirty = true;
+        runDeferredRoutines();
+        if (scrState != transactionStartedInState)
+            transactionStartedInState = 0;
+
+        int clickableObjectCode = -1;
+        applyingInteraction = false;
+        // A tap only means something on the screen it was made on; once that screen is gone, so is the tap. Keypad
+        //  taps made while the card goes in are typed ahead into the PIN (see isTypedAhead).
+        while (!pendingInteractions.empty() && pendingInteractions.front().screen != scrState
+               && !isTypedAhead(pendingInteractions.front()))
+        {
+            oss << getTimeCli() << "Dropping interaction " << pendingInteractions.front().clickableObjectCode
+                << " made on screen " << pendingInteractions.front().screen << ", now on " << scrState; logMsg(oss.str());
+            pendingInteractions.pop_front();
+        }
+        // Typed ahead taps wait out the card check rather than be spent on its screen
+        bool holdingTypedAhead = scrState == 23 && !pendingInteractions.empty() && isTypedAhead(pendingInteractions.front());
+        if (canAcceptInput() && !pendingInteractions.empty() && !holdingTypedAhead)
+        {
+            clickableObjectCode = pendingInteractions.front().clickableObjectCode;
+            interactionTime = voicePool.getTime();
+            sf::Time queueWait = interactionTime - pendingInteractions.front().receivedAt;
+            interactionsApplied++;
+            interactionQueueWaitTotal += queueWait;
+            interactionQueueWaitMax = std::max(interactionQueueWaitMax, queueWait);
+            applyingInteraction = true;
+            pendingInteractions.pop_front();
+            frameDirty = true;
+        }
+
+        switch (scrState)
+        {
+            case 1: //- (1) Insert Card
+                if (clickableObjectCode == 21)
                 {
                     eventRoutine(RoutineCode::CARD_IN, [this]() -> void {
                         scrState = 23;
+                    }, [this]() -> void {
+                        scrState = 25;
                     });
                 }
                 break;
@@ -1166,30 +5845,7 @@ private:
                             break;
                         case 20://- OK
                             eventRoutine(RoutineCode::MENU_SOUND);
-                            User* useLookupResult = findUserByPin(pin);
-                            if (useLookupResult != nullptr)
-                            {
-                                signIn(useLookupResult);
-                                oss << getTimeCli() << "Cardholder successfully authenticated:"; logMsg(oss.str());
-                                oss << "\t\t\t  Full Name: " << user->lastName << " " << user->firstName; logMsg(oss.str());
-                                oss << "\t\t\t  IBAN: " << user->iban; logMsg(oss.str());
-                                scrState = 3;
-                            }
-                            else
-                            {
-                                pinRetry++;
-                                if (pinRetry == 3)
-                                {
-                                    oss << getTimeCli() << "Cardholder entered a wrong PIN 3 times in a row"; logMsg(oss.str());
-                                    scrState = 22;
-                                    blocked = true;
-                                }
-                                else
-                                {
-                                    oss << getTimeCli() << "Cardholder entered a wrong PIN"; logMsg(oss.str());
-                                    scrState = 21;
-                                }
-                            }
+                            verifyPin(pin);
                             pin = 0;
                             pinCount = 0;
                             break;
@@ -1283,7 +5939,7 @@ private:
                             {
                                 eventRoutine(RoutineCode::MENU_SOUND);
                                 amountCount = 0;
-                                if (amount <= user->balance)
+                                if (amount <= user.balance)
                                     scrState = 5;
                                 else
                                 {
@@ -1310,7 +5966,7 @@ private:
                         case 20://- OK
                             eventRoutine(RoutineCode::MENU_SOUND);
                             amountCount = 0;
-                            if (amount <= user->balance)
+                            if (amount <= user.balance)
                                 scrState = 5;
                             else
                             {
@@ -1343,13 +5999,25 @@ private:
                 }
                 break;
             case 6: //- (6) Processing (Withdraw)
-                eventRoutine(RoutineCode::CASH_LARGE_OUT, [this]() -> void {
-                    user->balance = user->balance - amount;
-                    oss << getTimeCli() << user->lastName << " " << user->firstName << " withdrew " << amount << " RON"; logMsg(oss.str());
-                    amount = 0; amountCount = 0;
-                    amountLiveTxt = "";
-                    convert.str("");
-                    scrState = 7;
+                startTransaction(TransactionRequest { TransactionType::WITHDRAWAL, user.iban, 0, (unsigned long long int) amount },
+                                 [this](const TransactionResponse& response) -> void {
+                    if (!response.approved)
+                    {
+                        oss << getTimeCli() << "Withdrawal of " << amount << " RON declined"; logMsg(oss.str());
+                        amount = 0;
+                        scrState = 10;
+                        return;
+                    }
+                    eventRoutine(RoutineCode::CASH_LARGE_OUT, [this, response]() -> void {
+                        user.balance = response.balance;
+                        oss << getTimeCli() << user.lastName << " " << user.firstName << " withdrew " << amount << " RON"; logMsg(oss.str());
+                        amount = 0; amountCount = 0;
+                        amountLiveTxt = "";
+                        convert.str("");
+                        scrState = 7;
+                    }, [this, response]() -> void {
+                        reverseWithdrawal(response);
+                    });
                 });
                 break;
             case 7: //- (7) Receipt? (Withdraw)
@@ -1392,7 +6060,7 @@ private:
                             if (!cardVisible)
                             {
                                 eventRoutine(RoutineCode::MENU_SOUND);
-                                oss << getTimeCli() << user->lastName << " " << user->firstName << " finished the session"; logMsg(oss.str());
+                                oss << getTimeCli() << user.lastName << " " << user.firstName << " finished the session"; logMsg(oss.str());
                                 eventRoutine(RoutineCode::CARD_OUT);
                             }
                         }
@@ -1536,6 +6204,13 @@ private:
                     case 23:
                         eventRoutine(RoutineCode::CASH_SMALL_IN, [this]() -> void {
                             scrState = 24;
+                        }, [this]() -> void {
+                            // Nothing was credited yet, so there is nothing to undo
+                            cashSmallVisible = false;
+                            amount = 0; amountCount = 0;
+                            amountLiveTxt = "";
+                            convert.str("");
+                            scrState = 25;
                         });
                         break;
                 }
@@ -1560,7 +6235,67 @@ private:
                         break;
                 }
                 break;
-            case 15: //- Another transaction? (Deposit)
+            case 15: //- Another transaction? (Deposit)
+                switch (clickableObjectCode)
+                {
+                    case 1: //- Yes (L1)
+                        if (!receiptVisible)
+                        {
+                            eventRoutine(RoutineCode::MENU_SOUND);
+                            scrState = 3;
+                        }
+                        break;
+                    case 7: //- No (R3)
+                        if (!receiptVisible)
+                        {
+                            if (!cardVisible)
+                            {
+                                eventRoutine(RoutineCode::MENU_SOUND);
+                                oss << getTimeCli() << user.lastName << " " << user.firstName << " finished the session"; logMsg(oss.str());
+                                eventRoutine(RoutineCode::CARD_OUT);
+                            }
+                        }
+                        break;
+                    case 24: //- Receipt
+                        vibrate(VibrationDuration::SHORT);
+                        receiptVisible = false;
+                        break;
+                }
+                break;
+            case 17: //- Processing (Account Balance)
+                startTransaction(TransactionRequest { TransactionType::BALANCE_INQUIRY, user.iban, 0, 0 },
+                                 [this](const TransactionResponse& response) -> void {
+                    if (response.approved)
+                        user.balance = response.balance;
+                    else
+                    {
+                        oss << getTimeCli() << "Balance inquiry declined, showing the last known balance"; logMsg(oss.str());
+                    }
+                    oss << getTimeCli() << user.lastName << " " << user.firstName << "'s balance is: " << user.balance << " RON"; logMsg(oss.str());
+                    amount = 0; amountCount = 0;
+                    amountLiveTxt = "";
+                    convert.str("");
+                    scrState = 18;
+                });
+                break;
+            case 18: //- Balance = ***. Receipt?
+                switch (clickableObjectCode)
+                {
+                    case 1: //- Yes (L1)
+                        eventRoutine(RoutineCode::MENU_SOUND);
+                        eventRoutine(RoutineCode::RECEIPT_OUT);
+                        scrState = 19;
+                        break;
+                    case 7: //- No (R3)
+                        eventRoutine(RoutineCode::MENU_SOUND);
+                        scrState = 19;
+                        break;
+                }
+                balance.str("");
+                balance << user.balance << " RON";
+                amountLiveTxt = balance.str();
+                break;
+            case 19: //- Another Transaction? (Account Balance)
                 switch (clickableObjectCode)
                 {
                     case 1: //- Yes (L1)
@@ -1576,624 +6311,1965 @@ private:
                             if (!cardVisible)
                             {
                                 eventRoutine(RoutineCode::MENU_SOUND);
-                                oss << getTimeCli() << user->lastName << " " << user->firstName << " finished the session"; logMsg(oss.str());
+                                oss << getTimeCli() << user.lastName << " " << user.firstName << " finished the session"; logMsg(oss.str());
                                 eventRoutine(RoutineCode::CARD_OUT);
                             }
                         }
                         break;
                     case 24: //- Receipt
                         vibrate(VibrationDuration::SHORT);
-                        receiptVisible = false;
-                        break;
-                }
-                break;
-            case 17: //- Processing (Account Balance)
-                handleTimedAction(processingTime, [this]() -> void {
-                    oss << getTimeCli() << user->lastName << " " << user->firstName << "'s balance is: " << user->balance << " RON"; logMsg(oss.str());
-                    amount = 0; amountCount = 0;
-                    amountLiveTxt = "";
-                    convert.str("");
-                    scrState = 18;
-                });
-                break;
-            case 18: //- Balance = ***. Receipt?
-                switch (clickableObjectCode)
-                {
-                    case 1: //- Yes (L1)
-                        eventRoutine(RoutineCode::MENU_SOUND);
-                        eventRoutine(RoutineCode::RECEIPT_OUT);
-                        scrState = 19;
-                        break;
-                    case 7: //- No (R3)
-                        eventRoutine(RoutineCode::MENU_SOUND);
-                        scrState = 19;
-                        break;
-                }
-                balance.str("");
-                balance << user->balance << " RON";
-                amountLiveTxt = balance.str();
-                break;
-            case 19: //- Another Transaction? (Account Balance)
-                switch (clickableObjectCode)
-                {
-                    case 1: //- Yes (L1)
-                        if (!receiptVisible)
-                        {
-                            eventRoutine(RoutineCode::MENU_SOUND);
-                            scrState = 3;
-                        }
-                        break;
-                    case 7: //- No (R3)
-                        if (!receiptVisible)
-                        {
-                            if (!cardVisible)
-                            {
-                                eventRoutine(RoutineCode::MENU_SOUND);
-                                oss << getTimeCli() << user->lastName << " " << user->firstName << " finished the session"; logMsg(oss.str());
-                                eventRoutine(RoutineCode::CARD_OUT);
-                            }
-                        }
-                        break;
-                    case 24: //- Receipt
+                        receiptVisible = false;
+                        break;
+                }
+                break;
+            case 25: //- (25) Device fault
+            case 26: //- (26) Card unavailable offline
+                if (clickableObjectCode == 20)
+                {
+                    eventRoutine(RoutineCode::MENU_SOUND);
+                    eventRoutine(RoutineCode::CARD_OUT);
+                }
+                break;
+            case 21: //- (21) Wrong PIN
+                if (clickableObjectCode == 20)
+                {
+                    eventRoutine(RoutineCode::MENU_SOUND);
+                    scrState = 2;
+                }
+                break;
+            case 22: //- (22) Account suspended
+                if (!accountSuspendedFlag)
+                {
+                    oss << getTimeCli() << "ACCOUNT SUSPENDED"; logMsg(oss.str());
+                    accountSuspendedFlag = true;
+                }
+                if (clickableObjectCode == 20)
+                {
+                    eventRoutine(RoutineCode::MENU_SOUND);
+                    eventRoutine(RoutineCode::CARD_OUT);
+                }
+                break;
+            case 23: //- (23) Processing (for card in)
+                awaitPrefetchedTransaction(cardCheckPrefetch, TransactionRequest { TransactionType::CARD_CHECK, "", 0, 0 },
+                                           [this](const TransactionResponse& response) -> void {
+                    if (response.approved)
+                        scrState = 2;
+                    else
+                    {
+                        oss << getTimeCli() << "Card " << presentedCard << (response.cardSuspended ? " is suspended" : " was declined"); logMsg(oss.str());
+                        scrState = 22;
+                    }
+                });
+                break;
+            case 24: //- (24) Processing (deposit)
+                startTransaction(TransactionRequest { TransactionType::DEPOSIT, user.iban, 0, (unsigned long long int) amount },
+                                 [this](const TransactionResponse& response) -> void {
+                    if (response.approved)
+                    {
+                        user.balance = response.balance;
+                        oss << getTimeCli() << user.lastName << " " << user.firstName << " deposited " << amount << " RON"; logMsg(oss.str());
+                    }
+                    else
+                    {
+                        oss << getTimeCli() << "Deposit of " << amount << " RON declined"; logMsg(oss.str());
+                    }
+                    amount = 0; amountCount = 0;
+                    amountLiveTxt = "";
+                    convert.str("");
+                    scrState = 14;
+                });
+                break;
+        }
+
+        if (clickableObjectCode == 25) //- Button: Cancel
+        {
+            if (!cardVisible) {
+                eventRoutine(RoutineCode::MENU_SOUND);
+                if (scrState != 1 && scrState != 2 && scrState != 21 && scrState != 22 &&
+                    scrState != 23) {
+                    oss << getTimeCli() << user.lastName << " "
+                        << user.firstName << " canceled the session";
+                    logMsg(oss.str());
+                }
+                eventRoutine(RoutineCode::CARD_OUT);
+            }
+        }
+        if (clickableObjectCode == 26) //- Button: Exit
+        {
+            vibrate(VibrationDuration::SHORT);
+            playSound(clickSndBuf, SoundPriority::MENU_PRIORITY);
+            if (window != nullptr)
+                window->close();
+        }
+
+        applyingInteraction = false;
+
+        //- Update animations
+        // The frame an animation ends on still moves its sprite, so check before advancing
+        if (!runningAnimations.empty() || cursorRipple.isActive())
+            frameDirty = true;
+        // Animations on different objects run concurrently (e.g. the receipt still printing
+        //  while the card is ejected); only the ones that change the screen state block input
+        runningAnimations.advance(deltaTime);
+        cursorRipple.update(runningAnimations.getCurrentTime());
+        voicePool.update();
+
+        if (!layerWarmUpQueue.empty() && !headless)
+        {
+            TRACE_SCOPE("warm up static layer");
+            getStaticLayer(layerWarmUpQueue.front());
+            layerWarmUpQueue.pop_front();
+        }
+    }
+
+    void render(sf::RenderWindow& window)
+    {
+#ifdef ENABLE_PROFILER
+        sf::Clock stateRenderClock;
+#endif
+        window.clear();
+        drawCallCounter.beginFrame();
+
+        // The static layer replaces the background; the masks are cut from it as well,
+        //  so the screen text they cover stays on top of the sliding sprites
+        const sf::Texture* staticLayer = getStaticLayer(scrState);
+        sf::FloatRect canvas(0, 0, CANVAS_WIDTH, CANVAS_HEIGHT);
+        layerBatch.begin(staticLayer);
+        layerBatch.add(canvas, sf::IntRect(canvas));
+        drawCounted(layerBatch, staticLayer);
+
+        spriteBatch.begin(&atlas->getTexture());
+        maskBatch.begin(staticLayer);
+        if (cardVisible)
+            addMaskedSprite(cardSprite, cardMask);
+        if (cashLargeVisible)
+            addMaskedSprite(cashLargeSprite, cashLargeMask);
+        if (cashSmallVisible)
+            addMaskedSprite(cashSmallSprite, cashSmallMask);
+        if (receiptVisible)
+            addMaskedSprite(receiptSprite, receiptMask);
+        if (!spriteBatch.empty())
+        {
+            drawCounted(spriteBatch, &atlas->getTexture());
+            drawCounted(maskBatch, staticLayer);
+        }
+        scrRender();
+
+#ifdef SHOW_CURSOR
+        drawCounted(cursorRipple, nullptr, cursorRipple.getActiveCount());
+#endif
+
+#ifdef ENABLE_PROFILER
+        profiler.recordStateRender(scrState, stateRenderClock.getElapsedTime());
+        drawProfilerOverlay();
+#endif
+    }
+
+#ifdef ENABLE_PROFILER
+    void toggleProfilerOverlay()
+    {
+        profilerOverlayVisible = !profilerOverlayVisible;
+        // Force the text to be refreshed on the next frame
+        profilerOverlayTxt.setString("");
+        frameDirty = true;
+    }
+
+    void drawProfilerOverlay()
+    {
+        if (!profilerOverlayVisible) return;
+        if (profilerOverlayTxt.getString().isEmpty() || profilerOverlayClock.getElapsedTime() >= PROFILER_OVERLAY_REFRESH_TIME)
+        {
+            std::ostringstream overlay;
+            overlay << profiler.report(false)
+                    << "draw calls: " << drawCallCounter.frameDrawCalls
+                    << "  texture binds: " << drawCallCounter.frameTextureBinds << std::endl
+                    << "frames drawn: " << framesDrawn << "  skipped: " << framesSkipped;
+            profilerOverlayTxt.setString(overlay.str());
+            sf::FloatRect bounds = profilerOverlayTxt.getGlobalBounds();
+            profilerOverlayShape.setSize(sf::Vector2f(bounds.width + 16, bounds.height + 16));
+            profilerOverlayClock.restart();
+        }
+        window->draw(profilerOverlayShape);
+        window->draw(profilerOverlayTxt);
+    }
+
+    void dumpProfiler()
+    {
+        std::chrono::time_point<std::chrono::system_clock> current_time =
+                std::chrono::system_clock::now();
+        std::string path = "profile-" + serializeTimePoint(current_time, "%Y.%m.%d-%H.%M.%S") + ".txt";
+        if (profiler.dumpToFile(path))
+            oss << getTimeCli() << "Profiler data written to " << path;
+        else
+            oss << getTimeCli() << "Could not write profiler data to " << path;
+        logMsg(oss.str());
+    }
+#endif
+
+    void addMaskedSprite(const sf::Sprite& sprite, const sf::RectangleShape& mask)
+    {
+        spriteBatch.add(sprite);
+        sf::FloatRect maskBounds = mask.getGlobalBounds();
+        maskBatch.add(maskBounds, sf::IntRect(maskBounds));
+    }
+
+    // Renders the background, the input border and the static text of a screen into a texture the first
+    //  time it is shown. Screens with the same content (e.g. every "Processing" state) share one layer.
+    const sf::Texture* getStaticLayer(unsigned short int state)
+    {
+        auto stateLayer = stateLayers.find(state);
+        if (stateLayer != stateLayers.end())
+            return stateLayer->second;
+
+        const std::vector<CachedText>& layout = getScreenLayout(state);
+        bool hasInputBorder = usesInputBorder(state);
+        std::ostringstream signature;
+        signature << hasInputBorder;
+        for (const CachedText& cachedText : layout)
+        {
+            const sf::Text& text = cachedText.getText();
+            signature << '|' << text.getPosition().x << ',' << text.getPosition().y << ',' << text.getCharacterSize()
+                      << ',' << text.getFillColor().toInteger() << ',' << cachedText.getString();
+        }
+
+        std::unique_ptr<sf::RenderTexture>& layer = staticLayers[signature.str()];
+        if (!layer)
+        {
+            layer.reset(new sf::RenderTexture());
+            layer->create(CANVAS_WIDTH, CANVAS_HEIGHT);
+            layer->clear();
+            layer->draw(backgroundSprite);
+            if (hasInputBorder)
+                layer->draw(inputBorderShape);
+            for (const CachedText& text : layout)
+                layer->draw(text);
+            layer->display();
+        }
+        stateLayers[state] = &layer->getTexture();
+        return &layer->getTexture();
+    }
+
+    bool usesInputBorder(unsigned short int state)
+    {
+        return state == 2 || state == 4 || state == 11;
+    }
+
+    void scrRender()
+    {
+        PROFILE_PHASE(profiler, PHASE_SCR_RENDER);
+        TRACE_SCOPE("scrRender");
+
+        //- Show Live "OK" Instruction
+        if (pinCount == 4 || amountCount == 7)
+            drawCounted(okHintTxt);
+
+        //- Screen Clock (only re-laid out when the second changes)
+        std::time_t currentSecond = std::time(nullptr);
+        if (currentSecond != scrClockSecond)
+        {
+            scrClockSecond = currentSecond;
+            scrClock.setString(getTimeGui());
+        }
+        drawCounted(scrClock);
+
+        //- Client Name and IBAN
+        if (scrState != 1 && scrState != 2 && scrState != 21 && scrState != 22 && scrState != 23)
+        {
+            drawCounted(usernameScr);
+            drawCounted(ibanScr);
+        }
+
+        //- Static Screen Text and Input Border are part of the static layer drawn by render()
+
+        //- Live Text
+        switch (scrState)
+        {
+        case 2:
+            pinLiveTxt = std::string(pinCount, '*');
+            pinTxt.setString(pinLiveTxt);
+            drawCounted(pinTxt);
+            break;
+        case 4:
+        case 11:
+            amountTxt.setString(amountLiveTxt);
+            drawCounted(amountTxt);
+            break;
+        case 18:
+            balanceTxt.setString(amountLiveTxt);
+            drawCounted(balanceTxt);
+            break;
+        }
+    }
+
+    void drawCounted(const sf::Drawable& drawable, const sf::Texture* texture, unsigned int drawCalls = 1)
+    {
+        window->draw(drawable);
+        drawCallCounter.count(texture, drawCalls);
+    }
+
+    void drawCounted(const CachedText& text)
+    {
+        window->draw(text);
+        drawCallCounter.count(text.getTexture());
+    }
+
+    // The static text of a screen never changes, so it is laid out once per state on first use
+    const std::vector<CachedText>& getScreenLayout(unsigned short int state)
+    {
+        auto layout = screenLayouts.find(state);
+        if (layout == screenLayouts.end())
+        {
+            layout = screenLayouts.emplace(state, std::vector<CachedText>()).first;
+            buildScreenLayout(state, layout->second);
+        }
+        return layout->second;
+    }
+
+    void buildScreenLayout(unsigned short int state, std::vector<CachedText>& layout)
+    {
+        //- Processing
+        if (state == 23 || state == 17 || state == 6 || state == 24)
+        {
+            addLayoutText(layout, "In curs de procesare...", 250, 200, 20, sf::Color::Red, sf::Text::Bold);
+        }
+
+        //- Receipt?
+        if (state == 7 || state == 14 || state == 18)
+        {
+            addLayoutText(layout, "Doriti bonul aferent tranzactiei?", 90, 50, 22, sf::Color::Green, sf::Text::Bold);
+            addLayoutText(layout, "<--- Da", 85, 130, 20, sf::Color::White, sf::Text::Bold);
+            addLayoutText(layout, "Nu --->", 465, 225, 20, sf::Color::White, sf::Text::Bold);
+        }
+
+        //- Confirm?
+        if (state == 5 || state == 12)
+        {
+            addLayoutText(layout, "Confirmare", 255, 50, 22, sf::Color::Green, sf::Text::Bold);
+            addLayoutText(layout, "<--- Da", 85, 130, 20, sf::Color::White, sf::Text::Bold);
+            addLayoutText(layout, "Nu --->", 465, 225, 20, sf::Color::White, sf::Text::Bold);
+        }
+
+        //- Another Transaction?
+        if (state == 8 || state == 15 || state == 19)
+        {
+            addLayoutText(layout, "Doriti sa efectuati\no noua tranzactie?", 200, 50, 22, sf::Color::Green, sf::Text::Bold);
+            addLayoutText(layout, "<--- Da", 85, 130, 20, sf::Color::White, sf::Text::Bold);
+            addLayoutText(layout, "Nu --->", 465, 225, 20, sf::Color::White, sf::Text::Bold);
+        }
+
+        //- Enter amount
+        if (state == 4 || state == 11)
+        {
+            addLayoutText(layout, "Introduceti suma", 210, 50, 22, sf::Color::Green, sf::Text::Bold);
+            addLayoutText(layout, "RON", 425, 150, 23, sf::Color::White, sf::Text::Bold);
+        }
+
+        //- Main Screen Setup
+        switch (state)
+        {
+        case 1:
+            addLayoutText(layout, "    Bun venit!\nIntroduceti cardul", 180, 50, 24, sf::Color::Green, sf::Text::Bold);
+            break;
+        case 2:
+            addLayoutText(layout, "Introduceti codul PIN", 170, 50, 22, sf::Color::Green, sf::Text::Bold);
+            break;
+        case 3:
+            addLayoutText(layout, "<--- Retragere", 85, 130, 20, sf::Color::White, sf::Text::Bold);
+            addLayoutText(layout, "Depunere --->", 390, 130, 20, sf::Color::White, sf::Text::Bold);
+            addLayoutText(layout, "Interogare Sold --->", 300, 225, 20, sf::Color::White, sf::Text::Bold);
+            break;
+        case 10:
+            addLayoutText(layout, "Sold insuficient", 210, 50, 22, sf::Color::Green, sf::Text::Bold);
+            addLayoutText(layout, "Modificati suma --->", 300, 225, 20, sf::Color::White, sf::Text::Bold);
+            break;
+        case 13:
+            addLayoutText(layout, "Plasati numerarul in bancomat", 120, 50, 22, sf::Color::Green, sf::Text::Bold);
+            break;
+        case 21:
+            addLayoutText(layout, "Ati introdus un PIN incorect\n        OK | Cancel?", 110, 50, 24, sf::Color::Green, sf::Text::Bold);
+            break;
+        case 22:
+            addLayoutText(layout, "3 incercari succesive eronate\n  Contul dvs este suspendat\n      Apasati tasta OK", 105, 50, 24, sf::Color::Green, sf::Text::Bold);
+            break;
+        case 25:
+            addLayoutText(layout, "   Eroare la dispozitiv\nTranzactia a fost anulata\n    Apasati tasta OK", 140, 50, 24, sf::Color::Green, sf::Text::Bold);
+            break;
+        case 26:
+            addLayoutText(layout, "  Serviciu indisponibil\n  Reveniti mai tarziu\n   Apasati tasta OK", 140, 50, 24, sf::Color::Green, sf::Text::Bold);
+        }
+    }
+
+    void addLayoutText(std::vector<CachedText>& layout, const std::string msg, float posX, float posY, unsigned int charSize, const sf::Color color, const sf::Uint32 style)
+    {
+        layout.push_back(CachedText());
+        layout.back().setup(font, getBitmapFont(), posX, posY, charSize, color, style);
+        layout.back().setString(msg);
+    }
+
+    void addRunningAnimation(Animation* animation, AnimatedObject object, bool blocking)
+    {
+        runningAnimations.add(animation, object, blocking);
+    }
+
+    const char* getRoutineName(unsigned short int routine)
+    {
+        switch (routine)
+        {
+        case RoutineCode::CARD_IN: return "eventRoutine CARD_IN";
+        case RoutineCode::CARD_OUT: return "eventRoutine CARD_OUT";
+        case RoutineCode::KEY_SOUND: return "eventRoutine KEY_SOUND";
+        case RoutineCode::MENU_SOUND: return "eventRoutine MENU_SOUND";
+        case RoutineCode::CASH_LARGE_OUT: return "eventRoutine CASH_LARGE_OUT";
+        case RoutineCode::CASH_SMALL_IN: return "eventRoutine CASH_SMALL_IN";
+        case RoutineCode::RECEIPT_OUT: return "eventRoutine RECEIPT_OUT";
+        }
+        return "eventRoutine";
+    }
+
+    // onFault runs instead of the callback when the device reports that its command failed; without one, a fault is
+    //  only logged and the routine carries on
+    void eventRoutine(unsigned short int routine, std::function<void()> callback = {}, std::function<void()> onFault = {})
+    {
+        TRACE_SCOPE(getRoutineName(routine));
+        if (isRoutineBusy(routine))
+        {
+            oss << getTimeCli() << getRoutineName(routine) << " waits for the device to finish its previous command"; logMsg(oss.str());
+            deferredRoutines.push_back(DeferredRoutine { routine, callback, onFault });
+            return;
+        }
+
+        //=======================
+        //Routine Codes (routine)
+        //=======================
+        //1 = Card In
+        //2 = Card Out
+        //3 = Key Sound
+        //4 = Menu Sound
+        //5 = Cash Large Out
+        //6 = Cash Small In
+        //7 = Receipt Out
+        //======================
+        //======================
+
+        switch (routine)
+        {
+        case RoutineCode::CARD_IN:
+        {
+            accountSuspendedFlag = false;
+            sessionStartedAt = terminalTime;
+            if (!cardHeld && !databaseCards.empty())
+                presentedCard = databaseCards[nextDatabaseCard++ % databaseCards.size()];
+            prefetchCardCheck();
+            layerWarmUpQueue = { 23, 2, 3 };
+            TRACE_ASYNC_BEGIN("card insertion animation", 0);
+            playSound(cardSndBuf, SoundPriority::DEVICE_PRIORITY);
+            vibrate(VibrationDuration::MEDIUM);
+            std::function<void(bool)> done = joinCompletions(2, [this, callback]() -> void {
+                oss << getTimeCli() << "The cardholder inserted a VISA Classic Card (" << presentedCard << ")"; logMsg(oss.str());
+                if (callback) callback();
+            }, onFault);
+            devices.cardReader->acceptCard(deviceCompletion(devices.cardReader.get(), true, done));
+            addRunningAnimation(new VerticalOffsetAnimation(
+                    cardAnimationTime, cardSpritePosition,
+                    VerticalOffsetAnimationType::ORIGIN_TO_TOP,
+                    cardSprite.getLocalBounds().height,
+                    [this](OffsetAnimationUpdate update) -> void {
+                        handleOffsetAnimationUpdate(&cardSprite, &update);
+                    },
+                    [this, done]() -> void {
+                        TRACE_ASYNC_END("card insertion animation", 0);
+                        cardVisible = false;
+                        cardSprite.setPosition(cardSpritePosition);
+                        vibrate(VibrationDuration::SHORT);
+                        done(true);
+                    }
+            ), AnimatedObject::CARD, true);
+            break;
+        }
+        case RoutineCode::CARD_OUT:
+        {
+            playSound(cardSndBuf, SoundPriority::DEVICE_PRIORITY);
+            vibrate(VibrationDuration::MEDIUM);
+            cardVisible = true;
+            std::function<void(bool)> done = joinCompletions(2, [this, callback]() -> void {
+                oss << getTimeCli() << "The card was ejected"; logMsg(oss.str());
+                sf::Time sessionTime = terminalTime - sessionStartedAt;
+                sessionsEnded++;
+                sessionTimeTotal += sessionTime;
+                sessionTimeMax = std::max(sessionTimeMax, sessionTime);
+                oss << getTimeCli() << "Session duration: " << sessionTime.asSeconds() << " s"; logMsg(oss.str());
+                if (callback) callback();
+                signOut();
+            }, onFault);
+            devices.cardReader->returnCard(deviceCompletion(devices.cardReader.get(), true, done));
+            addRunningAnimation(new VerticalOffsetAnimation(
+                    cardAnimationTime, cardSpritePosition,
+                    VerticalOffsetAnimationType::TOP_TO_ORIGIN,
+                    cardSprite.getLocalBounds().height,
+                    [this](OffsetAnimationUpdate update) -> void {
+                        handleOffsetAnimationUpdate(&cardSprite, &update);
+                    },
+                    [this, done]() -> void {
+                        cardSprite.setPosition(cardSpritePosition);
+                        vibrate(VibrationDuration::SHORT);
+                        done(true);
+                    }
+            ), AnimatedObject::CARD, true);
+            break;
+        }
+        case RoutineCode::KEY_SOUND:
+            playSound(keySndBuf, SoundPriority::KEY_PRIORITY);
+            vibrate(VibrationDuration::SHORT);
+            break;
+        case RoutineCode::MENU_SOUND:
+            playSound(menuSndBuf, SoundPriority::MENU_PRIORITY);
+            vibrate(VibrationDuration::SHORT);
+            break;
+        case RoutineCode::CASH_LARGE_OUT:
+        {
+            playSound(cashSndBuf, SoundPriority::DEVICE_PRIORITY);
+            vibrate(VibrationDuration::MEDIUM);
+            cashLargeVisible = true;
+            std::function<void(bool)> done = joinCompletions(2, callback, onFault);
+            devices.cashDispenser->dispense(amount, deviceCompletion(devices.cashDispenser.get(), true, done));
+            addRunningAnimation(new VerticalOffsetAnimation(
+                    getSoundDuration(cashSndBuf), cashLargeSpritePosition,
+                    VerticalOffsetAnimationType::TOP_TO_ORIGIN,
+                    cashLargeSprite.getLocalBounds().height,
+                    [this](OffsetAnimationUpdate update) -> void {
+                        handleOffsetAnimationUpdate(&cashLargeSprite, &update);
+                    },
+                    [this, done]() -> void {
                         vibrate(VibrationDuration::SHORT);
-                        receiptVisible = false;
-                        break;
-                }
-                break;
-            case 21: //- (21) Wrong PIN
-                if (clickableObjectCode == 20)
-                {
-                    eventRoutine(RoutineCode::MENU_SOUND);
-                    scrState = 2;
-                }
-                break;
-            case 22: //- (22) Account suspended
-                if (!accountSuspendedFlag)
-                {
-                    oss << getTimeCli() << "ACCOUNT SUSPENDED"; logMsg(oss.str());
-                    accountSuspendedFlag = true;
-                }
-                if (clickableObjectCode == 20)
-                {
-                    eventRoutine(RoutineCode::MENU_SOUND);
-                    eventRoutine(RoutineCode::CARD_OUT);
-                }
-                break;
-            case 23: //- (23) Processing (for card in)
-                handleTimedAction(processingTime, [this]() -> void {
-                    if (!blocked)
-                        scrState = 2;
-                    else
-                        scrState = 22;
-                });
-                break;
-            case 24: //- (24) Processing (deposit)
-                handleTimedAction(processingTime, [this]() -> void {
-                    user->balance = user->balance + amount;
-                    oss << getTimeCli() << user->lastName << " " << user->firstName << " deposited " << amount << " RON"; logMsg(oss.str());
-                    amount = 0; amountCount = 0;
-                    amountLiveTxt = "";
-                    convert.str("");
-                    scrState = 14;
-                });
-                break;
+                        done(true);
+                    }
+            ), AnimatedObject::CASH_LARGE, true);
+            break;
+        }
+        case RoutineCode::CASH_SMALL_IN:
+        {
+            playSound(cashSndBuf, SoundPriority::DEVICE_PRIORITY);
+            vibrate(VibrationDuration::MEDIUM);
+            std::function<void(bool)> done = joinCompletions(2, callback, onFault);
+            devices.cashAcceptor->accept(deviceCompletion(devices.cashAcceptor.get(), true, done));
+            addRunningAnimation(new VerticalOffsetAnimation(
+                    getSoundDuration(cashSndBuf), cashSmallSpritePosition,
+                    VerticalOffsetAnimationType::ORIGIN_TO_TOP,
+                    cashSmallSprite.getLocalBounds().height,
+                    [this](OffsetAnimationUpdate update) -> void {
+                        handleOffsetAnimationUpdate(&cashSmallSprite, &update);
+                    },
+                    [this, done]() -> void {
+                        cashSmallVisible = false;
+                        cashSmallSprite.setPosition(cashSmallSpritePosition);
+                        vibrate(VibrationDuration::SHORT);
+                        done(true);
+                    }
+            ), AnimatedObject::CASH_SMALL, true);
+            break;
+        }
+        case RoutineCode::RECEIPT_OUT:
+        {
+            vibrate(VibrationDuration::MEDIUM);
+            playSound(printReceiptSndBuf, SoundPriority::DEVICE_PRIORITY);
+            receiptVisible = true;
+            // Without a callback the receipt prints while the session carries on
+            std::function<void(bool)> done = joinCompletions(2, callback, onFault);
+            devices.receiptPrinter->print(getReceiptText(), deviceCompletion(devices.receiptPrinter.get(), (bool) callback, done));
+            addRunningAnimation(new VerticalOffsetAnimation(
+                    getSoundDuration(printReceiptSndBuf), receiptSpritePosition,
+                    VerticalOffsetAnimationType::TOP_TO_ORIGIN,
+                    receiptSprite.getLocalBounds().height,
+                    [this](OffsetAnimationUpdate update) -> void {
+                        handleOffsetAnimationUpdate(&receiptSprite, &update);
+                    },
+                    [this, done]() -> void {
+                        vibrate(VibrationDuration::SHORT);
+                        done(true);
+                    }
+            ), AnimatedObject::RECEIPT, (bool) callback);
+            break;
+        }
+        }
+    }
+
+    // A device routine can't start while its device or its animation is still busy with the previous one
+    bool isRoutineBusy(unsigned short int routine)
+    {
+        switch (routine)
+        {
+        case RoutineCode::CARD_IN:
+        case RoutineCode::CARD_OUT:
+            return runningAnimations.isChannelBusy(AnimatedObject::CARD) || devices.cardReader->isBusy();
+        case RoutineCode::CASH_LARGE_OUT:
+            return runningAnimations.isChannelBusy(AnimatedObject::CASH_LARGE) || devices.cashDispenser->isBusy();
+        case RoutineCode::CASH_SMALL_IN:
+            return runningAnimations.isChannelBusy(AnimatedObject::CASH_SMALL) || devices.cashAcceptor->isBusy();
+        case RoutineCode::RECEIPT_OUT:
+            return runningAnimations.isChannelBusy(AnimatedObject::RECEIPT) || devices.receiptPrinter->isBusy();
+        }
+        return false;
+    }
+
+    // Called every frame: starts the routines that were waiting, in order; those still blocked wait again
+    void runDeferredRoutines()
+    {
+        if (deferredRoutines.empty()) return;
+        std::deque<DeferredRoutine> waiting;
+        waiting.swap(deferredRoutines);
+        for (DeferredRoutine& deferred : waiting)
+            eventRoutine(deferred.routine, deferred.callback, deferred.onFault);
+    }
+
+    // A waiting routine with a callback moves the state machine when it finishes, so it holds back input like a
+    //  blocking command
+    bool hasBlockingDeferredRoutines() const
+    {
+        for (const DeferredRoutine& deferred : deferredRoutines)
+            if (deferred.callback || deferred.onFault) return true;
+        return false;
+    }
+
+    // Returns a function that runs the callback on its count-th call, e.g. once both the animation
+    //  and the device command of a routine have finished. If any of the calls reported a failure, onFault runs
+    //  instead (when there is one).
+    std::function<void(bool)> joinCompletions(int count, std::function<void()> callback, std::function<void()> onFault = {})
+    {
+        struct Join
+        {
+            int remaining;
+            bool ok;
+        };
+        std::shared_ptr<Join> join = std::make_shared<Join>(Join { count, true });
+        return [join, callback, onFault](bool ok) -> void {
+            join->ok = join->ok && ok;
+            if (--join->remaining > 0) return;
+            if (!join->ok && onFault)
+                onFault();
+            else if (callback)
+                callback();
+        };
+    }
+
+    // A blocking command holds back input until it completes, the same way a blocking animation does
+    CommandWorker::Completion deviceCompletion(CommandWorker* device, bool blocking, std::function<void(bool)> done)
+    {
+        if (blocking)
+            blockingDeviceCommands++;
+        return [this, device, blocking, done](bool ok) -> void {
+            if (blocking)
+                blockingDeviceCommands--;
+            if (!ok)
+            {
+                oss << getTimeCli() << "The " << device->getName() << " reported a fault"; logMsg(oss.str());
+            }
+            done(ok);
+        };
+    }
+
+    std::string getReceiptText()
+    {
+        std::ostringstream receipt;
+        receipt << title << "\n" << getTimeGui() << "\n";
+        if (!user.iban.empty())
+            receipt << user.iban << "\n";
+        return receipt.str();
+    }
+
+    // Headless terminals have no sound buffers, and stay silent
+    void playSound(const std::unique_ptr<sf::SoundBuffer>& buffer, SoundPriority priority)
+    {
+        if (buffer == nullptr) return;
+        if (applyingInteraction)
+            voicePool.play(*buffer, priority, interactionTime);
+        else
+            voicePool.play(*buffer, priority);
+    }
+
+    // Zero for a headless terminal, whose animations then finish at once
+    sf::Time getSoundDuration(const std::unique_ptr<sf::SoundBuffer>& buffer) const
+    {
+        return buffer != nullptr ? buffer->getDuration() : sf::Time::Zero;
+    }
+
+    void loadClients()
+    {
+        LedgerAccount u;
+        int nr, i;
+        std::string line;
+        database >> nr;
+        std::getline(database, line);
+        for (i = 0; i < nr && std::getline(database, line);)
+        {
+            std::istringstream fields(line);
+            if (!(fields >> u.iban >> u.lastName >> u.firstName >> u.pin >> u.balance)) continue;
+            // The card number column is optional: databases written before it have accounts without a card
+            if (!(fields >> u.cardId))
+                u.cardId = 0;
+            ledger.add(u);
+            if (u.cardId != 0)
+                databaseCards.push_back(u.cardId);
+            i++;
         }
+    }
+
+    // Input stays blocked until the transaction core answers; the PIN is never checked against a prefetched record
+    void verifyPin(unsigned short int enteredPin)
+    {
+        transactionPending = true;
+        requestTransaction(TransactionRequest { TransactionType::PIN_VERIFY, "", enteredPin, 0, 0, presentedCard },
+                           [this](const TransactionResponse& response) -> void {
+            transactionPending = false;
+            if (!response.answered)
+            {
+                oss << getTimeCli() << "The PIN could not be verified, the transaction core did not answer"; logMsg(oss.str());
+                return;
+            }
+            if (response.approved)
+            {
+                signIn(response);
+                oss << getTimeCli() << "Cardholder successfully authenticated" << (response.standIn ? " offline" : "") << ":"; logMsg(oss.str());
+                oss << "\t\t\t  Full Name: " << user.lastName << " " << user.firstName; logMsg(oss.str());
+                oss << "\t\t\t  IBAN: " << user.iban; logMsg(oss.str());
+                scrState = 3;
+                return;
+            }
+            if (response.unknownOffline)
+            {
+                oss << getTimeCli() << "Card " << presentedCard << " cannot be verified while the host is unreachable"; logMsg(oss.str());
+                scrState = 26;
+                return;
+            }
+            if (response.cardSuspended)
+            {
+                oss << getTimeCli() << "Cardholder entered too many wrong PINs, card " << presentedCard << " is suspended"; logMsg(oss.str());
+                scrState = 22;
+            }
+            else
+            {
+                oss << getTimeCli() << "Cardholder entered a wrong PIN (" << response.pinAttemptsLeft << " attempts left)"; logMsg(oss.str());
+                scrState = 21;
+            }
+        });
+    }
+
+    void signOut()
+    {
+        user = User();
+        usernameScrStr.str("");
+        ibanScrStr.str("");
+        usernameScr.setString("");
+        ibanScr.setString("");
+        initStates();
+    }
+
+    void signIn(const TransactionResponse& account)
+    {
+        user.iban = account.iban;
+        user.lastName = account.lastName;
+        user.firstName = account.firstName;
+        user.balance = account.balance;
+        usernameScrStr << user.lastName << " " << user.firstName;
+        ibanScrStr << user.iban;
+        usernameScr.setString(usernameScrStr.str());
+        ibanScr.setString(ibanScrStr.str());
+    }
+
+    void loadPlaceholderClient()
+    {
+        LedgerAccount u;
+        u.iban = "RO-13-ABBK-0345-2342-0255-92";
+        u.lastName = "Placeholder";
+        u.firstName = "Client";
+        u.pin = 0;
+        u.balance = 100;
+        u.cardId = 0;
+        ledger.add(u);
+    }
+
+    std::string programTitle()
+    {
+        std::ostringstream stream;
+        stream << title << " | v" << ver;
+        return stream.str();
+    }
+
+    std::string serializeTimePoint(const std::chrono::system_clock::time_point& time, const std::string& format)
+    {
+        std::time_t tt = std::chrono::system_clock::to_time_t(time);
+//        std::tm tm = *std::gmtime(&tt); //GMT (UTC)
+        std::tm tm = *std::localtime(&tt); //Locale time-zone
+        std::stringstream ss;
+        ss << std::put_time( &tm, format.c_str() );
+        return ss.str();
+    }
+
+    std::string getTimeCli()
+    {
+        std::chrono::time_point<std::chrono::system_clock> current_time =
+                std::chrono::system_clock::now();
+        return serializeTimePoint(current_time, "%Y-%m-%d | %H:%M:%S --> ");
+    }
+
+    std::string getTimeGui()
+    {
+        std::chrono::time_point<std::chrono::system_clock> current_time =
+                std::chrono::system_clock::now();
+        return serializeTimePoint(current_time, "%H:%M:%S");
+    }
 
-        if (clickableObjectCode == 25) //- Button: Cancel
+    std::string getLogFileName()
+    {
+        std::chrono::time_point<std::chrono::system_clock> current_time =
+                std::chrono::system_clock::now();
+        return "log-" + serializeTimePoint(current_time, "%Y.%m.%d-%H.%M.%S") + ".txt";
+    }
+
+    void logMsg(std::string str)
+    {
+        if (!headless)
         {
-            if (!cardVisible) {
-                eventRoutine(RoutineCode::MENU_SOUND);
-                if (scrState != 1 && scrState != 2 && scrState != 21 && scrState != 22 &&
-                    scrState != 23) {
-                    oss << getTimeCli() << user->lastName << " "
-                        << user->firstName << " canceled the session";
-                    logMsg(oss.str());
-                }
-                eventRoutine(RoutineCode::CARD_OUT);
-            }
+            std::cout << str << std::endl;
+            log << str << std::endl;
         }
-        if (clickableObjectCode == 26) //- Button: Exit
+        oss.str("");
+        oss.clear();
+    }
+
+    bool needsRedraw(unsigned short int previousState)
+    {
+#ifdef ENABLE_PROFILER
+        // Keep the overlay numbers live while it is shown
+        if (profilerOverlayVisible && profilerOverlayClock.getElapsedTime() >= PROFILER_OVERLAY_REFRESH_TIME)
+            return true;
+#endif
+        return frameDirty || scrState != previousState || std::time(nullptr) != scrClockSecond;
+    }
+
+    void logRenderStats()
+    {
+        unsigned long long int frames = framesDrawn + framesSkipped;
+        oss << getTimeCli() << "Frames drawn: " << framesDrawn << ", skipped: " << framesSkipped;
+        if (frames > 0)
+            oss << " (" << (100 * framesSkipped / frames) << "% skipped)";
+        if (framesUnfocused > 0)
+            oss << ", idle while unfocused: " << framesUnfocused;
+        if (framesDrawn > 0)
+            oss << ", draw calls/frame: " << drawCallCounter.totalDrawCalls / (float) framesDrawn
+                << ", texture binds/frame: " << drawCallCounter.totalTextureBinds / (float) framesDrawn;
+        logMsg(oss.str());
+        if (voicePool.latencySamples > 0)
         {
-            vibrate(VibrationDuration::SHORT);
-            clickSnd.play();
-            window.close();
+            oss << getTimeCli() << "Input to audio latency: avg " << voicePool.latencyTotal.asMicroseconds() / 1000.f / voicePool.latencySamples
+                << " ms, max " << voicePool.latencyMax.asMicroseconds() / 1000.f << " ms over " << voicePool.latencySamples << " sounds"
+                << " (voices stolen: " << voicePool.stolenVoices << ", sounds dropped: " << voicePool.droppedSounds << ")"; logMsg(oss.str());
         }
-
-        //- Update animations
-        // Although we don't have concurrent object (non-cursor) animations yet,
-        //  we have the system to support that
-        for (auto iterator = runningAnimations.cbegin(); iterator != runningAnimations.end(); iterator++)
+        if (interactionsApplied > 0)
         {
-            auto animation = iterator.operator*();
-            animation->update(deltaTime);
-            // Clean up ended animations
-            if (animation->isEnded())
-            {
-                delete animation;
-                runningAnimations.erase(iterator--);
-            }
+            oss << getTimeCli() << "Input queue wait: avg " << interactionQueueWaitTotal.asMicroseconds() / 1000.f / interactionsApplied
+                << " ms, max " << interactionQueueWaitMax.asMicroseconds() / 1000.f << " ms over " << interactionsApplied << " taps"; logMsg(oss.str());
         }
-        if (cursorAnimation != nullptr)
+        // End to end, card in to card out, to compare against a build without input pipelining
+        if (sessionsEnded > 0)
         {
-            cursorAnimation->update(deltaTime);
+            oss << getTimeCli() << "Session time: avg " << sessionTimeTotal.asSeconds() / sessionsEnded << " s, max "
+                << sessionTimeMax.asSeconds() << " s over " << sessionsEnded << " sessions"; logMsg(oss.str());
         }
+        renderStatsClock.restart();
     }
 
-    void render(sf::RenderWindow& window)
+    // Only while there is something to tell: advices waiting, or some forwarded since the last time
+    void logOfflineQueue()
     {
-        window.clear();
-
-        window.draw(backgroundSprite);
-        if (cardVisible)
-        {
-            window.draw(cardSprite);
-            window.draw(cardMask);
-        }
-        if (cashLargeVisible)
+        for (const OfflineAdvice& advice : storeAndForward->takeRejectedAdvices())
         {
-            window.draw(cashLargeSprite);
-            window.draw(cashLargeMask);
+            oss << getTimeCli() << "RECONCILIATION: the host declined offline " << (advice.request.type == TransactionType::WITHDRAWAL ? "withdrawal " : "deposit ")
+                << advice.request.transactionId << " of " << advice.request.amount << " RON for " << advice.request.iban; logMsg(oss.str());
         }
-        if (cashSmallVisible)
+        OfflineQueue::Metrics metrics = storeAndForward->getQueueMetrics();
+        if (metrics.depth > 0 || metrics.forwarded != offlineForwardedLogged)
         {
-            window.draw(cashSmallSprite);
-            window.draw(cashSmallMask);
+            oss << getTimeCli() << "Offline queue: " << metrics.depth << " waiting (peak " << metrics.peakDepth << "), "
+                << metrics.queued << " queued, " << metrics.forwarded << " forwarded at " << (int) metrics.getDrainRate()
+                << "/s, " << metrics.rejected << " rejected and " << metrics.replayed << " already applied by the host; the host is "
+                << (storeAndForward->isHostReachable() ? "reachable" : "unreachable"); logMsg(oss.str());
+            offlineForwardedLogged = metrics.forwarded;
         }
-        if (receiptVisible)
+        offlineStatsClock.restart();
+    }
+
+    const char* getTransactionName(unsigned short int state)
+    {
+        switch (state)
         {
-            window.draw(receiptSprite);
-            window.draw(receiptMask);
+        case 23: return "card check";
+        case 6: return "withdraw";
+        case 17: return "balance inquiry";
+        case 24: return "deposit";
         }
-        scrRender();
+        return nullptr;
+    }
 
-#ifdef SHOW_CURSOR
-        window.draw(cursorCircle);
+    // Transaction states span several frames, so they are traced as async spans
+    void traceStateChange()
+    {
+#ifdef ENABLE_TRACING
+        const char* previousTransaction = getTransactionName(tracedState);
+        const char* transaction = getTransactionName(scrState);
+        if (previousTransaction != nullptr)
+            TRACE_ASYNC_END(previousTransaction, tracedTransactionId);
+        if (transaction != nullptr)
+            TRACE_ASYNC_BEGIN(transaction, ++tracedTransactionId);
 #endif
-
-        window.display();
+        tracedState = scrState;
     }
 
-    void scrRender()
+    void terminate()
     {
-        //- Show Live "OK" Instruction
-        if (pinCount == 4 || amountCount == 7)
-        {
-            initSfText(&R3Txt, "Apasati OK", 350, 200, 18, sf::Color::Yellow, sf::Color::Yellow, sf::Text::Bold);
-            window.draw(R3Txt);
-        }
+        logRenderStats();
+        // Every thread that records trace events is joined first, so the export reads settled buffers
+        devices.stop();
+        if (storeAndForward != nullptr)
+            storeAndForward->stopSync();
+        transactionCore->stop();
+#ifdef ENABLE_TRACING
+        std::chrono::time_point<std::chrono::system_clock> current_time =
+                std::chrono::system_clock::now();
+        std::string tracePath = "trace-" + serializeTimePoint(current_time, "%Y.%m.%d-%H.%M.%S") + ".json";
+        if (Tracer::instance().writeChromeTrace(tracePath))
+            oss << getTimeCli() << "Trace written to " << tracePath;
+        else
+            oss << getTimeCli() << "Could not write trace to " << tracePath;
+        logMsg(oss.str());
+#endif
+        oss << getTimeCli() << "The ATM is now powered off"; logMsg(oss.str());
+        if (log.is_open())
+            log.close();
+#ifdef TARGET_ANDROID
+        androidGlue.release();
+#endif
+        system("pause");
+    }
 
-        //- Screen Clock Text Setup
-        initSfText(&scrClock, getTimeGui(), 490, 25, 13, sf::Color::Red, sf::Color::Red, sf::Text::Bold);
-        window.draw(scrClock);
+    void initSfText(sf::Text *pText, const std::string msg, float posX, float posY, unsigned int charSize, const sf::Color colorFill, const sf::Color colorOutline, const sf::Uint32 style)
+    {
+        pText->setPosition(posX, posY);
+        pText->setString(msg);
+        pText->setCharacterSize(charSize);
+        pText->setFillColor(colorFill);
+        pText->setOutlineColor(colorOutline);
+        pText->setStyle(style);
+    }
 
-        //- Client Name and IBAN Text Setup
-        if (scrState != 1 && scrState != 2 && scrState != 21 && scrState != 22 && scrState != 23)
-        {
-            initSfText(&usernameScr, usernameScrStr.str(), 85, 25, 13, sf::Color::Cyan, sf::Color::Cyan, sf::Text::Regular);
-            window.draw(usernameScr);
+    inline std::string res(std::string generalPath)
+    {
+        return getResFilePath(generalPath);
+    }
 
-            initSfText(&ibanScr, ibanScrStr.str(), 85, 290, 13, sf::Color::White, sf::Color::White, sf::Text::Regular);
-            window.draw(ibanScr);
-        }
+    inline std::string getResFilePath(std::string generalPath)
+    {
+#ifdef TARGET_ANDROID
+        return generalPath;
+#endif
+        return "res/" + generalPath;
+    }
 
-        //- Processing
-        if (scrState == 23 || scrState == 17 || scrState == 6 || scrState == 24)
-        {
-            initSfText(&R3Txt, "In curs de procesare...", 250, 200, 20, sf::Color::Red, sf::Color::Red, sf::Text::Bold);
-            window.draw(R3Txt);
-        }
+    // Every request goes through here, so its round trip (in real time) and its outcome are counted, deposits and
+    //  withdrawals get their transaction id, and every request the number of the card in the reader
+    void requestTransaction(TransactionRequest request, TransactionCore::ResponseHandler handler)
+    {
+        if ((request.type == TransactionType::WITHDRAWAL || request.type == TransactionType::DEPOSIT) && request.transactionId == 0)
+            request.transactionId = transactionIds.next();
+        if (request.cardId == 0)
+            request.cardId = presentedCard;
+        sf::Clock sentAt;
+        transactionCore->request(request, [this, sentAt, handler](const TransactionResponse& response) -> void {
+            transactionStats.latencies.push_back(sentAt.getElapsedTime().asMicroseconds());
+            if (!response.answered)
+                transactionStats.unanswered++;
+            else if (!response.approved)
+                transactionStats.declined++;
+            handler(response);
+        });
+    }
 
-        //- Receipt?
-        if (scrState == 7 || scrState == 14 || scrState == 18)
-        {
-            if (scrState == 18)
-            {
-                initSfText(&liveTxt, amountLiveTxt, 280, 150, 23, sf::Color::White, sf::Color::White, sf::Text::Bold);
-                window.draw(liveTxt);
-            }
-            initSfText(&dialog, "Doriti bonul aferent tranzactiei?", 90, 50, 22, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-            initSfText(&L1Txt, "<--- Da", 85, 130, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(L1Txt);
-            initSfText(&R3Txt, "Nu --->", 465, 225, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(R3Txt);
-        }
+    // Sent once per visit of a processing state. The response is applied once it has arrived and the
+    //  processing screen has been up for minProcessingDisplayTime, so it never just flickers.
+    void startTransaction(const TransactionRequest& request, std::function<void(const TransactionResponse&)> onResponse)
+    {
+        if (!beginProcessing()) return;
+        const char* transactionName = getTransactionName(scrState);
+        requestTransaction(request, [this, onResponse, transactionName](const TransactionResponse& response) -> void {
+            oss << getTimeCli() << "Transaction core answered the " << transactionName << " in " << (terminalTime - processingStartedAt).asMilliseconds() << " ms"
+                << (response.standIn ? ", standing in for the host" : ""); logMsg(oss.str());
+            finishProcessing(response, onResponse);
+        });
+    }
 
-        //- Confirm?
-        if (scrState == 5 || scrState == 12)
+    // Same as startTransaction, for a request that was already sent ahead of its processing screen
+    void awaitPrefetchedTransaction(std::shared_ptr<PrefetchedResponse> prefetch, const TransactionRequest& request,
+                                    std::function<void(const TransactionResponse&)> onResponse)
+    {
+        if (prefetch == nullptr)
         {
-            initSfText(&dialog, "Confirmare", 255, 50, 22, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-            initSfText(&L1Txt, "<--- Da", 85, 130, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(L1Txt);
-            initSfText(&R3Txt, "Nu --->", 465, 225, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(R3Txt);
+            startTransaction(request, onResponse);
+            return;
         }
+        if (!beginProcessing()) return;
+        if (prefetch == cardCheckPrefetch)
+            cardCheckPrefetch.reset();
+        if (prefetch->arrived)
+            finishProcessing(prefetch->response, onResponse);
+        else
+            prefetch->onArrival = [this, onResponse](const TransactionResponse& response) -> void {
+                finishProcessing(response, onResponse);
+            };
+    }
 
-        //- Another Transaction?
-        if (scrState == 8 || scrState == 15 || scrState == 19)
-        {
-            initSfText(&dialog, "Doriti sa efectuati\no noua tranzactie?", 200, 50, 22, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-            initSfText(&L1Txt, "<--- Da", 85, 130, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(L1Txt);
-            initSfText(&R3Txt, "Nu --->", 465, 225, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(R3Txt);
-        }
+    bool beginProcessing()
+    {
+        if (transactionPending || transactionStartedInState == scrState) return false;
+        transactionStartedInState = scrState;
+        transactionPending = true;
+        processingStartedAt = terminalTime;
+        return true;
+    }
 
-        //- Enter amount
-        if (scrState == 4 || scrState == 11)
-        {
-            initSfText(&dialog, "Introduceti suma", 210, 50, 22, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-            pinBorderShape.setPosition(230, 150);
-            pinBorderShape.setSize(sf::Vector2f(180, 30));
-            pinBorderShape.setFillColor(sf::Color::Black);
-            pinBorderShape.setOutlineColor(sf::Color::White);
-            pinBorderShape.setOutlineThickness(2);
-            window.draw(pinBorderShape);
-            initSfText(&liveTxt, amountLiveTxt, 270, 150, 23, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(liveTxt);
-            initSfText(&R3Txt, "RON", 425, 150, 23, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(R3Txt);
-        }
+    void finishProcessing(const TransactionResponse& response, std::function<void(const TransactionResponse&)> onResponse)
+    {
+        sf::Time shownFor = terminalTime - processingStartedAt;
+        handleTimedAction(std::max(sf::Time::Zero, minProcessingDisplayTime - shownFor), [this, onResponse, response]() -> void {
+            transactionPending = false;
+            onResponse(response);
+        });
+    }
 
-        //- Main Screen Setup
-        switch (scrState)
-        {
-        case 1:
-            initSfText(&dialog, "    Bun venit!\nIntroduceti cardul", 180, 50, 24, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-            break;
-        case 2:
-            initSfText(&dialog, "Introduceti codul PIN", 170, 50, 22, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-            amountBorderShape.setPosition(230, 150);
-            amountBorderShape.setSize(sf::Vector2f(180, 30));
-            amountBorderShape.setFillColor(sf::Color::Black);
-            amountBorderShape.setOutlineColor(sf::Color::White);
-            amountBorderShape.setOutlineThickness(2);
-            window.draw(amountBorderShape);
-            pinLiveTxt = std::string(pinCount, '*');
-            initSfText(&liveTxt, pinLiveTxt, 290, 150, 25, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(liveTxt);
-            break;
-        case 3:
-            initSfText(&L1Txt, "<--- Retragere", 85, 130, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(L1Txt);
-            initSfText(&R1Txt, "Depunere --->", 390, 130, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(R1Txt);
-            initSfText(&R3Txt, "Interogare Sold --->", 300, 225, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(R3Txt);
-            break;
-        case 10:
-            initSfText(&dialog, "Sold insuficient", 210, 50, 22, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-            initSfText(&R3Txt, "Modificati suma --->", 300, 225, 20, sf::Color::White, sf::Color::White, sf::Text::Bold);
-            window.draw(R3Txt);
-            break;
-        case 13:
-            initSfText(&dialog, "Plasati numerarul in bancomat", 120, 50, 22, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-            break;
-        case 21:
-            initSfText(&dialog, "Ati introdus un PIN incorect\n        OK | Cancel?", 110, 50, 24, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-            break;
-        case 22:
-            initSfText(&dialog, "3 incercari succesive eronate\n  Contul dvs este suspendat\n      Apasati tasta OK", 105, 50, 24, sf::Color::Green, sf::Color::Green, sf::Text::Bold);
-            window.draw(dialog);
-        }
+    // The dispenser failed after the ledger had already debited the account, so the amount is credited back with
+    //  a deposit of its own (a new transaction id, so a retry of it cannot credit twice). One the ledger does not
+    //  answer is logged for reconciliation; the cardholder is told either way.
+    void reverseWithdrawal(const TransactionResponse& withdrawal)
+    {
+        unsigned long long int reversed = amount;
+        std::string iban = user.iban;
+        oss << getTimeCli() << "The withdrawal of " << reversed << " RON was not dispensed, reversing it"; logMsg(oss.str());
+        requestTransaction(TransactionRequest { TransactionType::DEPOSIT, iban, 0, reversed },
+                           [this, reversed, iban, withdrawal](const TransactionResponse& response) -> void {
+            if (response.approved)
+            {
+                if (user.iban == iban)
+                    user.balance = response.balance;
+                oss << getTimeCli() << "Reversed the withdrawal of " << reversed << " RON from " << iban
+                    << (response.standIn ? ", to be forwarded to the host" : ""); logMsg(oss.str());
+            }
+            else
+            {
+                oss << getTimeCli() << "RECONCILIATION: could not reverse the withdrawal of " << reversed << " RON from " << iban
+                    << " (balance after the debit: " << withdrawal.balance << " RON)"; logMsg(oss.str());
+            }
+        });
+        cashLargeVisible = false;
+        amount = 0; amountCount = 0;
+        amountLiveTxt = "";
+        convert.str("");
+        scrState = 25;
     }
 
-    void addRunningAnimation(Animation* animation)
+    void prefetchCardCheck()
     {
-        runningAnimations.push_back(animation);
+        std::shared_ptr<PrefetchedResponse> prefetch = std::make_shared<PrefetchedResponse>();
+        cardCheckPrefetch = prefetch;
+        requestTransaction(TransactionRequest { TransactionType::CARD_CHECK, "", 0, 0 },
+                           [this, prefetch](const TransactionResponse& response) -> void {
+            oss << getTimeCli() << "Card check prefetched " << (terminalTime - sessionStartedAt).asMilliseconds() << " ms after the card was tapped"; logMsg(oss.str());
+            prefetch->arrived = true;
+            prefetch->response = response;
+            if (prefetch->onArrival)
+                prefetch->onArrival(response);
+        });
     }
 
-    void addCursorAnimation(Animation* animation)
+    void handleTimedAction(sf::Time duration, std::function<void()> action)
     {
-        if (cursorAnimation != nullptr)
+        if (actionTimer == nullptr)
         {
-            delete cursorAnimation;
-            cursorAnimation = nullptr;
+            actionTimer = new ActionTimer(terminalTime, duration, [this, action]() -> void {
+                action();
+                delete actionTimer;
+                actionTimer = nullptr;
+            });
         }
-        cursorAnimation = animation;
     }
 
-    void eventRoutine(unsigned short int routine, std::function<void()> callback = {})
+    void vibrate(VibrationDuration vibrationDuration)
     {
-        //=======================
-        //Routine Codes (routine)
-        //=======================
-        //1 = Card In
-        //2 = Card Out
-        //3 = Key Sound
-        //4 = Menu Sound
-        //5 = Cash Large Out
-        //6 = Cash Small In
-        //7 = Receipt Out
-        //======================
-        //======================
-
-        if (!canAcceptInput()) return;
+        if (devices.haptics)
+            devices.haptics->vibrate(vibrationDuration);
+    }
 
-        switch (routine)
+    // Returns whether a frame was drawn
+    bool runFrame(sf::Time deltaTime)
+    {
+        PROFILE_PHASE(profiler, PHASE_FRAME);
+        TRACE_SCOPE("frame");
+        terminalTime += deltaTime;
+        unsigned short int previousState = scrState;
+        if (scrState != tracedState)
+            traceStateChange();
         {
-        case RoutineCode::CARD_IN:
-            accountSuspendedFlag = false;
-            cardSnd.play();
-            vibrate(VibrationDuration::MEDIUM);
-            addRunningAnimation(new VerticalOffsetAnimation(
-                    cardAnimationTime, cardSpritePosition,
-                    VerticalOffsetAnimationType::ORIGIN_TO_TOP,
-                    cardSprite.getLocalBounds().height,
-                    [this](OffsetAnimationUpdate update) -> void {
-                        handleOffsetAnimationUpdate(&cardSprite, &update);
-                    },
-                    [this, callback]() -> void {
-                        oss << getTimeCli() << "The cardholder inserted a VISA Classic Card"; logMsg(oss.str());
-                        cardVisible = false;
-                        cardSprite.setPosition(cardSpritePosition);
-                        vibrate(VibrationDuration::SHORT);
-                        if (callback) callback();
-                    }
-            ));
-            break;
-        case RoutineCode::CARD_OUT:
-            cardSnd.play();
-            vibrate(VibrationDuration::MEDIUM);
-            cardVisible = true;
-            addRunningAnimation(new VerticalOffsetAnimation(
-                    cardAnimationTime, cardSpritePosition,
-                    VerticalOffsetAnimationType::TOP_TO_ORIGIN,
-                    cardSprite.getLocalBounds().height,
-                    [this](OffsetAnimationUpdate update) -> void {
-                        handleOffsetAnimationUpdate(&cardSprite, &update);
-                    },
-                    [this, callback]() -> void {
-                        oss << getTimeCli() << "The card was ejected"; logMsg(oss.str());
-                        cardSprite.setPosition(cardSpritePosition);
-                        vibrate(VibrationDuration::SHORT);
-                        if (callback) callback();
-                        signOut();
-                    }
-            ));
-            break;
-        case RoutineCode::KEY_SOUND:
-            keySnd.play();
-            vibrate(VibrationDuration::SHORT);
-            break;
-        case RoutineCode::MENU_SOUND:
-            menuSnd.play();
-            vibrate(VibrationDuration::SHORT);
-            break;
-        case RoutineCode::CASH_LARGE_OUT:
-            cashSnd.play();
-            vibrate(VibrationDuration::MEDIUM);
-            cashLargeVisible = true;
-            addRunningAnimation(new VerticalOffsetAnimation(
-                    cashSndBuf.getDuration(), cashLargeSpritePosition,
-                    VerticalOffsetAnimationType::TOP_TO_ORIGIN,
-                    cashLargeSprite.getLocalBounds().height,
-                    [this](OffsetAnimationUpdate update) -> void {
-                        handleOffsetAnimationUpdate(&cashLargeSprite, &update);
-                    },
-                    [this, callback]() -> void {
-                        vibrate(VibrationDuration::SHORT);
-                        if (callback) callback();
-                    }
-            ));
-            break;
-        case RoutineCode::CASH_SMALL_IN:
-            cashSnd.play();
-            vibrate(VibrationDuration::MEDIUM);
-            addRunningAnimation(new VerticalOffsetAnimation(
-                    cashSndBuf.getDuration(), cashSmallSpritePosition,
-                    VerticalOffsetAnimationType::ORIGIN_TO_TOP,
-                    cashSmallSprite.getLocalBounds().height,
-                    [this](OffsetAnimationUpdate update) -> void {
-                        handleOffsetAnimationUpdate(&cashSmallSprite, &update);
-                    },
-                    [this, callback]() -> void {
-                        cashSmallVisible = false;
-                        cashSmallSprite.setPosition(cashSmallSpritePosition);
-                        vibrate(VibrationDuration::SHORT);
-                        if (callback) callback();
-                    }
-            ));
-            break;
-        case RoutineCode::RECEIPT_OUT:
-            vibrate(VibrationDuration::MEDIUM);
-            printReceiptSnd.play();
-            receiptVisible = true;
-            addRunningAnimation(new VerticalOffsetAnimation(
-                    printReceiptSndBuf.getDuration(), receiptSpritePosition,
-                    VerticalOffsetAnimationType::TOP_TO_ORIGIN,
-                    receiptSprite.getLocalBounds().height,
-                    [this](OffsetAnimationUpdate update) -> void {
-                        handleOffsetAnimationUpdate(&receiptSprite, &update);
-                    },
-                    [this, callback]() -> void {
-                        vibrate(VibrationDuration::SHORT);
-                        if (callback) callback();
-                    }
-            ));
-            break;
+            PROFILE_PHASE(profiler, PHASE_EVENTS);
+            TRACE_SCOPE("handleEvents");
+            handleEvents();
+        }
+        {
+            PROFILE_PHASE(profiler, PHASE_ACTION_TIMER);
+            TRACE_SCOPE("handleActionTimer");
+            handleActionTimer();
+        }
+        if (!windowHasFocus) return false;
+        {
+            PROFILE_PHASE(profiler, PHASE_UPDATE);
+            TRACE_SCOPE("update");
+            update(deltaTime);
+        }
+        if (scrState != tracedState)
+            traceStateChange();
+        if (!needsRedraw(previousState)) return false;
+        {
+            PROFILE_PHASE(profiler, PHASE_RENDER);
+            TRACE_SCOPE("render");
+            render(*window);
+        }
+        {
+            PROFILE_PHASE(profiler, PHASE_DISPLAY);
+            TRACE_SCOPE("display");
+            window->display();
         }
+        frameDirty = false;
+        return true;
     }
 
-    void loadClients()
+public:
+    // Writes res/font_atlas.png and res/font_atlas.txt from the TTF; run after changing FONT_STYLES_USED
+    bool bakeFont()
     {
-        User u;
-        int nr, i;
-        database >> nr;
-        for (i = 0; i < nr; i++)
+        if (!font.loadFromFile(res("courier_new.ttf")))
+        {
+            std::cerr << "Font not found" << std::endl;
+            return false;
+        }
+        std::vector<std::pair<unsigned int, bool>> styles;
+        for (const FontStyleUsage& usage : FONT_STYLES_USED)
+            styles.push_back(std::make_pair(usage.characterSize, usage.bold));
+        if (!BitmapFont::bake(font, styles, res("font_atlas.png"), res("font_atlas.txt")))
         {
-            database >> u.iban >> u.lastName >> u.firstName >> u.pin >> u.balance;
-            users.push_back(u);
+            std::cerr << "Could not write the font atlas" << std::endl;
+            return false;
         }
+        std::cout << "Font atlas written to " << res("font_atlas.png") << std::endl;
+        return true;
     }
 
-    User* findUserByPin(unsigned short pin)
+    bool packResources()
     {
-        for (int i = 0; i < users.size(); i++)
+        if (!ResourceArchive::pack(res(""), RESOURCE_FILES, res(RESOURCE_ARCHIVE)))
         {
-            if (users[i].pin == pin)
-                return &users[i];
+            std::cerr << "Could not write the resource archive" << std::endl;
+            return false;
         }
-        return nullptr;
+        std::cout << "Resource archive written to " << res(RESOURCE_ARCHIVE) << std::endl;
+        return true;
     }
 
-    void signOut()
+    // The header is included by main.cpp, so it goes next to it: the directory in __FILE__ when the compiler
+    //  recorded one, otherwise the working directory (the build runs this step from the project directory)
+    bool embedResources(std::string headerPath)
     {
-        user = nullptr;
-        usernameScrStr.str("");
-        ibanScrStr.str("");
-        initStates();
+        if (headerPath.empty())
+        {
+            std::string source = __FILE__;
+            size_t separator = source.find_last_of("/\\");
+            headerPath = (separator == std::string::npos ? "" : source.substr(0, separator + 1)) + EMBEDDED_RESOURCES_HEADER;
+        }
+        if (!ResourceArchive::embed(res(""), RESOURCE_FILES, headerPath))
+        {
+            std::cerr << "Could not write " << headerPath << std::endl;
+            return false;
+        }
+        std::cout << "Embedded resources written to " << headerPath << ", rebuild with EMBED_RESOURCES" << std::endl;
+        return true;
     }
 
-    void signIn(User* user)
+    // For tools that run terminals or a host of their own
+    Ledger& loadAccounts()
     {
-        this->user = user;
-        usernameScrStr << user->lastName << " " << user->firstName;
-        ibanScrStr << user->iban;
+        openResources();
+        loadDatabase();
+        return ledger;
     }
 
-    void loadPlaceholderClient()
+    // A simulated terminal for the fleet: no window, assets, sound or log, devices that answer at once, and
+    //  everything on the caller's thread. Takes ownership of the core.
+    void initHeadless(TransactionCore* core)
     {
-        User u;
-        u.iban = "RO-13-ABBK-0345-2342-0255-92";
-        u.lastName = "Placeholder";
-        u.firstName = "Client";
-        u.pin = 0;
-        u.balance = 100;
-        users.push_back(u);
+        headless = true;
+        initStates();
+        devices.cardReader.reset(new MockCardReader(sf::Time::Zero));
+        devices.cashDispenser.reset(new MockCashDispenser(sf::Time::Zero));
+        devices.cashAcceptor.reset(new MockCashAcceptor(sf::Time::Zero));
+        devices.receiptPrinter.reset(new MockReceiptPrinter(sf::Time::Zero));
+        devices.haptics.reset(new MockHaptics(sf::Time::Zero));
+        devices.runInline();
+        transactionCore.reset(core);
+        transactionCore->runInline();
     }
 
-    std::string programTitle()
+    // One frame of a headless terminal, deltaTime of simulated time
+    void stepHeadless(sf::Time deltaTime)
     {
-        std::ostringstream stream;
-        stream << title << " | v" << ver;
-        return stream.str();
+        terminalTime += deltaTime;
+        handleActionTimer();
+        update(deltaTime);
     }
 
-    std::string serializeTimePoint(const std::chrono::system_clock::time_point& time, const std::string& format)
+    sf::Time getTerminalTime() const
     {
-        std::time_t tt = std::chrono::system_clock::to_time_t(time);
-//        std::tm tm = *std::gmtime(&tt); //GMT (UTC)
-        std::tm tm = *std::localtime(&tt); //Locale time-zone
-        std::stringstream ss;
-        ss << std::put_time( &tm, format.c_str() );
-        return ss.str();
+        return terminalTime;
     }
 
-    std::string getTimeCli()
+    unsigned short int getScreenState() const
     {
-        std::chrono::time_point<std::chrono::system_clock> current_time =
-                std::chrono::system_clock::now();
-        return serializeTimePoint(current_time, "%Y-%m-%d | %H:%M:%S --> ");
+        return scrState;
     }
 
-    std::string getTimeGui()
+    // A press now would be applied on the next frame
+    bool isWaitingForInput()
     {
-        std::chrono::time_point<std::chrono::system_clock> current_time =
-                std::chrono::system_clock::now();
-        return serializeTimePoint(current_time, "%H:%M:%S");
+        return canAcceptInput() && pendingInteractions.empty();
     }
 
-    std::string getLogFileName()
+    // The card the cardholder taps next
+    void presentCard(sf::Uint64 cardId)
     {
-        std::chrono::time_point<std::chrono::system_clock> current_time =
-                std::chrono::system_clock::now();
-        return "log-" + serializeTimePoint(current_time, "%Y.%m.%d-%H.%M.%S") + ".txt";
+        presentedCard = cardId;
+        cardHeld = true;
     }
 
-    void logMsg(std::string str)
+    void press(int clickableObjectCode)
     {
-        std::cout << str << std::endl;
-        log << str << std::endl;
-        oss.str("");
-        oss.clear();
+        pendingInteractions.push_back(PendingInteraction { clickableObjectCode, scrState, voicePool.getTime() });
     }
 
-    void terminate()
+    const TransactionStats& getTransactionStats() const
     {
-        oss << getTimeCli() << "The ATM is now powered off"; logMsg(oss.str());
-        if (log.is_open())
-            log.close();
-#ifdef TARGET_ANDROID
-        androidGlue.release();
-#endif
-        system("pause");
+        return transactionStats;
     }
 
-    void initSfText(sf::Text *pText, const std::string msg, float posX, float posY, unsigned int charSize, const sf::Color colorFill, const sf::Color colorOutline, const sf::Uint32 style)
+    // Serves the ledger to terminals started with "--connect" until the process is killed
+    bool runHost(unsigned short int port)
     {
-        pText->setPosition(posX, posY);
-        pText->setString(msg);
-        pText->setCharacterSize(charSize);
-        pText->setFillColor(colorFill);
-        pText->setOutlineColor(colorOutline);
-        pText->setStyle(style);
+        if (port == 0)
+            port = DEFAULT_HOST_PORT;
+        openResources();
+        loadDatabase();
+        if (!ledger.openCardStatuses(CARD_STATUS_JOURNAL))
+        {
+            std::cerr << "Could not open " << CARD_STATUS_JOURNAL << std::endl;
+            return false;
+        }
+        if (!ledger.openTransactionJournal(TRANSACTION_JOURNAL))
+        {
+            std::cerr << "Could not open " << TRANSACTION_JOURNAL << std::endl;
+            return false;
+        }
+        AtmHost host(ledger);
+        if (!host.listen(port))
+        {
+            std::cerr << "Could not listen on port " << port << std::endl;
+            return false;
+        }
+        oss << getTimeCli() << "Host listening on port " << port; logMsg(oss.str());
+        sf::Clock statsClock;
+        while (true)
+        {
+            host.poll(HOST_POLL_TIMEOUT);
+            for (const Ledger::Shortfall& shortfall : ledger.takeShortfalls())
+            {
+                oss << getTimeCli() << "RECONCILIATION: offline withdrawal " << shortfall.transactionId << " left " << shortfall.iban
+                    << " short by " << shortfall.amount << " RON"; logMsg(oss.str());
+            }
+            if (statsClock.getElapsedTime() >= HOST_STATS_INTERVAL)
+            {
+                oss << getTimeCli() << host.getConnectionCount() << " terminals connected (peak " << host.getPeakConnectionCount()
+                    << "), " << host.getRequestsServed() << " requests served, " << ledger.getReplayCount() << " retries answered from the dedup table, "
+                    << ledger.getSuspendedCardCount() << " cards suspended";
+                if (ledger.getDedupEarlyEvictions() > 0)
+                    oss << " (" << ledger.getDedupEarlyEvictions() << " evicted within the window, the table is too small)";
+                if (host.getConnectionsRefused() > 0)
+                    oss << ", " << host.getConnectionsRefused() << " terminals refused (select is full)";
+                logMsg(oss.str());
+                statsClock.restart();
+            }
+        }
+        return true;
     }
 
-    inline std::string res(std::string generalPath)
+    // Starts a host on loopback in this process and drives it with many terminals at once
+    bool loadTestHost(size_t terminalCount, size_t rounds)
     {
-        return getResFilePath(generalPath);
+        openResources();
+        loadDatabase();
+        raiseOpenFileLimit();
+        LoopbackHost host(ledger);
+        if (!host.start())
+        {
+            std::cerr << "Could not start the host" << std::endl;
+            return false;
+        }
+        size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+        HostLoadTest::Result result = HostLoadTest::run(sf::IpAddress::LocalHost, host.getPort(), terminalCount, rounds,
+                                                        ledger.getIbans(), threadCount);
+        host.stop();
+
+        double seconds = std::max(result.elapsed.asSeconds(), 0.001f);
+        std::cout << result.terminalsConnected << "/" << terminalCount << " terminals connected, "
+                  << result.requestsAnswered << " requests answered, " << result.requestsFailed << " failed" << std::endl;
+        std::cout << "Throughput: " << (unsigned long long int) (result.requestsAnswered / seconds) << " requests/s over "
+                  << result.elapsed.asMilliseconds() << " ms" << std::endl;
+        std::cout << "Latency: p50 " << HostLoadTest::getPercentile(result.latencies, 0.50f) << " us, p99 "
+                  << HostLoadTest::getPercentile(result.latencies, 0.99f) << " us, max "
+                  << HostLoadTest::getPercentile(result.latencies, 1.0f) << " us" << std::endl;
+        return result.terminalsConnected == terminalCount && result.requestsFailed == 0;
     }
 
-    inline std::string getResFilePath(std::string generalPath)
+    // Times the wire codec, then round trips to a host on loopback, one request at a time and pipelined
+    bool benchmarkProtocol()
     {
-#ifdef TARGET_ANDROID
-        return generalPath;
-#endif
-        return "res/" + generalPath;
+        openResources();
+        loadDatabase();
+        std::vector<std::string> ibans = ledger.getIbans();
+        const int CODEC_ITERATIONS = 1000000;
+        const int WARM_UP_ROUND_TRIPS = 1000, ROUND_TRIPS = 20000;
+        const sf::Uint32 PIPELINED_REQUESTS = 200000, PIPELINE_DEPTH = 32;
+        auto report = [](const char* name, sf::Time time, int iterations) -> void {
+            std::cout << std::left << std::setw(18) << name << std::right << std::fixed << std::setprecision(1)
+                      << time.asMicroseconds() * 1000.0 / iterations << " ns" << std::endl;
+        };
+
+        //- Codec
+        TransactionRequest request { TransactionType::WITHDRAWAL, ibans.front(), 0, 10 };
+        TransactionResponse response;
+        response.approved = true;
+        response.balance = 1000;
+        response.iban = ibans.front();
+        response.lastName = "Placeholder";
+        response.firstName = "Client";
+        char requestFrame[TransactionCodec::REQUEST_FRAME_SIZE];
+        char responseFrame[TransactionCodec::RESPONSE_FRAME_SIZE];
+        TransactionRequest decodedRequest;
+        TransactionResponse decodedResponse;
+        sf::Uint32 id = 0;
+        unsigned long long int checksum = 0;     // Printed, so the loops are not optimized away
+        sf::Clock clock;
+        for (int i = 0; i < CODEC_ITERATIONS; i++)
+        {
+            TransactionCodec::encodeRequest(i, request, requestFrame);
+            checksum += requestFrame[TransactionCodec::LENGTH_PREFIX_SIZE];
+        }
+        report("encode request", clock.restart(), CODEC_ITERATIONS);
+        for (int i = 0; i < CODEC_ITERATIONS; i++)
+        {
+            TransactionCodec::decodeRequest(requestFrame + TransactionCodec::LENGTH_PREFIX_SIZE, TransactionCodec::REQUEST_SIZE, id, decodedRequest);
+            checksum += id + decodedRequest.amount;
+        }
+        report("decode request", clock.restart(), CODEC_ITERATIONS);
+        for (int i = 0; i < CODEC_ITERATIONS; i++)
+        {
+            TransactionCodec::encodeResponse(i, response, responseFrame);
+            checksum += responseFrame[TransactionCodec::LENGTH_PREFIX_SIZE];
+        }
+        report("encode response", clock.restart(), CODEC_ITERATIONS);
+        for (int i = 0; i < CODEC_ITERATIONS; i++)
+        {
+            TransactionCodec::decodeResponse(responseFrame + TransactionCodec::LENGTH_PREFIX_SIZE, TransactionCodec::RESPONSE_SIZE, id, decodedResponse);
+            checksum += id + decodedResponse.balance;
+        }
+        report("decode response", clock.restart(), CODEC_ITERATIONS);
+        std::cout << "(checksum " << checksum << ")" << std::endl;
+
+        //- Loopback round trips
+        LoopbackHost host(ledger);
+        TransactionClient client;
+        if (!host.start() || !client.connect(sf::IpAddress::LocalHost, host.getPort(), sf::seconds(5)))
+        {
+            std::cerr << "Could not connect to the host" << std::endl;
+            return false;
+        }
+        TransactionRequest inquiry { TransactionType::BALANCE_INQUIRY, ibans.front(), 0, 0 };
+        std::vector<sf::Int64> roundTrips;
+        for (int i = 0; i < WARM_UP_ROUND_TRIPS + ROUND_TRIPS; i++)
+        {
+            sf::Clock roundTrip;
+            if (!client.send(i, inquiry) || client.receive(id, decodedResponse) != sf::Socket::Done || id != (sf::Uint32) i)
+            {
+                std::cerr << "The host did not answer" << std::endl;
+                return false;
+            }
+            if (i >= WARM_UP_ROUND_TRIPS)
+                roundTrips.push_back(roundTrip.getElapsedTime().asMicroseconds());
+        }
+        std::sort(roundTrips.begin(), roundTrips.end());
+        std::cout << "Round trip: p50 " << HostLoadTest::getPercentile(roundTrips, 0.50f) << " us, p99 "
+                  << HostLoadTest::getPercentile(roundTrips, 0.99f) << " us, max "
+                  << HostLoadTest::getPercentile(roundTrips, 1.0f) << " us" << std::endl;
+
+        // The host answers a connection's requests in order, so the ids come back in sequence
+        sf::Uint32 sent = 0, received = 0;
+        clock.restart();
+        while (received < PIPELINED_REQUESTS)
+        {
+            while (sent < PIPELINED_REQUESTS && sent - received < PIPELINE_DEPTH)
+                if (!client.send(sent++, inquiry)) return false;
+            if (client.receive(id, decodedResponse) != sf::Socket::Done || id != received++)
+            {
+                std::cerr << "The host did not answer" << std::endl;
+                return false;
+            }
+        }
+        sf::Time elapsed = clock.getElapsedTime();
+        std::cout << "Pipelined (" << PIPELINE_DEPTH << " in flight): " << (unsigned long long int) (PIPELINED_REQUESTS / std::max(elapsed.asSeconds(), 0.001f))
+                  << " requests/s" << std::endl;
+        return true;
     }
 
-    void handleTimedAction(sf::Time duration, std::function<void()> action)
+    // Times the dedup table as the ledger uses it, with half of the deposits and withdrawals being retries of one
+    //  from the last 20 (simulated) seconds, on a table much larger than the caches
+    bool benchmarkDedup()
     {
-        if (actionTimer == nullptr)
+        const unsigned int BUCKET_BITS = 17;                   // 786432 entries, 16 MB
+        const size_t TERMINALS = 1000;
+        const size_t TRANSACTIONS = 4000000;
+        const size_t TRANSACTIONS_PER_MILLISECOND = 10;        // Simulated time: about 150000 distinct ids per window
+        const size_t RETRY_DISTANCE = 100000;                  // A retry repeats one of the last this many distinct ids
+        const float DUPLICATE_RATE = 0.5f;
+        const sf::Time WINDOW = sf::seconds(30);
+
+        //- The ids are drawn first, so only the table is timed
+        std::mt19937 random(1);
+        std::uniform_real_distribution<float> chance(0.f, 1.f);
+        std::vector<TransactionIdSource> terminals(TERMINALS);
+        std::vector<sf::Uint64> distinct;
+        std::vector<sf::Uint64> ids;
+        distinct.reserve(TRANSACTIONS);
+        ids.reserve(TRANSACTIONS);
+        size_t retries = 0;
+        for (size_t i = 0; i < TRANSACTIONS; i++)
         {
-            actionTimer = new ActionTimer(duration, [this, action]() -> void {
-                action();
-                delete actionTimer;
-                actionTimer = nullptr;
+            if (!distinct.empty() && chance(random) < DUPLICATE_RATE)
+            {
+                size_t recent = std::min(distinct.size(), RETRY_DISTANCE);
+                ids.push_back(distinct[distinct.size() - 1 - random() % recent]);
+                retries++;
+            }
+            else
+            {
+                distinct.push_back(terminals[random() % TERMINALS].next());
+                ids.push_back(distinct.back());
+            }
+        }
+
+        //- Lookup, and insert when the id is new
+        DedupTable table(WINDOW, BUCKET_BITS);
+        size_t found = 0;
+        unsigned long long int checksum = 0;     // Printed, so the loops are not optimized away
+        DedupTable::Result result;
+        sf::Clock clock;
+        for (size_t i = 0; i < TRANSACTIONS; i++)
+        {
+            sf::Uint32 now = static_cast<sf::Uint32>(i / TRANSACTIONS_PER_MILLISECOND);
+            if (table.find(ids[i], now, result))
+            {
+                found++;
+                checksum += result.balance;
+            }
+            else
+                table.insert(ids[i], now, DedupTable::Result { true, i });
+        }
+        sf::Time elapsed = clock.getElapsedTime();
+
+        //- Lookups alone, on the filled table
+        sf::Uint32 end = static_cast<sf::Uint32>(TRANSACTIONS / TRANSACTIONS_PER_MILLISECOND);
+        clock.restart();
+        for (size_t i = 0; i < TRANSACTIONS; i++)
+            if (table.find(ids[i], end, result))
+                checksum += result.balance;
+        sf::Time lookupElapsed = clock.getElapsedTime();
+
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << TRANSACTIONS << " transactions, " << retries << " retries (" << 100.f * retries / TRANSACTIONS
+                  << "%), table of " << table.getCapacity() << " entries" << std::endl;
+        std::cout << "Lookup and insert: " << elapsed.asMicroseconds() * 1000.0 / TRANSACTIONS << " ns per transaction" << std::endl;
+        std::cout << "Lookup alone:      " << lookupElapsed.asMicroseconds() * 1000.0 / TRANSACTIONS << " ns" << std::endl;
+        std::cout << found << "/" << retries << " retries recognized, " << table.getEarlyEvictions()
+                  << " entries evicted within the window (checksum " << checksum << ")" << std::endl;
+        return true;
+    }
+
+    // Runs a store-and-forward core against a host on loopback and takes the host away: the cards are verified
+    //  online, transacted on while the host is paused (silent, so the first request has to run into its deadline;
+    //  the host applies it on resume, and its advice must not be applied again), the core is restarted from its journal, and once the host
+    //  is back the queue has to drain into the host's ledger. Prints the queue metrics.
+    bool testOffline()
+    {
+        const std::string journalPath = "offline_test_queue.txt";
+        const size_t OFFLINE_TRANSACTIONS = 1000;    // Cards in turn, each with a deposit of 2 and a withdrawal of 1 in turn
+        const sf::Time DRAIN_TIMEOUT = sf::seconds(30);
+        loadAccounts();
+        std::vector<LedgerAccount> accounts = ledger.getAccounts();
+        LoopbackHost host(ledger);
+        if (!host.start())
+        {
+            std::cerr << "Could not start the host" << std::endl;
+            return false;
+        }
+        std::remove(journalPath.c_str());
+        std::unique_ptr<StoreAndForwardCore> core(new StoreAndForwardCore(sf::IpAddress::LocalHost.toString(), host.getPort(),
+                                                                          HOST_CONNECT_TIMEOUT, HOST_REQUEST_TIMEOUT, journalPath, OFFLINE_POLICY));
+        core->start();
+        auto call = [&core](const TransactionRequest& request) -> TransactionResponse {
+            TransactionResponse answer;
+            bool answered = false;
+            core->request(request, [&answer, &answered](const TransactionResponse& response) -> void {
+                answer = response;
+                answered = true;
             });
+            while (!answered)
+                if (core->dispatchCompletions() == 0)
+                    sf::sleep(sf::milliseconds(1));
+            return answer;
+        };
+        auto fail = [](const char* reason) -> bool {
+            std::cerr << "Offline test failed: " << reason << std::endl;
+            return false;
+        };
+
+        //- Online: the core remembers the cards it sees verified (an account without a card is verified by its PIN
+        //   alone, and a PIN shared by two of those verifies the first). The last card is never verified here.
+        std::vector<LedgerAccount> cards;
+        std::map<std::string, unsigned long long int> expectedBalances;
+        std::set<unsigned short int> pins;
+        LedgerAccount unseen {};
+        for (std::vector<LedgerAccount>::reverse_iterator account = accounts.rbegin(); account != accounts.rend() && unseen.cardId == 0; ++account)
+            unseen = *account;
+        for (const LedgerAccount& account : accounts)
+        {
+            expectedBalances[account.iban] = account.balance;
+            pins.insert(account.pin);
+            if (account.cardId != 0 && account.cardId == unseen.cardId) continue;
+            TransactionResponse response = call(TransactionRequest { TransactionType::PIN_VERIFY, "", account.pin, 0, 0, account.cardId });
+            if (!response.approved || response.standIn) return fail("the host did not verify a PIN");
+            if (response.iban == account.iban)
+                cards.push_back(account);
+        }
+        if (cards.empty()) return fail("there are no accounts to test with");
+
+        //- Offline
+        host.pause();
+        TransactionIdSource transactionIds;
+        sf::Clock offlineClock;
+        sf::Time deadlineTime;
+        for (size_t i = 0; i < OFFLINE_TRANSACTIONS; i++)
+        {
+            const LedgerAccount& card = cards[i % cards.size()];
+            bool deposit = (i / cards.size()) % 2 == 0;
+            TransactionResponse response = call(TransactionRequest { deposit ? TransactionType::DEPOSIT : TransactionType::WITHDRAWAL,
+                                                                     card.iban, 0, deposit ? 2u : 1u, transactionIds.next() });
+            if (i == 0)
+            {
+                deadlineTime = offlineClock.getElapsedTime();
+                if (deadlineTime > HOST_REQUEST_TIMEOUT + sf::seconds(1)) return fail("a request to the silent host outlived its deadline");
+                if (core->isHostReachable()) return fail("the silent host is still counted as reachable");
+            }
+            if (!response.standIn || !response.approved) return fail("a transaction was not approved offline");
+            if (deposit)
+                expectedBalances[card.iban] += 2;
+            else
+                expectedBalances[card.iban] -= 1;
+        }
+        sf::Time offlineTime = offlineClock.getElapsedTime();
+        TransactionResponse response = call(TransactionRequest { TransactionType::WITHDRAWAL, cards.front().iban, 0, OFFLINE_POLICY.withdrawalLimit + 1 });
+        if (!response.standIn || response.approved) return fail("a withdrawal over the offline limit was approved");
+        const LedgerAccount& first = cards.front();
+        unsigned short int wrongPin = (first.pin + 1) % 10000;
+        while (first.cardId == 0 && pins.count(wrongPin) > 0)
+            wrongPin = (wrongPin + 1) % 10000;
+        response = call(TransactionRequest { TransactionType::PIN_VERIFY, "", wrongPin, 0, 0, first.cardId });
+        if (!response.standIn || response.approved) return fail("a wrong PIN was verified offline");
+        // The right PIN of a card this terminal never saw verified is declined, but neither counted nor forwarded
+        for (unsigned int i = 0; unseen.cardId != 0 && i < OFFLINE_POLICY.maxWrongPins; i++)
+        {
+            response = call(TransactionRequest { TransactionType::PIN_VERIFY, "", unseen.pin, 0, 0, unseen.cardId });
+            if (!response.standIn || response.approved || !response.unknownOffline || response.cardSuspended)
+                return fail("a card never seen verified was not declined as unknown offline");
         }
+        size_t advices = OFFLINE_TRANSACTIONS + (first.cardId != 0 ? 1 : 0);    // The wrong PIN is forwarded too
+        if (core->getQueueMetrics().depth != advices) return fail("the queue does not hold every offline transaction");
+
+        //- Restart the terminal while the host is still away: the queue comes back from the journal
+        core.reset();
+        core.reset(new StoreAndForwardCore(sf::IpAddress::LocalHost.toString(), host.getPort(), HOST_CONNECT_TIMEOUT, HOST_REQUEST_TIMEOUT,
+                                                   journalPath, OFFLINE_POLICY));
+        core->start();
+        if (core->getQueueMetrics().depth != advices) return fail("the queue was not restored from its journal");
+
+        //- Back online
+        sf::Clock drainClock;
+        host.resume();
+        while (core->getQueueMetrics().depth > 0 && drainClock.getElapsedTime() < DRAIN_TIMEOUT)
+            sf::sleep(sf::milliseconds(1));
+        sf::Time drainTime = drainClock.getElapsedTime();
+        OfflineQueue::Metrics metrics = core->getQueueMetrics();
+        core.reset();
+        host.stop();
+        std::remove(journalPath.c_str());
+
+        std::cout << "The first request to the silent host stood in after " << deadlineTime.asMilliseconds() << " ms" << std::endl;
+        std::cout << OFFLINE_TRANSACTIONS << " transactions approved offline in " << offlineTime.asMilliseconds() << " ms" << std::endl;
+        std::cout << "Queue after the restart: " << advices << " waiting, drained " << drainTime.asMilliseconds()
+                  << " ms after the host came back" << std::endl;
+        std::cout << "Forwarded " << metrics.forwarded << " (" << metrics.rejected << " rejected, " << metrics.replayed << " already applied by the host) at "
+                  << (unsigned long long int) metrics.getDrainRate() << " advices/s while forwarding" << std::endl;
+        if (metrics.depth > 0) return fail("the queue did not drain");
+        for (const LedgerAccount& account : ledger.getAccounts())
+            if (account.balance != expectedBalances[account.iban]) return fail("the host's balances do not match the offline transactions");
+        std::cout << "The host's balances match" << std::endl;
+        if (first.cardId != 0 && ledger.getWrongPinCount(first.cardId) != 1) return fail("the host did not count the offline wrong PIN");
+        if (unseen.cardId != 0 && ledger.getWrongPinCount(unseen.cardId) != 0) return fail("the host counted the PIN of a card unknown offline");
+        return true;
     }
 
-    void vibrate(VibrationDuration vibrationDuration)
+    // "address[:port]"; run() then authorizes every transaction against that host
+    void connectToHost(const std::string& host)
     {
-#ifdef TARGET_ANDROID
-        androidGlue.vibrate(vibrationDuration);
-#endif
+        size_t colon = host.find(':');
+        hostAddress = host.substr(0, colon);
+        hostPort = colon == std::string::npos ? DEFAULT_HOST_PORT : (unsigned short int) std::atoi(host.c_str() + colon + 1);
     }
 
-public:
     void run()
     {
+        TRACE_THREAD_NAME("main");
         init();
-        while (window.isOpen())
+        while (window->isOpen())
         {
             sf::Time deltaTime = frameDeltaClock.restart();
-            handleEvents();
-            handleActionTimer();
-            if (windowHasFocus)
+            if (runFrame(deltaTime))
+                framesDrawn++;
+            else if (windowHasFocus)
             {
-                update(deltaTime);
-                render(window);
+                framesSkipped++;
+                sf::sleep(IDLE_POLL_INTERVAL);
             }
             else
-                sf::sleep(sf::milliseconds(16));
+            {
+                framesUnfocused++;
+                sf::sleep(UNFOCUSED_POLL_INTERVAL);
+            }
+            if (renderStatsClock.getElapsedTime() >= RENDER_STATS_INTERVAL)
+                logRenderStats();
+            if (storeAndForward != nullptr && offlineStatsClock.getElapsedTime() >= OFFLINE_STATS_INTERVAL)
+                logOfflineQueue();
         }
         terminate();
     }
 };
 
-int main()
+// Plays cardholders on a headless terminal, one session after another: card in, PIN, one to three transactions
+//  (withdrawals, deposits and balance inquiries, some with a receipt), card out. It pauses between presses like a
+//  person would, on the terminal's clock.
+class VirtualCardholder
+{
+private:
+    Atm& atm;
+    const std::vector<LedgerAccount>& accounts;
+    std::mt19937 random;
+    size_t sessionsLeft;
+    const LedgerAccount* account = nullptr;    // Set during a session
+    int transactionsLeft = 0;
+    std::deque<int> presses;                   // Planned for the current screen
+    unsigned short int currentState = 0;
+    int pressesOnScreen = 0;
+    sf::Time nextPressAt;
+    const int MAX_PRESSES_PER_SCREEN = 20;     // More than that and the session is stuck, so it is canceled
+
+    //- Clickable object codes
+    const int DIGIT_CODES[10] = { 15, 9, 12, 16, 10, 13, 17, 11, 14, 18 };
+    enum Button
+    {
+        YES = 1,                               // L1
+        WITHDRAW = 1,
+        DEPOSIT = 5,
+        BALANCE = 7,
+        NO = 7,                                // R3
+        OK = 20,
+        CARD = 21,
+        CASH_LARGE = 22,
+        CASH_SMALL = 23,
+        RECEIPT = 24,
+        CANCEL = 25
+    };
+
+    int pick(int from, int to)
+    {
+        return std::uniform_int_distribution<int>(from, to)(random);
+    }
+
+    // digitCount pads with leading zeros (PINs); 0 types just the significant digits (amounts)
+    void type(unsigned int number, int digitCount)
+    {
+        std::string digits = std::to_string(number);
+        if ((int) digits.size() < digitCount)
+            digits.insert(0, digitCount - digits.size(), '0');
+        for (char digit : digits)
+            presses.push_back(DIGIT_CODES[digit - '0']);
+        presses.push_back(Button::OK);
+    }
+
+    void askForReceipt()
+    {
+        presses.push_back(pick(0, 2) == 0 ? Button::YES : Button::NO);
+    }
+
+    void plan()
+    {
+        switch (currentState)
+        {
+        case 1: //- Insert card: the previous session is over
+            if (account != nullptr)
+            {
+                sessionsCompleted++;
+                account = nullptr;
+            }
+            if (sessionsLeft == 0) return;
+            sessionsLeft--;
+            {
+                account = &accounts[pick(0, (int) accounts.size() - 1)];
+                atm.presentCard(account->cardId);
+            }
+            transactionsLeft = pick(1, 3);
+            presses.push_back(Button::CARD);
+            break;
+        case 2: //- PIN: one in 50 is mistyped, so now and then a card is suspended
+            type(pick(0, 49) == 0 ? (account->pin + 1) % 10000 : account->pin, 4);
+            break;
+        case 3: //- Main menu
+        {
+            transactionsLeft--;
+            int choice = pick(0, 99);
+            presses.push_back(choice < 45 ? Button::WITHDRAW : choice < 75 ? Button::DEPOSIT : Button::BALANCE);
+            break;
+        }
+        case 4: //- Withdrawal amount
+            type(10 * pick(1, 40), 0);
+            break;
+        case 11: //- Deposit amount
+            type(10 * pick(1, 100), 0);
+            break;
+        case 5: case 12: //- Confirm
+            presses.push_back(Button::YES);
+            break;
+        case 13: //- Insert cash
+            presses.push_back(Button::CASH_SMALL);
+            break;
+        case 7: //- Take the cash, then receipt?
+            presses.push_back(Button::CASH_LARGE);
+            askForReceipt();
+            break;
+        case 14: case 18: //- Receipt?
+            askForReceipt();
+            break;
+        case 8: case 15: case 19: //- Take the receipt, then another transaction?
+            presses.push_back(Button::RECEIPT);
+            presses.push_back(transactionsLeft > 0 ? Button::YES : Button::NO);
+            break;
+        case 10: //- Not enough funds
+            presses.push_back(Button::CANCEL);
+            break;
+        case 21: case 22: case 25: case 26: //- Wrong PIN, account suspended, device fault, card unavailable offline
+            presses.push_back(Button::OK);
+            break;
+        }
+    }
+
+public:
+    unsigned long long int sessionsCompleted = 0;
+    unsigned long long int sessionsCanceled = 0;   // Stuck on a screen
+
+    VirtualCardholder(Atm& atm, const std::vector<LedgerAccount>& accounts, size_t sessions, unsigned int seed)
+        : atm(atm), accounts(accounts), random(seed), sessionsLeft(sessions) {}
+
+    bool isDone() const
+    {
+        return sessionsLeft == 0 && account == nullptr;
+    }
+
+    // After each frame of the terminal
+    void act()
+    {
+        sf::Time now = atm.getTerminalTime();
+        if (atm.getScreenState() != currentState)
+        {
+            currentState = atm.getScreenState();
+            pressesOnScreen = 0;
+            presses.clear();
+        }
+        if (!atm.isWaitingForInput() || now < nextPressAt) return;
+        if (pressesOnScreen >= MAX_PRESSES_PER_SCREEN && presses.empty())
+        {
+            sessionsCanceled++;
+            presses.push_back(Button::CANCEL);
+        }
+        if (presses.empty())
+            plan();
+        if (presses.empty()) return;
+        bool digit = presses.size() > 1;
+        atm.press(presses.front());
+        presses.pop_front();
+        pressesOnScreen++;
+        nextPressAt = now + sf::milliseconds(digit ? pick(150, 450) : pick(600, 2000));
+    }
+};
+
+// Runs headless terminals with a virtual cardholder each against one ledger, in this process or through a host on
+//  loopback. The terminals are stepped on a few threads with simulated frames, as fast as they go, so the numbers
+//  show how much load the ledger or the host can take rather than how long the sessions take.
+class TerminalFleet
+{
+private:
+    struct Terminal
+    {
+        std::unique_ptr<Atm> atm;
+        std::unique_ptr<VirtualCardholder> cardholder;
+    };
+
+    static const sf::Int64 FRAME_MICROSECONDS = 16667;
+
+    static void drive(std::vector<Terminal>& terminals, size_t first, size_t step)
+    {
+        bool running = true;
+        while (running)
+        {
+            running = false;
+            for (size_t i = first; i < terminals.size(); i += step)
+            {
+                if (terminals[i].cardholder->isDone()) continue;
+                running = true;
+                terminals[i].atm->stepHeadless(sf::microseconds(FRAME_MICROSECONDS));
+                terminals[i].cardholder->act();
+            }
+        }
+    }
+
+public:
+    static bool run(Ledger& ledger, size_t terminalCount, size_t sessionsPerTerminal, bool loopback)
+    {
+        std::vector<LedgerAccount> accounts = ledger.getAccounts();
+        std::unique_ptr<LoopbackHost> host;
+        if (loopback)
+        {
+            raiseOpenFileLimit();
+            host.reset(new LoopbackHost(ledger));
+            if (!host->start())
+            {
+                std::cerr << "Could not start the host" << std::endl;
+                return false;
+            }
+        }
+
+        std::vector<Terminal> terminals(terminalCount);
+        for (size_t i = 0; i < terminalCount; i++)
+        {
+            terminals[i].atm.reset(new Atm());
+            if (loopback)
+                terminals[i].atm->initHeadless(new RemoteTransactionCore(sf::IpAddress::LocalHost.toString(), host->getPort(), sf::seconds(5), sf::seconds(5)));
+            else
+                terminals[i].atm->initHeadless(new LocalTransactionCore(ledger, sf::Time::Zero));
+            terminals[i].cardholder.reset(new VirtualCardholder(*terminals[i].atm, accounts, sessionsPerTerminal, (unsigned int) i));
+        }
+
+        size_t threadCount = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), std::max<size_t>(terminalCount, 1));
+        std::vector<std::thread> threads;
+        sf::Clock clock;
+        for (size_t t = 0; t < threadCount; t++)
+            threads.push_back(std::thread(&TerminalFleet::drive, std::ref(terminals), t, threadCount));
+        for (std::thread& thread : threads)
+            thread.join();
+        sf::Time elapsed = clock.getElapsedTime();
+        if (host)
+            host->stop();
+
+        unsigned long long int sessions = 0, canceled = 0, declined = 0, unanswered = 0;
+        sf::Time simulated;
+        std::vector<sf::Int64> latencies;
+        for (Terminal& terminal : terminals)
+        {
+            sessions += terminal.cardholder->sessionsCompleted;
+            canceled += terminal.cardholder->sessionsCanceled;
+            simulated += terminal.atm->getTerminalTime();
+            const TransactionStats& stats = terminal.atm->getTransactionStats();
+            declined += stats.declined;
+            unanswered += stats.unanswered;
+            latencies.insert(latencies.end(), stats.latencies.begin(), stats.latencies.end());
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        double seconds = std::max(elapsed.asSeconds(), 0.001f);
+        double transactions = (double) std::max<size_t>(latencies.size(), 1);
+        std::cout << terminalCount << " terminals (" << (loopback ? "host on loopback" : "ledger in process") << "), "
+                  << sessions << " sessions in " << elapsed.asMilliseconds() << " ms on " << threadCount << " threads" << std::endl;
+        std::cout << "Sessions: " << std::fixed << std::setprecision(1) << sessions / seconds << "/s, "
+                  << simulated.asSeconds() / std::max<unsigned long long int>(sessions, 1) << " simulated seconds each, "
+                  << canceled << " canceled, " << ledger.getSuspendedCardCount() << " cards suspended" << std::endl;
+        std::cout << "Transactions: " << latencies.size() << " (" << latencies.size() / seconds << "/s), "
+                  << std::setprecision(2) << 100.0 * declined / transactions << "% declined, "
+                  << 100.0 * unanswered / transactions << "% unanswered" << std::endl;
+        std::cout << "Latency: p50 " << HostLoadTest::getPercentile(latencies, 0.50f) << " us, p99 "
+                  << HostLoadTest::getPercentile(latencies, 0.99f) << " us, max "
+                  << HostLoadTest::getPercentile(latencies, 1.0f) << " us" << std::endl;
+        return canceled == 0 && unanswered == 0;
+    }
+};
+
+int main(int argc, char** argv)
 {
     Atm atm;
+    if (argc > 1 && std::string(argv[1]) == "--bake-font")
+        return atm.bakeFont() ? 0 : 1;
+    if (argc > 1 && std::string(argv[1]) == "--pack-resources")
+        return atm.packResources() ? 0 : 1;
+    if (argc > 1 && std::string(argv[1]) == "--embed-resources")
+        return atm.embedResources(argc > 2 ? argv[2] : "") ? 0 : 1;
+    if (argc > 1 && std::string(argv[1]) == "--host")
+        return atm.runHost(argc > 2 ? (unsigned short int) std::atoi(argv[2]) : 0) ? 0 : 1;
+    if (argc > 1 && std::string(argv[1]) == "--bench-protocol")
+        return atm.benchmarkProtocol() ? 0 : 1;
+    if (argc > 1 && std::string(argv[1]) == "--bench-dedup")
+        return atm.benchmarkDedup() ? 0 : 1;
+    if (argc > 1 && std::string(argv[1]) == "--offline-test")
+        return atm.testOffline() ? 0 : 1;
+    if (argc > 1 && std::string(argv[1]) == "--load-test")
+        return atm.loadTestHost(argc > 2 ? std::atoi(argv[2]) : 2000, argc > 3 ? std::atoi(argv[3]) : 30) ? 0 : 1;
+    if (argc > 1 && std::string(argv[1]) == "--fleet")
+    {
+        size_t terminals = argc > 2 ? std::atoi(argv[2]) : 0;
+        size_t sessions = argc > 3 ? std::atoi(argv[3]) : 0;
+        bool loopback = std::find(argv + 2, argv + argc, std::string("--loopback")) != argv + argc;
+        return TerminalFleet::run(atm.loadAccounts(), terminals > 0 ? terminals : 200, sessions > 0 ? sessions : 5, loopback) ? 0 : 1;
+    }
+    if (argc > 2 && std::string(argv[1]) == "--connect")
+        atm.connectToHost(argv[2]);
+    char** card = std::find(argv + 1, argv + argc, std::string("--card"));
+    if (card != argv + argc && card + 1 != argv + argc)
+        atm.presentCard(std::strtoull(card[1], nullptr, 10));
     atm.run();
     return 0;
 }